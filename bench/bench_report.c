@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Summarizes a benchmark run for run_bench.sh. Reads lines of
+ *
+ *	<label> <end to end latency in ns> <ecfs file>
+ *
+ * from stdin and for every label prints the latency percentiles, the
+ * capture throughput (core bytes / latency) and, from each file's
+ * .ecfs_stats, the per stage wall time percentiles and peak RSS.
+ */
+
+#include <stdio.h>
+#include "../libecfs/include/libecfs.h"
+
+#define MAX_RUNS 4096
+#define MAX_STAGES 32
+
+struct run {
+	char label[64];
+	uint64_t latency_ns;
+	uint64_t core_bytes;
+	int nstats;
+	ecfs_stat_t stats[MAX_STAGES];
+};
+
+static struct run runs[MAX_RUNS];
+static int nruns;
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Nearest rank percentile of a sorted array
+ */
+static uint64_t pct(const uint64_t *v, int n, int p)
+{
+	int rank = (p * n + 99) / 100;
+
+	return n == 0 ? 0 : v[rank > 0 ? rank - 1 : 0];
+}
+
+static int load_run(struct run *r, const char *path)
+{
+	ecfs_elf_t *desc;
+	ecfs_stat_t *stats;
+	int i, n;
+
+	/*
+	 * load_ecfs_file() exits if it can't open the file
+	 */
+	if (access(path, R_OK) < 0 || (desc = load_ecfs_file(path)) == NULL)
+		return -1;
+	n = get_ecfs_stats(desc, &stats);
+	if (n < 0) {
+		unload_ecfs_file(desc);
+		return -1;
+	}
+	r->nstats = n > MAX_STAGES ? MAX_STAGES : n;
+	memcpy(r->stats, stats, r->nstats * sizeof(ecfs_stat_t));
+	for (i = 0; i < r->nstats; i++)
+		if (!strcmp(r->stats[i].name, "core"))
+			r->core_bytes = r->stats[i].bytes_read;
+	free(stats);
+	unload_ecfs_file(desc);
+	return 0;
+}
+
+static void report(const char *label)
+{
+	static uint64_t v[MAX_RUNS];
+	uint64_t rss;
+	int i, s, n, nstages = 0;
+	double mbs;
+
+	for (n = 0, i = 0; i < nruns; i++) {
+		if (strcmp(runs[i].label, label))
+			continue;
+		v[n++] = runs[i].latency_ns;
+		if (runs[i].nstats > nstages)
+			nstages = runs[i].nstats;
+	}
+	qsort(v, n, sizeof(v[0]), cmp_u64);
+	printf("%s: %d runs\n", label, n);
+	printf("\tlatency ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+	    pct(v, n, 50) / 1e6, pct(v, n, 90) / 1e6, pct(v, n, 99) / 1e6, v[n - 1] / 1e6);
+
+	for (n = 0, i = 0; i < nruns; i++) {
+		if (strcmp(runs[i].label, label) || runs[i].latency_ns == 0)
+			continue;
+		mbs = (double)runs[i].core_bytes / (1 << 20) / (runs[i].latency_ns / 1e9);
+		v[n++] = (uint64_t)(mbs * 1000);
+	}
+	qsort(v, n, sizeof(v[0]), cmp_u64);
+	printf("\tthroughput MB/s: p50 %.1f min %.1f\n", pct(v, n, 50) / 1e3, n ? v[0] / 1e3 : 0.0);
+
+	printf("\t%-12s %-12s %-12s %s\n", "stage", "p50 ms", "p90 ms", "peak rss kB");
+	for (s = 0; s < nstages; s++) {
+		const char *name = NULL;
+
+		for (rss = 0, n = 0, i = 0; i < nruns; i++) {
+			if (strcmp(runs[i].label, label) || s >= runs[i].nstats)
+				continue;
+			if (runs[i].stats[s].name[0] == '\0')
+				continue;
+			name = runs[i].stats[s].name;
+			v[n++] = runs[i].stats[s].wall_ns;
+			if (runs[i].stats[s].peak_rss_kb > rss)
+				rss = runs[i].stats[s].peak_rss_kb;
+		}
+		if (name == NULL)
+			continue;
+		qsort(v, n, sizeof(v[0]), cmp_u64);
+		printf("\t%-12s %-12.3f %-12.3f %lu\n", name, pct(v, n, 50) / 1e6,
+		    pct(v, n, 90) / 1e6, (unsigned long)rss);
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	char line[4096], path[4096];
+	unsigned long long latency;
+	int i, j, failed = 0;
+
+	while (fgets(line, sizeof(line), stdin) != NULL && nruns < MAX_RUNS) {
+		struct run *r = &runs[nruns];
+
+		memset(r, 0, sizeof(*r));
+		if (sscanf(line, "%63s %llu %4095s", r->label, &latency, path) != 3)
+			continue;
+		r->latency_ns = latency;
+		if (load_run(r, path) < 0) {
+			fprintf(stderr, "%s: no .ecfs_stats in %s\n", r->label, path);
+			failed++;
+			continue;
+		}
+		nruns++;
+	}
+	for (i = 0; i < nruns; i++) {
+		for (j = 0; j < i; j++)
+			if (!strcmp(runs[i].label, runs[j].label))
+				break;
+		if (j == i)
+			report(runs[i].label);
+	}
+	if (failed)
+		printf("%d runs without a usable ecfs file\n", failed);
+	return nruns == 0;
+}
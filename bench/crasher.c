@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Synthetic crasher for the capture benchmarks (see run_bench.sh).
+ * Sets up a process of a given shape and then segfaults:
+ *
+ *	-t <n>	threads (parked on a barrier when the main thread crashes)
+ *	-l <n>	shared libraries, dlopen()ed from lib/libbench<i>.so
+ *	-m <mb>	heap, filled with non-zero data
+ *	-f <n>	open fds (on /dev/null)
+ *	-s <n>	connected TCP loopback socket pairs
+ *	-o <f>	write "<pid> <CLOCK_REALTIME ns>" to f right before crashing
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifndef BENCH_STATIC
+#include <dlfcn.h>
+#endif
+
+static pthread_barrier_t barrier;
+
+static void * park(void *arg)
+{
+	pthread_barrier_wait(&barrier);
+	pause();
+	return NULL;
+}
+
+static void load_libs(int count)
+{
+#ifndef BENCH_STATIC
+	char self[PATH_MAX], path[PATH_MAX + 32], *p;
+	ssize_t n;
+	int i;
+
+	if ((n = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0) {
+		perror("readlink");
+		exit(1);
+	}
+	self[n] = '\0';
+	if ((p = strrchr(self, '/')) != NULL)
+		*p = '\0';
+	for (i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/lib/libbench%d.so", self, i);
+		if (dlopen(path, RTLD_NOW) == NULL) {
+			fprintf(stderr, "dlopen %s: %s\n", path, dlerror());
+			exit(1);
+		}
+	}
+#else
+	if (count > 0)
+		fprintf(stderr, "-l is ignored by the static crasher\n");
+#endif
+}
+
+static void fill_heap(size_t mb)
+{
+	size_t i, len = mb << 20;
+	uint64_t *p, x = 0x9e3779b97f4a7c15ULL;
+
+	if (len == 0)
+		return;
+	if ((p = malloc(len)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < len / sizeof(*p); i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		p[i] = x;
+	}
+}
+
+static void open_sockets(int pairs)
+{
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	int lfd, fd, i;
+
+	if (pairs == 0)
+		return;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(lfd, pairs) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sin, &slen) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	for (i = 0; i < pairs; i++) {
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+		    connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+		    accept(lfd, NULL, NULL) < 0) {
+			perror("connect");
+			exit(1);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int threads = 0, libs = 0, fds = 0, sockets = 0, c, i;
+	size_t heap_mb = 0;
+	char *stampfile = NULL;
+	struct timespec ts;
+	pthread_t tid;
+	FILE *fp;
+
+	while ((c = getopt(argc, argv, "t:l:m:f:s:o:")) != -1) {
+		switch(c) {
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'l':
+				libs = atoi(optarg);
+				break;
+			case 'm':
+				heap_mb = strtoul(optarg, NULL, 10);
+				break;
+			case 'f':
+				fds = atoi(optarg);
+				break;
+			case 's':
+				sockets = atoi(optarg);
+				break;
+			case 'o':
+				stampfile = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-t threads] [-l libs] [-m heap_mb] [-f fds] [-s socket_pairs] [-o stampfile]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	load_libs(libs);
+	fill_heap(heap_mb);
+	for (i = 0; i < fds; i++)
+		if (open("/dev/null", O_RDONLY) < 0) {
+			perror("open");
+			exit(1);
+		}
+	open_sockets(sockets);
+
+	pthread_barrier_init(&barrier, NULL, threads + 1);
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tid, NULL, park, NULL) != 0) {
+			fprintf(stderr, "pthread_create failed after %d threads\n", i);
+			exit(1);
+		}
+	pthread_barrier_wait(&barrier);
+
+	if (stampfile != NULL) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if ((fp = fopen(stampfile, "w")) != NULL) {
+			fprintf(fp, "%d %llu\n", getpid(),
+			    (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+			fclose(fp);
+		}
+	}
+	*(volatile int *)0 = 0;
+	return 0;
+}
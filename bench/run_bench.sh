@@ -0,0 +1,148 @@
+#!/bin/bash
+#
+# ECFS capture benchmarks. Built into bin/<variant>/<bits>/bench by
+# 'make bench'; run from there.
+#
+# Live mode (root): crashes the synthetic crashers under a private
+# core_pattern that runs ecfs_handler, and reports end to end latency,
+# throughput and per stage time/peak RSS from each file's .ecfs_stats.
+#
+#	./run_bench.sh [-n runs] [-f "ecfs flags"] [-o outdir] [-R recdir] [case ...]
+#
+# A case is <binary>:<shape>, binary is one of pie, nopie, static or
+# stripped and shape one of small, threads, libs, heap or fds. With -R
+# every capture is also recorded for replay.
+#
+# Replay mode (no root needed): converts recorded captures (ecfs -R)
+# again. Use it to bisect capture regressions with any ecfs build.
+#
+#	./run_bench.sh -r recdir [-n runs] [-f "ecfs flags"] [-b ecfs] [-o outdir]
+#
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+RUNS=5
+FLAGS=""
+OUT=/tmp/ecfs_bench.$$
+REC=""
+REPLAY=""
+HANDLER=/opt/ecfs/bin/ecfs_handler
+ECFS=$HERE/../ecfs
+CONF=/opt/ecfs/ecfs_handler.conf
+CASES="pie:small pie:threads pie:libs pie:heap pie:fds nopie:small static:small stripped:small"
+
+usage() {
+	sed -n '3,/^$/s/^# \{0,1\}//p' "$0"
+	exit 1
+}
+
+while getopts "n:f:o:R:r:b:h" c; do
+	case $c in
+		n) RUNS=$OPTARG ;;
+		f) FLAGS=$OPTARG ;;
+		o) OUT=$OPTARG ;;
+		R) REC=$OPTARG ;;
+		r) REPLAY=$OPTARG ;;
+		b) ECFS=$OPTARG ;;
+		*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] && CASES="$*"
+mkdir -p "$OUT" || exit 1
+
+now_ns() {
+	date +%s%N
+}
+
+# Waits for ecfs to be done with a file: the "write" row of
+# .ecfs_stats is only filled in once everything else has finished.
+wait_for_ecfs() {
+	local i
+	for i in $(seq 600); do
+		"$HERE/../readecfs" -T "$1" 2>/dev/null | grep -q '^write ' && return 0
+		sleep 0.05
+	done
+	return 1
+}
+
+shape_args() {
+	case $1 in
+		small) echo "" ;;
+		threads) echo "-t 128" ;;
+		libs) echo "-l 32" ;;
+		heap) echo "-m 512" ;;
+		fds) echo "-f 1024 -s 64" ;;
+		*) echo "unknown shape $1" >&2; return 1 ;;
+	esac
+}
+
+binary() {
+	case $1 in
+		pie) echo crasher ;;
+		nopie) echo crasher_nopie ;;
+		static) echo crasher_static ;;
+		stripped) echo crasher_strip ;;
+		*) echo "unknown binary $1" >&2; return 1 ;;
+	esac
+}
+
+replay() {
+	local dir pid comm i start end
+	for dir in "$REPLAY"/*/; do
+		pid=$(basename "$dir")
+		[ -f "$dir/core" ] || continue
+		comm=$(cat "$dir/comm")
+		for i in $(seq "$RUNS"); do
+			start=$(now_ns)
+			if ! "$ECFS" $FLAGS -r "$REPLAY" -p "$pid" -e "$comm" -o "$OUT/replay.$pid.$i" < "$dir/core" > /dev/null; then
+				echo "replay of $pid failed (see syslog)" >&2
+				continue
+			fi
+			end=$(now_ns)
+			echo "replay:$comm.$pid $((end - start)) $OUT/replay.$pid.$i"
+		done
+	done
+}
+
+live() {
+	local c bin args i pid stamp end
+	if [ "$(id -u)" != 0 ]; then
+		echo "live benchmarks need root (core_pattern); use -r to replay recordings" >&2
+		exit 1
+	fi
+	# globals, the EXIT trap runs after we have returned
+	saved_pattern=$(cat /proc/sys/kernel/core_pattern)
+	saved_limit=$(cat /proc/sys/kernel/core_pipe_limit)
+	[ -f $CONF ] && cp $CONF "$OUT/handler.conf.saved"
+	trap 'echo "$saved_pattern" > /proc/sys/kernel/core_pattern;
+	      echo "$saved_limit" > /proc/sys/kernel/core_pipe_limit;
+	      if [ -f "$OUT/handler.conf.saved" ]; then mv "$OUT/handler.conf.saved" $CONF; else rm -f $CONF; fi' EXIT
+	# no rate limiting, and a deep enough queue for back to back crashes
+	mkdir -p "$(dirname $CONF)"
+	printf "rate_limit = 0\nmax_queued = 64\nqueue_timeout = 120\n" > $CONF
+	[ -n "$REC" ] && FLAGS="$FLAGS -R $REC"
+	echo 16 > /proc/sys/kernel/core_pipe_limit
+	echo "|$HANDLER $FLAGS -e %e -p %p -o $OUT/%e.%p" > /proc/sys/kernel/core_pattern
+
+	ulimit -c unlimited
+	for c in $CASES; do
+		bin=$(binary "${c%%:*}") || exit 1
+		args=$(shape_args "${c##*:}") || exit 1
+		for i in $(seq "$RUNS"); do
+			rm -f "$OUT/stamp"
+			"$HERE/$bin" $args -o "$OUT/stamp" 2>/dev/null
+			read -r pid stamp < "$OUT/stamp" || continue
+			wait_for_ecfs "$OUT/$bin.$pid" || echo "$c: no ecfs file for pid $pid" >&2
+			end=$(now_ns)
+			echo "$c $((end - stamp)) $OUT/$bin.$pid"
+		done
+	done
+}
+
+if [ -n "$REPLAY" ]; then
+	replay > "$OUT/runs"
+else
+	live > "$OUT/runs"
+fi
+"$HERE/bench_report" < "$OUT/runs"
+echo "ecfs files and raw results are in $OUT"
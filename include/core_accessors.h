@@ -35,7 +35,16 @@
  */
 elfdesc_t * load_core_file(const char *path);
 
-elfdesc_t * reload_core_file(elfdesc_t *old);
+/*
+ * Same as load_core_file() for an already open core (i.e a staging
+ * file); name is only used as elfdesc->path. fd isn't taken over.
+ */
+elfdesc_t * load_core_fd(int fd, const char *name);
+
+/*
+ * Drop the mapping of old and load the core at fd in its place.
+ */
+elfdesc_t * reload_core_file(elfdesc_t *old, int fd);
 
 void get_text_phdr_size_with_hint(elfdesc_t *elfdesc, unsigned long hint);
 
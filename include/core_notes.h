@@ -33,6 +33,12 @@
  */
 notedesc_t * parse_notes_area(elfdesc_t *elfdesc);
 
+/*
+ * The per thread tables point into the mapped notes; re-point them
+ * at elfdesc after reload_core_file() has mapped the core again.
+ */
+void rebase_notes(notedesc_t *notedesc, elfdesc_t *elfdesc);
+
 /*
  * Get original entry point
  */
@@ -40,17 +40,57 @@ ssize_t get_segment_from_pmem(unsigned long vaddr, memdesc_t *memdesc, uint8_t *
  * though we want the complete text of the main executable and
  * its shared libaries. This function merges the executables complete
  * text segment into the core file. And merge_shlib_texts_into_core
- * will do the ones for each shared library.
+ * will do the ones for each shared library. Both write the result to
+ * a new staging file (see ecfs_tmpfile()) which replaces *core_fd.
  */
-int merge_exe_text_into_core(const char *path, memdesc_t *memdesc);
+int merge_exe_text_into_core(int *core_fd, memdesc_t *memdesc);
+
+
+/*
+ * Reads the complete text segment of the executable (into memdesc->textseg)
+ * and, if opts.text_all is set, of every shared library (into maps[i].text_image)
+ * with a single SIGSTOP/SIGCONT of the task. Ranges are pulled in batches
+ * with process_vm_readv() and anything it can't read falls back to one
+ * shared /proc/$pid/mem fd. Returns -1 only if the executables text failed.
+ */
+int capture_text_segments(memdesc_t *memdesc);
 
 /*
- * This function is called by merge_shlib_texts_into_core() and merges a text segment
- * from a given shared library into the core file.
+ * Merges the text image of every shared library into the core file.
+ * All of the phdr offset shifts are computed up front so that the
+ * core file is only rewritten once regardless of the library count.
  */
+int merge_shlib_texts_into_core(int *core_fd, memdesc_t *memdesc);
 
-void create_shlib_text_mappings(memdesc_t *memdesc);
+/*
+ * Describes one text image that is to be merged into the core file
+ * in place of the 4096 bytes the kernel dumped for it. plan_text_merges()
+ * fills in the phdr index and the old and new file offsets.
+ */
+struct text_merge {
+	unsigned long vaddr;	// any address within the text segment
+	uint8_t *image;		// complete text image read from /proc/$pid/mem
+	size_t len;		// length of image
+	int phdr_index;		// index of the PT_LOAD that the image belongs to
+	ElfW(Off) old_offset;
+	ElfW(Off) new_offset;
+	size_t old_filesz;
+	size_t new_filesz;
+};
 
-int merge_shlib_texts_into_core(const char *corefile, memdesc_t *memdesc);
+/*
+ * Builds the text merges for the executable and (when opts.text_all
+ * is set) every shared library text image that has been read in.
+ * Returns the number of entries stored in *merges.
+ */
+int get_text_merges(memdesc_t *memdesc, struct text_merge **merges);
+
+/*
+ * Computes the final phdr layout of a core file once every text image
+ * in merges[] has been merged in. phdr is modified in place (p_filesz
+ * of merged segments and p_offset of every segment following them) and
+ * the total number of bytes that the file grows by is returned.
+ */
+ssize_t plan_text_merges(ElfW(Phdr) *phdr, int phnum, struct text_merge *merges, int count);
 
 #endif
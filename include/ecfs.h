@@ -55,8 +55,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#define MAX_RAMDISK_GIGS 4
-#define ECFS_RAMDISK_DIR "/tmp/ecfs_ramdisk"
+#define ECFS_ARENA_SIZE (16 << 20) /* up front reservation for arena_alloc() */
 
 /*
  * Custom sections
@@ -77,6 +76,7 @@
  */
 #define NET_TCP 1
 #define NET_UDP 2
+#define NET_UNIX 3
 
 #define HUGE_ALLOC(size)  \
       mmap(0, (size), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)
@@ -116,6 +116,69 @@
 
 #define MAX_SHDR_COUNT 2048
 
+/*
+ * Compressed ECFS variant (ecfs -c). The PT_LOAD bodies are split
+ * into ECFS_ZCHUNK_SIZE chunks that are deflated and appended to the
+ * file; the original ranges are left as holes. The .zindex section is
+ * an array of ecfs_zchunk_t sorted by offset.
+ */
+#define ECFS_ZCHUNK_SIZE (64 * 1024)
+#define ECFS_ZINDEX_NAME ".zindex"
+
+typedef struct {
+	uint64_t offset;	// file offset of the chunk as if uncompressed
+	uint64_t stored_offset;	// where the deflated chunk is stored
+	uint32_t size;		// uncompressed size
+	uint32_t stored_size;	// deflated size; 0 if left uncompressed in place
+} ecfs_zchunk_t;
+
+/*
+ * Shared library text store (ecfs -t -d). Instead of embedding each
+ * shlib text image, it is written once to ECFS_TEXTSTORE_DIR under
+ * its hash and the ECFS file gets a .textrefs entry pointing at it.
+ */
+#define ECFS_TEXTSTORE_DIR "/opt/ecfs/textstore"
+#define ECFS_TEXTREFS_NAME ".textrefs"
+
+typedef struct {
+	uint64_t hash;		// hash_bytes() of the text image
+	uint64_t vaddr;		// base address of the text in the process
+	uint64_t len;		// length of the text image
+} ecfs_textref_t;
+
+/*
+ * Capture instrumentation. ecfs times each stage of the pipeline
+ * (see stats.h) and stores one ecfs_stat_t per stage, indexed by
+ * ECFS_STAGE_*, in the .ecfs_stats section. Stages that didn't run
+ * are left zeroed.
+ */
+#define ECFS_STATS_NAME ".ecfs_stats"
+#define ECFS_STAGE_NAME_LEN 16
+
+enum {
+	ECFS_STAGE_PROC = 0,	// /proc/<pid> metadata, fd links, original ELF
+	ECFS_STAGE_TEXT,	// text images from /proc/<pid>/mem
+	ECFS_STAGE_CORE,	// reading the core from the kernel pipe
+	ECFS_STAGE_NOTES,	// parsing the notes segment
+	ECFS_STAGE_MERGE,	// merging text images into the staged core
+	ECFS_STAGE_PHDRS,	// original phdrs, offsets, lib maps, dyntags
+	ECFS_STAGE_SYMBOLS,	// resolving shlib dynamic symbols
+	ECFS_STAGE_HEURISTICS,	// dll injection heuristics
+	ECFS_STAGE_WRITE,	// core2ecfs(), including the local symtab
+	ECFS_STAGE_SYMVALS,	// storing runtime .dynsym values
+	ECFS_STAGE_COMPRESS,	// ecfs -c
+	ECFS_STAGE_COUNT
+};
+
+typedef struct {
+	char name[ECFS_STAGE_NAME_LEN];
+	uint64_t wall_ns;	// CLOCK_MONOTONIC time spent in the stage
+	uint64_t cpu_ns;	// process CPU time (all threads) spent in the stage
+	uint64_t bytes_read;	// rchar delta from /proc/self/io
+	uint64_t bytes_written;	// wchar delta from /proc/self/io
+	uint64_t peak_rss_kb;	// ru_maxrss when the stage ended
+} ecfs_stat_t;
+
 typedef struct elf_stats {
 #define ELF_STATIC (1 << 1) // if its statically linked (instead of dynamically)
 #define ELF_PIE (1 << 2)    // if its position indepdendent executable
@@ -129,7 +192,15 @@ struct opts {
 	int text_all; // write complete text segment (not just 4096 bytes) of each shared library
 	int heuristics; // heuristics for detecting dll injection etc.
 	int use_stdin;
-	int use_ramdisk;
+	int single_pass; // stream the core straight into the outfile with texts merged in
+	int sparse; // leave holes in the outfile in place of zero pages
+	int compress; // store PT_LOAD bodies as compressed chunks (see ecfs_zchunk_t)
+	int text_store; // with text_all, store shlib texts in ECFS_TEXTSTORE_DIR instead
+	int sym_threads; // number of threads resolving shared library symbols (0 or 1 is serial)
+	int symcache; // use the persistent symbol cache in ECFS_SYMCACHE_DIR
+	int stats_log; // log a one line summary of the .ecfs_stats table
+	char *record_dir; // save a replayable /proc snapshot and core here (see replay.h)
+	char *replay_dir; // read /proc/<pid> and the text images from a recorded snapshot
 	char *logfile;
 };
 
@@ -175,13 +246,20 @@ struct section_meta {
 	    dstrSiz, plt_relaSiz, plt_relSiz;
 };
 
-struct elf_thread_core_info {
-	struct elf_prstatus *prstatus;
-	struct elf_prpsinfo *psinfo;
-	struct user_regs_struct *regs;
-	elf_fpregset_t *fpu;
-	siginfo_t *siginfo;
-	 ElfW(Nhdr) * notes;
+/*
+ * Per thread register state, kept as parallel arrays indexed by thread
+ * number (in NT_PRSTATUS order) and grown as the notes are walked. The
+ * entries point straight into the PT_NOTE segment of the mapped core,
+ * so rebase_notes() must be called whenever the core is remapped.
+ * fpregs/xstate are NULL for a thread the kernel dumped none for.
+ */
+struct thread_core_table {
+	struct elf_prstatus **prstatus;
+	elf_fpregset_t **fpregs;
+	uint8_t **xstate;
+	size_t *xstate_size;
+	int count;
+	int cap;
 };
 
 typedef struct ecfs_file_fmt {
@@ -194,6 +272,7 @@ typedef struct ecfs_file_fmt {
 	loff_t stb_offset;
 	loff_t personality_offset;
 	loff_t arglist_offset;
+	loff_t textrefs_offset;
 	size_t prstatus_size;
 	size_t prpsinfo_size;
 	size_t fdinfo_size;
@@ -202,6 +281,9 @@ typedef struct ecfs_file_fmt {
 	size_t exepath_size;
 	size_t personality_size;
 	size_t arglist_size;
+	size_t textrefs_size;
+	loff_t stats_offset;
+	size_t stats_size;
 	int thread_count;
 } ecfs_file_t;
 
@@ -239,9 +321,8 @@ typedef struct notedesc {
 	Elf32_auxv_t *auxv;
 #endif
 	struct siginfo_t *siginfo;
-	struct elf_thread_core_info thread_core_info[MAX_THREADS];
+	struct thread_core_table threads;
 	elf_fpregset_t *fpu;
-	int thread_count;
 	int thread_status_size;
 	int numnote;
 	size_t auxv_size;
@@ -381,6 +462,8 @@ typedef struct memdesc {
 	unsigned long o_entry; 
 	fd_info_t *fdinfo;
 	ssize_t fdinfo_size;
+	ecfs_textref_t *textrefs; // shlib texts kept in the text store (opts.text_store)
+	int textref_count;
 } memdesc_t;
 
 typedef struct handle { 
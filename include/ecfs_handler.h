@@ -13,10 +13,41 @@
 #include <dlfcn.h>
 
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <string.h>
+#include <time.h>
 
 #define ECFS_WORKER_32 "/opt/ecfs/bin/ecfs32"
 #define ECFS_WORKER_64 "/opt/ecfs/bin/ecfs64"
 
+/*
+ * Admission control. A crash storm would otherwise start one worker
+ * per crashing process. Workers hold one of max_workers lock files
+ * in ECFS_SLOT_DIR while they run, and at most max_queued handlers
+ * wait (up to queue_timeout seconds) for one to become free. Only the
+ * first rate_limit dumps of an executable in each rate_window seconds
+ * are converted to ECFS. Anything that isn't admitted gets a short
+ * text summary in <outfile>.summary instead. The defaults can be
+ * overridden in ECFS_HANDLER_CONF with "key = value" lines; a limit
+ * of 0 disables it.
+ */
+#define ECFS_HANDLER_CONF "/opt/ecfs/ecfs_handler.conf"
+#define ECFS_SLOT_DIR "/opt/ecfs/slots"
+#define ECFS_RATE_DIR "/opt/ecfs/ratelimit"
+
+#define ECFS_DEFAULT_MAX_WORKERS 4
+#define ECFS_DEFAULT_MAX_QUEUED 16
+#define ECFS_DEFAULT_QUEUE_TIMEOUT 30
+#define ECFS_DEFAULT_RATE_LIMIT 3
+#define ECFS_DEFAULT_RATE_WINDOW 300
+
+struct handler_conf {
+	int max_workers;
+	int max_queued;
+	int queue_timeout;
+	int rate_limit;
+	int rate_window;
+};
+
 	
 #endif
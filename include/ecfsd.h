@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ECFS_ECFSD_H
+#define _ECFS_ECFSD_H
+
+/*
+ * Resident conversion daemon. ecfsd keeps a pool of ecfs workers that
+ * have already been exec'd and have warmed up their arena, the
+ * ld.so.cache index and (with -y) the symbol cache entries of the
+ * common libraries. Each one waits in accept() on ECFSD_SOCKET.
+ * ecfs_handler connects and passes its argv as a request, plus the
+ * core pipe and a /proc/<pid> directory fd (SCM_RIGHTS). Once the
+ * worker acknowledges, the handler exits. The crashing process stays
+ * pinned as long as the worker holds the pipe open, so the worker
+ * can still read /proc/<pid>. A worker converts exactly one dump and
+ * exits, and ecfsd starts a fresh one in its place.
+ */
+#define ECFSD_SOCKET "/opt/ecfs/ecfsd.sock"
+#define ECFSD_WORKER_ARG "--ecfsd-worker"
+#define ECFSD_LISTEN_FD 3
+#define ECFSD_DEFAULT_WORKERS 4
+#define ECFSD_MAGIC 0xecf5d001
+#define ECFSD_MAX_ARGS 64
+#define ECFSD_MAX_ARGV_LEN 4096
+
+struct ecfsd_request {
+	uint32_t magic;
+	uint32_t argc;
+	uint32_t argv_len;	// NUL separated arguments follow
+};
+
+/*
+ * Handler side: connect to ecfsd and hand over the dump. Returns 0
+ * once a worker has taken it, -1 if there is no daemon or it didn't
+ * (in which case the caller should run the worker itself).
+ */
+int ecfsd_submit(int argc, char **argv, int core_fd, int proc_fd);
+
+/*
+ * Worker side: wait for a request on the listening socket at
+ * ECFSD_LISTEN_FD, install the core pipe as stdin and replace
+ * argc/argv with the request's. Returns 0 on success.
+ */
+int ecfsd_accept(int *argc, char ***argv);
+
+#endif
@@ -27,5 +27,7 @@
 #define _ECFS_EH_FRAME_H
 
 int get_all_functions(const char *filepath, struct fde_func_data **funcs);
+int get_ecfs_functions(const char *filepath, const uint8_t *mem, size_t len, struct fde_func_data **funcs);
+int get_shlib_functions(const char *path, unsigned long base, struct fde_func_data **funcs);
 
 #endif
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _ECFS_HASH_H
+#define _ECFS_HASH_H
+
+typedef struct hash_entry {
+	const char *key;	// not owned by the table
+	uint64_t hash;		// 0 if the slot is empty
+	unsigned long value;
+} hash_entry_t;
+
+typedef struct hash_table {
+	hash_entry_t *entries;
+	size_t size;		// always a power of 2
+	size_t count;
+} hash_table_t;
+
+/*
+ * hint is the number of keys expected; the table grows as needed.
+ */
+hash_table_t * hash_create(size_t hint);
+
+void hash_destroy(hash_table_t *table);
+
+/*
+ * Returns 1 if key was added, 0 if it was already present (in which
+ * case its value is only overwritten if replace is set).
+ */
+int hash_insert(hash_table_t *table, const char *key, unsigned long value, int replace);
+
+/*
+ * Returns 1 and stores the value of key in *value if key is present.
+ */
+int hash_lookup(hash_table_t *table, const char *key, unsigned long *value);
+
+#endif
@@ -31,16 +31,27 @@
 #ifndef _ECFS_HEURISTICS_H
 #define _ECFS_HEURISTICS_H
 
+/*
+ * A string in .rodata that looks like a shared library name,
+ * as an offset and length (excluding the NUL) into the section.
+ */
+struct rodata_string {
+	uint32_t offset;
+	uint32_t len;
+};
+
+int scan_rodata_strings(const uint8_t *rodata_ptr, size_t rodata_size, struct rodata_string **out);
 int build_rodata_strings(char ***stra, uint8_t *rodata_ptr, size_t rodata_size);
 
 /* 
  * From DT_NEEDED (We pass the executable and each shared library to this function)
  */
-int get_dt_needed_libs(const char *bin_path, struct needed_libs **needed_libs);
+int get_dt_needed_libs_all(memdesc_t *memdesc, struct needed_libs **needed_libs);
 /*
  * Get dlopen libs
  */
-int get_dlopen_libs(const char *exe_path, struct dlopen_libs **dl_libs);
+int get_dlopen_libs(const char *exe_path, struct dlopen_libs **dl_libs, int index, size_t *cap);
+int get_dlopen_libs_all(memdesc_t *memdesc, struct needed_libs *needed_libs, int needed_count, struct dlopen_libs **dlopen_libs);
 
 void mark_dll_injection(notedesc_t *notedesc, memdesc_t *memdesc, elfdesc_t *elfdesc);
 
@@ -26,6 +26,13 @@
 #ifndef _ECFS_PROC_H
 #define _ECFS_PROC_H
 
+/*
+ * Builds the path of /proc/<pid>/<name>. Every read of the crashed
+ * process' /proc entries goes through here so that they can come from
+ * a recorded snapshot instead (ecfs -r, see replay.h).
+ */
+int proc_path(char *buf, size_t len, pid_t pid, const char *name);
+
 /*
  * Since the process is paused, all /proc data is still available.
  * get_maps() simply extracts all of the memory mapping information
@@ -33,12 +40,10 @@
  * eventually we pair this info up with the program headers (PT_LOAD's)
  * in the core file to determine where to build certain section headers.
  */
-int get_maps(pid_t pid, mappings_t *maps, const char *path);
+int get_maps(pid_t pid, mappings_t **maps, const char *path);
 
 int get_fd_links(memdesc_t *memdesc, fd_info_t **fdinfo);
 
-int get_map_count(pid_t pid);
-
 /*
  * Handle the case where say: /bin/someprog is a symbolic link
  */
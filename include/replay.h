@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _ECFS_REPLAY_H
+#define _ECFS_REPLAY_H
+
+/*
+ * Offline replay. ecfs -R <dir> records everything it reads about the
+ * crashed process into <dir>/<pid>/, laid out like /proc/<pid>:
+ *
+ *	maps auxv environ comm cmdline status	copies of the /proc files
+ *	exe					copy of the executable
+ *	exe.link				symlink to the original exe path
+ *	fd/<n>					symlinks, as in /proc/<pid>/fd
+ *	net/{tcp,tcp6,udp,udp6,unix}		socket tables
+ *	mem, mem.idx				the text images that were read,
+ *						indexed by "vaddr len offset"
+ *	core					the core as passed by the kernel
+ *
+ * ecfs -r <dir> -p <pid> -e <comm> -o <out> < <dir>/<pid>/core then runs
+ * the same conversion without the process, root or core_pattern. The
+ * shared libraries (and with -h the executable's DT_NEEDED and
+ * dlopen() strings) are still read from their original paths.
+ */
+int replay_record(pid_t pid);
+
+void replay_record_mem(pid_t pid, unsigned long vaddr, const uint8_t *buf, size_t len);
+
+int replay_record_core(pid_t pid, int core_fd);
+
+ssize_t replay_read_mem(pid_t pid, uint8_t *buf, unsigned long vaddr, size_t len);
+
+#endif
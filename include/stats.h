@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _ECFS_STATS_H
+#define _ECFS_STATS_H
+
+/*
+ * Per stage instrumentation of the capture pipeline. main() brackets
+ * each stage with stats_begin()/stats_end(); a stage that is entered
+ * more than once accumulates. The table is what core2ecfs() writes
+ * out as .ecfs_stats.
+ */
+void stats_begin(int stage);
+
+void stats_end(int stage);
+
+/*
+ * Credits bytes to the stage currently running. Only needed for I/O
+ * that /proc/self/io doesn't account, i.e. splice(2).
+ */
+void stats_add_io(uint64_t bytes_read, uint64_t bytes_written);
+
+ecfs_stat_t * stats_table(void);
+
+/*
+ * core2ecfs() writes .ecfs_stats before the later stages have run, so
+ * once everything is done this rewrites the section in outfile with
+ * the final table. Returns -1 if outfile has no .ecfs_stats.
+ */
+int stats_update_file(const char *outfile);
+
+/*
+ * One line summary (totals, then wall ms per stage that ran) meant
+ * for log_msg().
+ */
+void stats_summary(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ECFS_STRTAB_H
+#define _ECFS_STRTAB_H
+
+#include "../include/ecfs.h"
+
+/*
+ * Growable ELF string table. Strings are appended back to back (each
+ * NUL terminated) into one buffer whose capacity doubles as needed, so
+ * the table can be handed to write()/writev() as is. Offset 0 is always
+ * the empty string.
+ */
+typedef struct strtab {
+	char *buf;
+	size_t len;
+	size_t cap;
+} strtab_t;
+
+/*
+ * Growable symbol table, with its own string table for the names.
+ */
+typedef struct symtab_builder {
+	ElfW(Sym) *syms;
+	size_t count;
+	size_t cap;
+	strtab_t strtab;
+} symtab_builder_t;
+
+void strtab_init(strtab_t *, size_t);
+unsigned int strtab_add(strtab_t *, const char *);
+unsigned int strtab_add_hex(strtab_t *, const char *, uint64_t);
+void strtab_free(strtab_t *);
+
+void symtab_builder_init(symtab_builder_t *, size_t);
+ElfW(Sym) * symtab_builder_add(symtab_builder_t *, unsigned int, ElfW(Addr), size_t, unsigned char, ElfW(Section));
+void symtab_builder_free(symtab_builder_t *);
+
+#endif
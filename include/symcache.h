@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _ECFS_SYMCACHE_H
+#define _ECFS_SYMCACHE_H
+
+/*
+ * Persistent per-library symbol cache (ecfs -y). Every library that
+ * is parsed gets a cache file in ECFS_SYMCACHE_DIR named after its
+ * st_dev, st_ino and st_mtime, holding its .dynsym values and sizes,
+ * its name table, its DT_NEEDED list and the ".so" strings in its
+ * .rodata (used as dlopen() candidates by the heuristics). The build-id is kept in the
+ * header and checked on every lookup. Files are written under a
+ * unique temporary name and renamed into place, so any number of
+ * concurrent ecfs workers can share the directory.
+ */
+#define ECFS_SYMCACHE_DIR "/opt/ecfs/symcache"
+#define SYMCACHE_MAGIC "ECFSSYM2"
+#define SYMCACHE_MAX_BUILD_ID 64
+
+struct symcache_hdr {
+	char magic[8];
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t mtime_sec;
+	uint64_t mtime_nsec;
+	uint64_t size;
+	uint32_t build_id_len;
+	uint8_t build_id[SYMCACHE_MAX_BUILD_ID];
+	uint32_t use_addend;	// first PT_LOAD is at 0; values need the load base added
+	uint64_t sym_count;
+	uint64_t sym_offset;	// array of struct symcache_sym
+	uint64_t needed_count;
+	uint64_t needed_offset;	// array of uint32_t offsets into the name table
+	uint64_t rodata_count;
+	uint64_t rodata_offset;	// array of uint32_t offsets into the name table
+	uint32_t calls_dlopen;	// .dynsym has a dlopen symbol
+	uint32_t pad;
+	uint64_t names_offset;
+	uint64_t names_size;	// .dynstr followed by the .rodata strings
+};
+
+struct symcache_sym {
+	uint64_t value;		// unrelocated st_value
+	uint64_t size;
+	uint32_t name;		// offset into the name table
+	uint32_t pad;
+};
+
+typedef struct symcache {
+	struct symcache_hdr *hdr;
+	struct symcache_sym *syms;
+	uint32_t *needed;
+	uint32_t *rodata;
+	const char *names;
+	size_t map_size;
+} symcache_t;
+
+/*
+ * Maps the cache entry for the library at path, building (and storing)
+ * it first if there isn't a valid one. The mapping is left in place for
+ * the lifetime of the process so that names can be used without copying.
+ * Returns 0 on success, -1 if the library couldn't be parsed.
+ */
+int symcache_get(const char *path, symcache_t *cache);
+
+/*
+ * Map the entries of the libraries this process is linked against
+ * (libc, ld.so, ...), which nearly every dump needs. Used by ecfsd.
+ */
+void symcache_prewarm(void);
+
+#endif
@@ -26,8 +26,18 @@
 #ifndef _ECFS_SYMRESOLVE_H
 #define _ECFS_SYMRESOLVE_H
 
+#include "../include/hash.h"
+
 unsigned long lookup_from_symlist(const char *name, list_t *list);
 
+/*
+ * Hash index over every symbol in the list, with the same precedence
+ * as lookup_from_symlist() (first library in the list wins).
+ */
+hash_table_t * build_symbol_index(list_t *list);
+
+unsigned long lookup_from_symindex(const char *name, hash_table_t *index);
+
 int store_dynamic_symvals(list_t *list, const char *path);
 
 int fill_dynamic_symtab(list_t **list, struct lib_mappings *lm);
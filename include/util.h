@@ -48,9 +48,31 @@ int xfstat(int fd, struct stat *st);
 
 void xfree(void *p);
 
-int create_tmp_ramdisk(size_t gigs);
+int arena_init(size_t size);
 
-int inquire_meminfo(void);
+void * arena_alloc(size_t len);
+
+char * arena_strdup(const char *s);
+
+char * arena_fmtstrdup(char *fmt, ...);
+
+int arena_owns(const void *p);
+
+void arena_stats(char *buf, size_t len);
+
+void arena_destroy(void);
+
+int ecfs_tmpfile(const char *name);
+
+void ecfs_seal(int fd);
+
+int grow_pipe_buffer(int fd);
+
+ssize_t splice_to_file(int in, int out);
+
+ssize_t sparse_pwrite(int fd, const void *buf, size_t len, off_t offset);
+
+uint64_t hash_bytes(const void *buf, size_t len);
 
 /*
  * Used for debugging
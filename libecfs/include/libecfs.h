@@ -34,6 +34,7 @@
  */
 #define NET_TCP 1
 #define NET_UDP 2
+#define NET_UNIX 3
 
 typedef struct elf_stats {
 #define ELF_STATIC (1 << 1) // if its statically linked (instead of dynamically)
@@ -76,8 +77,57 @@ typedef struct ecfs_elf {
          int fd;                /* A copy of the file descriptor to the file */
 	 int pie;		/* is the process from a PIE executable? */
 	 elf_stat_t *elfstats;
+	 struct ecfs_zchunk *zchunks; /* chunk index of a compressed ECFS file, otherwise NULL */
+	 size_t zchunk_count;
+	 uint8_t *zchunk_done;  /* zchunk_done[i] is set once chunk i has been inflated */
+	 struct ecfs_textref *textrefs; /* shlib texts kept in the text store, otherwise NULL */
+	 size_t textref_count;
+	 uint8_t **textref_maps; /* textref_maps[i] is the mapping of textrefs[i] once opened */
 } ecfs_elf_t;
 
+/*
+ * Compressed ECFS files (ecfs -c) have a .zindex section; the
+ * PT_LOAD bodies are inflated back into desc->mem on demand.
+ */
+#define ECFS_ZINDEX_NAME ".zindex"
+
+typedef struct ecfs_zchunk {
+	uint64_t offset;	// file offset of the chunk as if uncompressed
+	uint64_t stored_offset;	// where the deflated chunk is stored
+	uint32_t size;		// uncompressed size
+	uint32_t stored_size;	// deflated size; 0 if left uncompressed in place
+} ecfs_zchunk_t;
+
+/*
+ * ECFS files made with ecfs -t -d reference the shlib text images in
+ * the content addressed text store instead of embedding them. get_ptr_for_va()
+ * resolves addresses within them transparently.
+ */
+#define ECFS_TEXTSTORE_DIR "/opt/ecfs/textstore"
+#define ECFS_TEXTREFS_NAME ".textrefs"
+
+typedef struct ecfs_textref {
+	uint64_t hash;		// hash of the text image
+	uint64_t vaddr;		// base address of the text in the process
+	uint64_t len;		// length of the text image
+} ecfs_textref_t;
+
+/*
+ * Per stage capture stats written by ecfs; one ecfs_stat_t per
+ * stage in pipeline order. Stages that didn't run are zeroed.
+ */
+#define ECFS_STATS_NAME ".ecfs_stats"
+#define ECFS_STAGE_NAME_LEN 16
+
+typedef struct ecfs_stat {
+	char name[ECFS_STAGE_NAME_LEN];
+	uint64_t wall_ns;	// monotonic wall time spent in the stage
+	uint64_t cpu_ns;	// process CPU time spent in the stage
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t peak_rss_kb;	// peak RSS of ecfs when the stage ended
+} ecfs_stat_t;
+
 #define MAX_SYM_LEN 255
 
 typedef struct ecfs_sym {
@@ -129,3 +179,4 @@ ssize_t get_section_pointer(ecfs_elf_t *desc, const char *name, uint8_t **ptr);
 int get_auxiliary_vector(ecfs_elf_t *, Elf64_auxv_t **);
 ssize_t get_pltgot_info(ecfs_elf_t *desc, pltgot_info_t **pginfo);
 int get_auxiliary_vector64(ecfs_elf_t *desc, Elf64_auxv_t **auxv);
+int get_ecfs_stats(ecfs_elf_t *desc, ecfs_stat_t **stats);
@@ -1,9 +1,78 @@
 #include "../include/libecfs.h"
 #include "../include/util.h"
+#include <zlib.h>
+
+/*
+ * Inflate every chunk of a compressed ECFS file that overlaps
+ * [offset, offset + len) into its place in desc->mem (which is
+ * a private writable mapping). Chunks are only inflated once and
+ * never evicted so that pointers handed out stay valid until
+ * unload_ecfs_file().
+ */
+static void materialize(ecfs_elf_t *desc, ElfW(Off) offset, size_t len)
+{
+	ecfs_zchunk_t *chunk;
+	size_t lo = 0, hi = desc->zchunk_count, mid;
+	uLongf dlen;
+
+	if (desc->zchunks == NULL || len == 0)
+		return;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (desc->zchunks[mid].offset + desc->zchunks[mid].size <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < desc->zchunk_count; lo++) {
+		chunk = &desc->zchunks[lo];
+		if (chunk->offset >= offset + len)
+			break;
+		if (desc->zchunk_done[lo] || chunk->stored_size == 0)
+			continue;
+		dlen = chunk->size;
+		if (uncompress(&desc->mem[chunk->offset], &dlen,
+		    &desc->mem[chunk->stored_offset], chunk->stored_size) != Z_OK || dlen != chunk->size)
+			fprintf(stderr, "libecfs: failed to inflate chunk at offset %lx\n", (unsigned long)chunk->offset);
+		desc->zchunk_done[lo] = 1;
+	}
+}
+
+/*
+ * Map the text store image of textrefs[i]. Returns NULL if it
+ * isn't available (i.e. the ECFS file was copied to another host).
+ */
+static uint8_t * map_textref(ecfs_elf_t *desc, size_t i)
+{
+	ecfs_textref_t *ref = &desc->textrefs[i];
+	char path[MAX_PATH];
+	uint8_t *map;
+	int fd;
+
+	if (desc->textref_maps[i] != NULL)
+		return desc->textref_maps[i];
+	snprintf(path, sizeof(path), "%s/%016lx-%lx", ECFS_TEXTSTORE_DIR,
+	    (unsigned long)ref->hash, (unsigned long)ref->len);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	map = mmap(NULL, ref->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	desc->textref_maps[i] = map;
+	return map;
+}
+
+static void materialize_section(ecfs_elf_t *desc, ElfW(Shdr) *shdr)
+{
+	if (shdr->sh_type != SHT_NOBITS)
+		materialize(desc, shdr->sh_offset, shdr->sh_size);
+}
 
 ecfs_elf_t * load_ecfs_file(const char *path)
 {
 	ecfs_elf_t *ecfs = (ecfs_elf_t *)heapAlloc(sizeof(ecfs_elf_t));
+	memset(ecfs, 0, sizeof(ecfs_elf_t));
 	uint8_t *mem;
 	ElfW(Ehdr) *ehdr;
 	ElfW(Phdr) *phdr;
@@ -38,7 +107,45 @@ ecfs_elf_t * load_ecfs_file(const char *path)
 	 * setup section header string table
 	 */
 	ecfs->shstrtab = (char *)&mem[shdr[ehdr->e_shstrndx].sh_offset];
+	ecfs->mem = mem;
 	
+	/*
+	 * Compressed variant? The sections we keep pointers to
+	 * below are inflated right away.
+	 */
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (!strcmp(&ecfs->shstrtab[shdr[i].sh_name], ECFS_ZINDEX_NAME)) {
+			ecfs->zchunks = (ecfs_zchunk_t *)&mem[shdr[i].sh_offset];
+			ecfs->zchunk_count = shdr[i].sh_size / sizeof(ecfs_zchunk_t);
+			ecfs->zchunk_done = calloc(ecfs->zchunk_count + 1, 1);
+			if (ecfs->zchunk_done == NULL) {
+				perror("calloc");
+				return NULL;
+			}
+			break;
+		}
+	}
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (!strcmp(&ecfs->shstrtab[shdr[i].sh_name], ECFS_TEXTREFS_NAME)) {
+			ecfs->textrefs = (ecfs_textref_t *)&mem[shdr[i].sh_offset];
+			ecfs->textref_count = shdr[i].sh_size / sizeof(ecfs_textref_t);
+			ecfs->textref_maps = calloc(ecfs->textref_count + 1, sizeof(uint8_t *));
+			if (ecfs->textref_maps == NULL) {
+				perror("calloc");
+				return NULL;
+			}
+			break;
+		}
+	}
+	if (ecfs->zchunks != NULL) {
+		for (i = 0; i < ehdr->e_shnum; i++) {
+			char *name = &ecfs->shstrtab[shdr[i].sh_name];
+			if (!strcmp(name, ".dynstr") || !strcmp(name, ".dynsym") || !strcmp(name, ".dynamic") ||
+			    !strcmp(name, ".rela.dyn") || !strcmp(name, ".rela.plt") || !strcmp(name, ".got.plt"))
+				materialize_section(ecfs, &shdr[i]);
+		}
+	}
+
 	/*
 	 * setup .dynsym symbols, .symtab symbols, and .dynstr and .strtab string table
 	 */
@@ -143,6 +250,15 @@ ecfs_elf_t * load_ecfs_file(const char *path)
 
 int unload_ecfs_file(ecfs_elf_t *desc)
 {
+	size_t i;
+
+	if (desc->zchunk_done != NULL)
+		free(desc->zchunk_done);
+	for (i = 0; i < desc->textref_count; i++)
+		if (desc->textref_maps[i] != NULL)
+			munmap(desc->textref_maps[i], desc->textrefs[i].len);
+	if (desc->textref_maps != NULL)
+		free(desc->textref_maps);
 	return munmap(desc->mem, desc->filesize);
 }
 
@@ -253,6 +369,26 @@ int get_siginfo(ecfs_elf_t *desc, siginfo_t *siginfo)
 	return -1;
 }
 
+/*
+ * Returns the number of stage records in .ecfs_stats, or -1 if the
+ * file predates it.
+ */
+int get_ecfs_stats(ecfs_elf_t *desc, ecfs_stat_t **stats)
+{
+	char *StringTable = desc->shstrtab;
+	ElfW(Shdr) *shdr = desc->shdr;
+	int i;
+
+	for (i = 0; i < desc->ehdr->e_shnum; i++) {
+		if (!strcmp(&StringTable[shdr[i].sh_name], ECFS_STATS_NAME)) {
+			*stats = (ecfs_stat_t *)heapAlloc(shdr[i].sh_size);
+			memcpy(*stats, &desc->mem[shdr[i].sh_offset], shdr[i].sh_size);
+			return shdr[i].sh_size / sizeof(ecfs_stat_t);
+		}
+	}
+	return -1;
+}
+
 ssize_t get_stack_ptr(ecfs_elf_t *desc, uint8_t **ptr)
 {
 	char *StringTable = desc->shstrtab;
@@ -261,6 +397,7 @@ ssize_t get_stack_ptr(ecfs_elf_t *desc, uint8_t **ptr)
 
 	for (i = 0; i < desc->ehdr->e_shnum; i++) {
 		if (!strcmp(&StringTable[shdr[i].sh_name], ".stack")) {
+			materialize_section(desc, &shdr[i]);
 			*ptr = &desc->mem[shdr[i].sh_offset];
 			return shdr[i].sh_size;
 		}
@@ -278,6 +415,7 @@ ssize_t get_heap_ptr(ecfs_elf_t *desc, uint8_t **ptr)
 
 	for (i = 0; i < desc->ehdr->e_shnum; i++) {
 		if (!strcmp(&StringTable[shdr[i].sh_name], ".heap")) {
+			materialize_section(desc, &shdr[i]);
 			*ptr = &desc->mem[shdr[i].sh_offset];
 			return shdr[i].sh_size;
 		}
@@ -321,12 +459,27 @@ ssize_t get_ptr_for_va(ecfs_elf_t *desc, unsigned long vaddr, uint8_t **ptr)
 	ElfW(Ehdr) *ehdr = desc->ehdr;
 	ElfW(Phdr) *phdr = desc->phdr;
 	ssize_t len;
+	uint8_t *text;
 	int i;
 	
+	/*
+	 * Shlib texts that were left in the text store
+	 */
+	for (i = 0; i < desc->textref_count; i++) {
+		if (vaddr >= desc->textrefs[i].vaddr && vaddr < desc->textrefs[i].vaddr + desc->textrefs[i].len) {
+			if ((text = map_textref(desc, i)) == NULL)
+				break; // fall back to the 4096 bytes in the file
+			*ptr = &text[vaddr - desc->textrefs[i].vaddr];
+			return desc->textrefs[i].vaddr + desc->textrefs[i].len - vaddr;
+		}
+	}
 	for (i = 0; i < ehdr->e_phnum; i++) {
 		if (vaddr >= phdr[i].p_vaddr && vaddr < phdr[i].p_vaddr + phdr[i].p_memsz) {
 			*ptr = (uint8_t *)&desc->mem[phdr[i].p_offset + (vaddr - phdr[i].p_vaddr)];
 			len = phdr[i].p_vaddr + phdr[i].p_memsz - vaddr;
+			if (vaddr - phdr[i].p_vaddr < phdr[i].p_filesz)
+				materialize(desc, phdr[i].p_offset + (vaddr - phdr[i].p_vaddr),
+				    phdr[i].p_filesz - (vaddr - phdr[i].p_vaddr));
 			return len;
 		}
 	}
@@ -347,6 +500,7 @@ ssize_t get_section_pointer(ecfs_elf_t *desc, const char *name, uint8_t **ptr)
 
 	for (i = 0; i < desc->ehdr->e_shnum; i++) {
 		if (!strcmp(&StringTable[shdr[i].sh_name], name)) {
+			materialize_section(desc, &shdr[i]);
 			*ptr = (uint8_t *)&desc->mem[shdr[i].sh_offset];
 			len = shdr[i].sh_size;
 			return len;
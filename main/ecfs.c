@@ -35,6 +35,15 @@
 #include "../include/personality.h"
 #include "../include/core2ecfs.h"
 #include "../include/core_accessors.h"
+#include "../include/core_stream.h"
+#include "../include/compress.h"
+#include "../include/textstore.h"
+#include "../include/symcache.h"
+#include "../include/orig_elf.h"
+#include "../include/ecfsd.h"
+#include "../include/libpath.h"
+#include "../include/stats.h"
+#include "../include/replay.h"
 
 
 /*
@@ -46,51 +55,36 @@
  */
 
 /*
- * This function will read the corefile from stdin
- * then write it to a temporary file which is then read
- * by the load_core_file() function above.
+ * This function will read the corefile from stdin into an
+ * anonymous staging file (see ecfs_tmpfile()) which is then
+ * mapped by load_core_fd(). The staging fd is returned in
+ * *core_fd; it is the only reference to the file.
  */
-#define RBUF_LEN 4096 * 8
-elfdesc_t * load_core_file_stdin(char **corefile)
+elfdesc_t * load_core_file_stdin(int *core_fd)
 {
-        uint8_t *buf = NULL;
-        ssize_t nread;
-	ssize_t bytes = 0, bw;
-	int i = 0;
+	struct timespec start, end;
+	ssize_t bytes;
+	double secs;
 	int file;
 	
-	char *tmp_dir = opts.use_ramdisk ? ECFS_RAMDISK_DIR : ECFS_CORE_DIR;
-	
-	char *filepath = xfmtstrdup("%s/.tmp_core", tmp_dir);
-        do {
-                if (access(filepath, F_OK) == 0) {
-                        free(filepath);
-                        filepath = xfmtstrdup("%s/.tmp_core.%d", tmp_dir, ++i);
-                } else
-                        break;
-                        
-        } while(1);
-	
-	/*
-	 * Open tmp file for writing
-	 */
-	file = open(filepath, O_CREAT|O_RDWR, S_IRWXU);
-	buf = alloca(RBUF_LEN);
-	while ((nread = read(STDIN_FILENO, buf, RBUF_LEN)) > 0) {
-        	bytes += nread;
-		bw = write(file, buf, nread);
-		if (bw < 0) {
-			log_msg(__LINE__, "write %s", strerror(errno));
-			exit(-1);
-		}
+	file = ecfs_tmpfile("ecfs_core");
+	if (file < 0)
+		exit(-1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bytes = splice_to_file(STDIN_FILENO, file);
+	if (bytes < 0) {
+		log_msg(__LINE__, "failed to read core file from stdin");
+		exit(-1);
 	}
-	syncfs(file);
-	close(file);
-	*corefile = xstrdup(filepath);
-	return load_core_file(filepath);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ecfs_seal(file);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	log_msg(__LINE__, "read %ld byte core file from stdin in %.3f seconds (%.1f MB/s)",
+	    (long)bytes, secs, secs > 0 ? bytes / secs / (1024 * 1024) : 0.0);
+	*core_fd = file;
+	return load_core_fd(file, "memfd:ecfs_core");
 
 }		
-#undef RBUF_LEN
 
 /*
  * Get /proc/pid/maps info to create data
@@ -106,15 +100,6 @@ memdesc_t * build_proc_metadata(pid_t pid, notedesc_t *notedesc)
 	int i;
 	memdesc_t *memdesc = (memdesc_t *)heapAlloc(sizeof(memdesc_t));
 	
-	memdesc->mapcount = get_map_count(pid);
-        if (memdesc->mapcount < 0) {
-                log_msg(__LINE__, "failed to get mapcount from /proc/%d/maps", pid);
-                return NULL;
-        }
-        memdesc->maps = (mappings_t *)heapAlloc(sizeof(mappings_t) * memdesc->mapcount);
-        
-        memset((void *)memdesc->maps, 0, sizeof(mappings_t) * memdesc->mapcount);
-        
 	/*
 	 * comm and path should be different. comm should be just the filename
 	 * whereas path should be the complete filepath. Although due to an early
@@ -129,7 +114,8 @@ memdesc_t * build_proc_metadata(pid_t pid, notedesc_t *notedesc)
 	memdesc->comm = memdesc->path = exename; // supplied by core_pattern %e
 	memdesc->exe_path = get_executable_path(pid); 
 	memdesc->exe_comm = strrchr(memdesc->exe_path, '/') + 1;
-	if (get_maps(pid, memdesc->maps, memdesc->exe_comm) < 0) {
+	memdesc->mapcount = get_maps(pid, &memdesc->maps, memdesc->exe_comm);
+	if (memdesc->mapcount < 0) {
                 log_msg(__LINE__, "failed to get data from /proc/%d/maps", pid);
                 return NULL;
         }
@@ -162,11 +148,6 @@ memdesc_t * build_proc_metadata(pid_t pid, notedesc_t *notedesc)
 #if DEBUG
 	log_msg(__LINE__, "executable text base: %lx\n", memdesc->text.base);
 #endif
-	ssize_t tlen = get_segment_from_pmem(memdesc->text.base, memdesc, &memdesc->textseg);
-        if (tlen < 0) {
-		log_msg(__LINE__, "get_segment_from_pmem() failed: %s\n", strerror(errno));
-                return NULL;
-        }
 	return memdesc;
 	
 }
@@ -181,9 +162,12 @@ int main(int argc, char **argv)
 	handle_t *handle = alloca(sizeof(handle_t));
 	pid_t pid = 0;
 	int i, j, ret, c, pie = 0;
-	char *corefile = NULL;
+	int core_fd = -1;
 	char *outfile = NULL;
+	char arena_line[256];
+	char stats_line[512];
 	list_t *list_head;
+	int ecfsd_worker = argc >= 2 && !strcmp(argv[1], ECFSD_WORKER_ARG);
 	/*
 	 * When testing use:
 	 * ./ecfs -c corefile -o output.ecfs -p <pid>
@@ -198,12 +182,36 @@ int main(int argc, char **argv)
 		fprintf(stdout, "\n- Manual mode which allows for specifying existing core files (Debugging mode)\n");
 		fprintf(stdout, "[-p]	pid of process (Must respawn a process after it crashes)\n");
 		fprintf(stdout, "[-e]	executable path (Supplied by %%e format arg in core_pattern)\n");
-		fprintf(stdout, "[-o]	output ecfs file\n\n");
+		fprintf(stdout, "[-o]	output ecfs file\n");
+		fprintf(stdout, "[-s]	single pass: stream the core directly into the output file\n");
+		fprintf(stdout, "[-z]	sparse output: leave holes in place of zero pages\n");
+		fprintf(stdout, "[-c]	compress segment data into randomly accessible chunks\n");
+		fprintf(stdout, "[-d]	with -t, keep shlib texts in %s and reference them\n", ECFS_TEXTSTORE_DIR);
+		fprintf(stdout, "[-j]	number of threads used to resolve shared library symbols\n");
+		fprintf(stdout, "[-y]	use the persistent shared library symbol cache in %s\n", ECFS_SYMCACHE_DIR);
+		fprintf(stdout, "[-l]	log a summary of the per stage capture stats (%s)\n", ECFS_STATS_NAME);
+		fprintf(stdout, "[-R]	record a replayable snapshot of /proc/<pid> and the core into <dir>/<pid>\n");
+		fprintf(stdout, "[-r]	replay: read /proc/<pid> from <dir>/<pid> as recorded by -R (core on stdin)\n\n");
 		exit(-1);
 	}
 	memset(&opts, 0, sizeof(opts));
+	if (arena_init(ECFS_ARENA_SIZE) == 0)
+		atexit(arena_destroy);
 
-	while ((c = getopt(argc, argv, "th:o:p:e:")) != -1) {
+	/*
+	 * Spawned by ecfsd: do the work that doesn't depend on the dump
+	 * now, then sleep until a handler gives us one. From there on
+	 * argv is the handler's and we run exactly as if exec'd by it.
+	 */
+	if (ecfsd_worker) {
+		libpath_prewarm();
+		if (argc > 2 && !strcmp(argv[2], "-y"))
+			symcache_prewarm();
+		if (ecfsd_accept(&argc, &argv) < 0)
+			exit(-1);
+	}
+
+	while ((c = getopt(argc, argv, "tszcdylj:h:o:p:e:R:r:")) != -1) {
 		switch(c) {
 			case 'o':
 				outfile = xstrdup(optarg);
@@ -220,6 +228,33 @@ int main(int argc, char **argv)
 			case 't':
 				opts.text_all = 1;
 				break;
+			case 's':
+				opts.single_pass = 1;
+				break;
+			case 'z':
+				opts.sparse = 1;
+				break;
+			case 'c':
+				opts.compress = 1;
+				break;
+			case 'd':
+				opts.text_store = 1;
+				break;
+			case 'j':
+				opts.sym_threads = atoi(optarg);
+				break;
+			case 'y':
+				opts.symcache = 1;
+				break;
+			case 'l':
+				opts.stats_log = 1;
+				break;
+			case 'R':
+				opts.record_dir = xstrdup(optarg);
+				break;
+			case 'r':
+				opts.replay_dir = xstrdup(optarg);
+				break;
 			default:
 				fprintf(stderr, "Unknown option\n");
 				exit(0);
@@ -236,31 +271,17 @@ int main(int argc, char **argv)
 	}
 	
 	/*
-	 * Prevents ecfs from coring itself
+	 * Prevents ecfs from coring itself. A replay isn't run from the
+	 * core_pattern, and a non-dumpable process can't read its own
+	 * /proc/self/io which the stage stats come from.
 	 */
-	prctl(PR_SET_DUMPABLE, 0);
+	if (opts.replay_dir == NULL)
+		prctl(PR_SET_DUMPABLE, 0);
 	
 #if DEBUG
-	log_msg(__LINE__, "options: text_all: %d heuristics: %d outfile: %s exename: %s pid: %d", 
-			opts.text_all, opts.heuristics, outfile, exename, pid);
+	log_msg(__LINE__, "options: text_all: %d heuristics: %d single_pass: %d outfile: %s exename: %s pid: %d", 
+			opts.text_all, opts.heuristics, opts.single_pass, outfile, exename, pid);
 #endif
-	if (opts.text_all) {
-		/*
-		 * text_all requires alot more disk operations and 
-		 * the time it takes becomes infeasable. We use a
-		 * tmpfs ramdisk (of 1 GIG which can be tweaked up to 4GIG)
-		 * to fix this problem. Even the hugest processes only
-		 * take ~3 seconds now.
-		 */
-		int ramdisk_size = inquire_meminfo();
-		if (ramdisk_size <= 0)
-			ramdisk_size = 1;
-		if (create_tmp_ramdisk(ramdisk_size) < 0) {
-			log_msg(__LINE__, "create_tmp_ramdisk failed");
-		} else
-			opts.use_ramdisk = 1;
- 	}
-
 	/*
 	 * If we're reading from stdin we are probably waiting for the kernel
 	 * to write the corefile to us. Until we have read the core file completely
@@ -287,29 +308,64 @@ int main(int argc, char **argv)
         	log_msg(__LINE__, "Did not specify an output file, defaulting to use 'ecfs.out'");
               	outfile = xfmtstrdup("%s/ecfs.out", ECFS_CORE_DIR);
        	}
+	if (opts.record_dir != NULL) {
+		if (opts.replay_dir != NULL || opts.single_pass) {
+			log_msg(__LINE__, "-R can't be combined with -r or -s");
+			exit(-1);
+		}
+		if (replay_record(pid) < 0) {
+			log_msg(__LINE__, "Failed to record /proc/%d into %s", pid, opts.record_dir);
+			exit(-1);
+		}
+	}
 		
+	stats_begin(ECFS_STAGE_PROC);
 	memdesc = build_proc_metadata(pid, notedesc);
        	if (memdesc == NULL) {
                	log_msg(__LINE__, "Failed to retrieve process metadata");
                	exit(-1);
        	}
 	memdesc->task.pid = pid;
-	pie = check_for_pie(pid);
 	global_hacks.stripped = check_for_stripped_shdr(pid);
 	fill_global_hacks(pid);
 	pie = check_for_pie(pid);
 	memdesc->fdinfo_size = get_fd_links(memdesc, &memdesc->fdinfo) * sizeof(fd_info_t);
 	memdesc->o_entry = get_original_ep(pid);
-	if (opts.text_all)
-		create_shlib_text_mappings(memdesc);
+	orig_elf_close();
+	stats_end(ECFS_STAGE_PROC);
+
+	stats_begin(ECFS_STAGE_TEXT);
+	if (capture_text_segments(memdesc) < 0) {
+		log_msg(__LINE__, "capture_text_segments() failed to read the executables text");
+		exit(-1);
+	}
+	if (opts.text_all && opts.text_store)
+		store_shlib_texts(memdesc);
+	stats_end(ECFS_STAGE_TEXT);
 
 	/*
 	 * load the core file from stdin (Passed by the kernel via core_pattern)
 	 */
-	elfdesc = load_core_file_stdin(&corefile);
+	stats_begin(ECFS_STAGE_CORE);
+	if (opts.single_pass) {
+		/*
+		 * The text images (that we already read from /proc/$pid/mem)
+		 * are merged in as the core streams in, and the result is
+		 * written straight to outfile, which core2ecfs() appends to.
+		 */
+		elfdesc = stream_core_to_ecfs(STDIN_FILENO, outfile, memdesc);
+		if (elfdesc == NULL) {
+			log_msg(__LINE__, "Failed to stream core file from stdin into %s", outfile);
+			exit(-1);
+		}
+	} else
+		elfdesc = load_core_file_stdin(&core_fd);
+	stats_end(ECFS_STAGE_CORE);
+	if (opts.record_dir != NULL && replay_record_core(pid, core_fd) < 0)
+		log_msg(__LINE__, "Failed to record the core into %s", opts.record_dir);
 	
 #if DEBUG
-	log_msg(__LINE__, "Successfully read core from stdin and created temporary corefile path: %s", corefile);
+	log_msg(__LINE__, "Successfully read core from stdin into: %s", elfdesc->path);
 #endif
 	/*
 	 * Retrieve 'struct elf_prstatus' and other structures
@@ -320,6 +376,7 @@ int main(int argc, char **argv)
 #if DEBUG
 	log_msg(__LINE__, "Parsing notes area");
 #endif
+	stats_begin(ECFS_STAGE_NOTES);
 	notedesc = (notedesc_t *)parse_notes_area(elfdesc);
 	if (notedesc == NULL) {
 		log_msg(__LINE__, "Failed to parse ELF notes segment\n");
@@ -340,6 +397,7 @@ int main(int argc, char **argv)
 		unsigned long hint = text_base;
 		get_text_phdr_size_with_hint(elfdesc, hint);
 	}
+	stats_end(ECFS_STAGE_NOTES);
 	
 	/*
 	 * XXX the linux kernel only dumps 4096 bytes of any code segment
@@ -352,21 +410,23 @@ int main(int argc, char **argv)
 	 * of every single shared library which becomes our biggest bottleneck
 	 * in terms of performance.
 	 */
-	if (elfdesc->text_memsz > elfdesc->text_filesz) {
+	stats_begin(ECFS_STAGE_MERGE);
+	if (!opts.single_pass && elfdesc->text_memsz > elfdesc->text_filesz) {
 #if DEBUG
 		log_msg(__LINE__, "merging text into core");
 #endif
-		if (merge_exe_text_into_core((const char *)corefile, memdesc) < 0) {
+		if (merge_exe_text_into_core(&core_fd, memdesc) < 0) {
 			log_msg(__LINE__, "Failed to merge text into core file");
 		}
 		
-        	elfdesc = reload_core_file(elfdesc);
+        	elfdesc = reload_core_file(elfdesc, core_fd);
         	if (elfdesc == NULL) {
         		log_msg(__LINE__, "Failed to parse text-merged core file");	
                 	exit(-1);
         	} 
+		rebase_notes(notedesc, elfdesc);
 	}
-	if (opts.text_all) {
+	if (opts.text_all && !opts.single_pass) {
 #if DEBUG
 		log_msg(__LINE__, "opts.text_all is enabled");
 #endif
@@ -376,19 +436,22 @@ int main(int argc, char **argv)
 		 * default (As with regular core files) we only write out the first 4096
 		 * bytes of each shared libraries text segment. 
 		 */
-		if (merge_shlib_texts_into_core((const char *)corefile, memdesc) < 0) {
+		if (merge_shlib_texts_into_core(&core_fd, memdesc) < 0) {
 			log_msg(__LINE__, "Failed to merge shlib texts into core");
 		}
-		elfdesc = reload_core_file(elfdesc); // reload after our mods
+		elfdesc = reload_core_file(elfdesc, core_fd); // reload after our mods
 		if (elfdesc == NULL) {
 			log_msg(__LINE__, "Failed to parse shlib text merged core file");
 			exit(-1);
 		}
+		rebase_notes(notedesc, elfdesc);
 	}
+	stats_end(ECFS_STAGE_MERGE);
 
 	/*
 	 * Which mappings are stored in actual phdr segments?
 	 */
+	stats_begin(ECFS_STAGE_PHDRS);
         for (i = 0; i < elfdesc->ehdr->e_phnum; i++) {
                 for (j = 0; j < memdesc->mapcount; j++) 
                         if (memdesc->maps[j].base == (elfdesc->phdr + i)->p_vaddr)
@@ -468,6 +531,7 @@ int main(int argc, char **argv)
 			exit(-1);
 		}
 	}
+	stats_end(ECFS_STAGE_PHDRS);
 
 	/*
 	 * If we aren't dealing with a statically-compiled-only
@@ -479,9 +543,11 @@ int main(int argc, char **argv)
 #if DEBUG
 		log_msg(__LINE__, "calling fill_dynamic_symtab()");
 #endif
+		stats_begin(ECFS_STAGE_SYMBOLS);
 		ret = fill_dynamic_symtab(&list_head, notedesc->lm_files);
 		if (ret < 0) 
 			log_msg(__LINE__, "Unable to load dynamic symbol table with runtime values");
+		stats_end(ECFS_STAGE_SYMBOLS);
 	}
 	
 	/*
@@ -493,8 +559,11 @@ int main(int argc, char **argv)
 	log_msg(__LINE__, "calling mark_dll_injection()");
 #endif
 	 if (!(handle->elfstat.personality & ELF_STATIC))
-		if (opts.heuristics)
+		if (opts.heuristics) {
+			stats_begin(ECFS_STAGE_HEURISTICS);
 	 		mark_dll_injection(notedesc, memdesc, elfdesc);
+			stats_end(ECFS_STAGE_HEURISTICS);
+		}
 
 	/*
 	 * Convert the core file into an actual ECFS file and write it
@@ -503,37 +572,56 @@ int main(int argc, char **argv)
 #if DEBUG
 	log_msg(__LINE__, "calling core2ecfs()");
 #endif
+	stats_begin(ECFS_STAGE_WRITE);
 	ret = core2ecfs(outfile, handle);
 	if (ret < 0) {
 		log_msg(__LINE__, "Failed to transform core file '%s' into ecfs", argv[2]);
 		exit(-1);
 	}
 	
-	unlink(elfdesc->path); //unlink a tmp file
-	if (corefile) // incase we had to re-write file and merge in text
-		unlink(corefile);
+	if (core_fd >= 0) { // the staging file goes away with its last fd
+		munmap(elfdesc->mem, elfdesc->size);
+		close(core_fd);
+		core_fd = -1;
+	}
+	stats_end(ECFS_STAGE_WRITE);
 
 	if (!(handle->elfstat.personality & ELF_STATIC)) {
 #if DEBUG
 		log_msg(__LINE__, "calling store_dynamic_symvals()");
 #endif
+		stats_begin(ECFS_STAGE_SYMVALS);
 		ret = store_dynamic_symvals(list_head, outfile);
 		if (ret < 0) 
 			log_msg(__LINE__, "Unable to store runtime values into dynamic symbol table");
+		stats_end(ECFS_STAGE_SYMVALS);
 	}
 	
 #if DEBUG
 	log_msg(__LINE__, "finished storing symvals");
 #endif
-done: 
-        
-	unlink(elfdesc->path); // unlink tmp file
-        if (corefile) // incase we had to re-write file and mege in text
-        	unlink(corefile);
-	
 	/*
-	 * XXX add line to umount ramdisk
+	 * Compression has to be last since it moves the
+	 * section header table and punches out the segments.
 	 */
+	if (opts.compress) {
+		stats_begin(ECFS_STAGE_COMPRESS);
+		if (compress_ecfs_file(outfile) < 0)
+			log_msg(__LINE__, "Failed to compress %s, leaving it uncompressed", outfile);
+		stats_end(ECFS_STAGE_COMPRESS);
+	}
+	if (stats_update_file(outfile) < 0)
+		log_msg(__LINE__, "Unable to store final stage stats in %s", outfile);
+done: 
+	arena_stats(arena_line, sizeof(arena_line));
+	log_msg(__LINE__, "%s", arena_line);
+	if (opts.stats_log) {
+		stats_summary(stats_line, sizeof(stats_line));
+		log_msg(__LINE__, "%s", stats_line);
+	}
+        
+	if (core_fd >= 0)
+		close(core_fd);
         return 0;
 }
 
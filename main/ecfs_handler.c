@@ -24,6 +24,7 @@
  */
 
 #include "../include/ecfs_handler.h"
+#include "../include/ecfsd.h"
 #include <syslog.h>
 #include <stdarg.h>
 
@@ -62,6 +63,188 @@ static void load_ecfs_worker(char **argv, char **envp, const char *ecfs_worker_p
 
 }
 
+static void load_handler_conf(struct handler_conf *conf)
+{
+	char line[256], key[64];
+	FILE *fp;
+	int val;
+
+	conf->max_workers = ECFS_DEFAULT_MAX_WORKERS;
+	conf->max_queued = ECFS_DEFAULT_MAX_QUEUED;
+	conf->queue_timeout = ECFS_DEFAULT_QUEUE_TIMEOUT;
+	conf->rate_limit = ECFS_DEFAULT_RATE_LIMIT;
+	conf->rate_window = ECFS_DEFAULT_RATE_WINDOW;
+
+	if ((fp = fopen(ECFS_HANDLER_CONF, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || sscanf(line, " %63[a-z_] = %d", key, &val) != 2 || val < 0)
+			continue;
+		if (!strcmp(key, "max_workers"))
+			conf->max_workers = val;
+		else if (!strcmp(key, "max_queued"))
+			conf->max_queued = val;
+		else if (!strcmp(key, "queue_timeout"))
+			conf->queue_timeout = val;
+		else if (!strcmp(key, "rate_limit"))
+			conf->rate_limit = val;
+		else if (!strcmp(key, "rate_window"))
+			conf->rate_window = val;
+		else
+			log_msg(__LINE__, "unknown key in %s: %s", ECFS_HANDLER_CONF, key);
+	}
+	fclose(fp);
+}
+
+/*
+ * Try to take one of count lock files named <prefix>.N in
+ * ECFS_SLOT_DIR without blocking. flock() locks go away with the
+ * process, so a handler that is killed can never leak a slot.
+ * Returns the locked fd, or -1 if every slot is taken.
+ */
+static int take_slot(const char *prefix, int count)
+{
+	char path[256];
+	int i, fd;
+
+	for (i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/%s.%d", ECFS_SLOT_DIR, prefix, i);
+		if ((fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR)) < 0) {
+			log_msg(__LINE__, "open %s: %s", path, strerror(errno));
+			return -1;
+		}
+		if (flock(fd, LOCK_EX|LOCK_NB) == 0)
+			return fd;
+		close(fd);
+	}
+	return -1;
+}
+
+/*
+ * Returns 1 if another full dump of exename is allowed in the
+ * current window. The per-executable counter lives in a small
+ * file under ECFS_RATE_DIR that is updated under flock().
+ */
+static int rate_check(struct handler_conf *conf, const char *exename)
+{
+	char path[512], buf[64], *p;
+	long start = 0, count = 0;
+	time_t now = time(NULL);
+	ssize_t n;
+	int fd;
+
+	if (conf->rate_limit == 0)
+		return 1;
+	mkdir(ECFS_RATE_DIR, S_IRWXU);
+	snprintf(path, sizeof(path), "%s/%s", ECFS_RATE_DIR, exename);
+	for (p = path + strlen(ECFS_RATE_DIR) + 1; *p != '\0'; p++)
+		if (*p == '/')
+			*p = '_';
+	if ((fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR)) < 0)
+		return 1;
+	flock(fd, LOCK_EX);
+	if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[n] = '\0';
+		sscanf(buf, "%ld %ld", &start, &count);
+	}
+	if (now - start >= conf->rate_window) {
+		start = now;
+		count = 0;
+	}
+	count++;
+	n = snprintf(buf, sizeof(buf), "%ld %ld\n", start, count);
+	if (pwrite(fd, buf, n, 0) == n)
+		ftruncate(fd, n);
+	close(fd);
+	return count <= conf->rate_limit;
+}
+
+/*
+ * Wait for a worker slot. We first need one of the queue slots, so
+ * that when the queue is full the handler gives up straight away
+ * instead of piling up behind everyone else. Returns the locked
+ * worker slot fd (which must stay open while the worker runs), or
+ * -1 with *reason set.
+ */
+static int admit(struct handler_conf *conf, const char *exename, const char **reason)
+{
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = 10 * 1000000 };
+	time_t deadline;
+	int fd, qfd;
+
+	if (!rate_check(conf, exename)) {
+		*reason = "rate limited";
+		return -1;
+	}
+	if (conf->max_workers == 0)
+		return open("/dev/null", O_RDONLY|O_CLOEXEC);
+	mkdir(ECFS_SLOT_DIR, S_IRWXU);
+	if ((fd = take_slot("run", conf->max_workers)) >= 0)
+		return fd;
+	if ((qfd = take_slot("queue", conf->max_queued)) < 0) {
+		*reason = "queue full";
+		return -1;
+	}
+	deadline = time(NULL) + conf->queue_timeout;
+	while ((fd = take_slot("run", conf->max_workers)) < 0) {
+		if (time(NULL) >= deadline) {
+			*reason = "timed out in queue";
+			break;
+		}
+		nanosleep(&delay, NULL);
+		if (delay.tv_nsec < 250 * 1000000)
+			delay.tv_nsec <<= 1;
+	}
+	close(qfd);
+	return fd;
+}
+
+static void copy_proc_file(FILE *out, int pid, const char *name)
+{
+	char path[64], buf[4096];
+	ssize_t i, n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return;
+	fprintf(out, "--- %s ---\n", name);
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++)	// cmdline is NUL separated
+			if (buf[i] == '\0')
+				buf[i] = ' ';
+		fwrite(buf, 1, n, out);
+	}
+	fputc('\n', out);
+	close(fd);
+}
+
+/*
+ * The compact record written instead of an ECFS file for dumps that
+ * weren't admitted. The core pipe is never read, so the kernel
+ * finishes the dump and releases the process as soon as we exit.
+ */
+static void write_summary(const char *outfile, const char *exename, int pid, const char *reason)
+{
+	char path[512], link[64], exe[512];
+	ssize_t n;
+	FILE *out;
+
+	snprintf(path, sizeof(path), "%s.summary", outfile);
+	if ((out = fopen(path, "w")) == NULL) {
+		log_msg(__LINE__, "fopen %s: %s", path, strerror(errno));
+		return;
+	}
+	snprintf(link, sizeof(link), "/proc/%d/exe", pid);
+	n = readlink(link, exe, sizeof(exe) - 1);
+	exe[n < 0 ? 0 : n] = '\0';
+	fprintf(out, "ecfs: full dump skipped (%s)\npid: %d\nexename: %s\nexe: %s\ntime: %ld\n",
+	    reason, pid, exename, exe, (long)time(NULL));
+	copy_proc_file(out, pid, "cmdline");
+	copy_proc_file(out, pid, "status");
+	fclose(out);
+}
+
 /*
  * If we cannot get architecture this way its probably
  * because the executable no longer exists? In this case
@@ -108,18 +291,31 @@ int main(int argc, char **argv, char **envp)
 	char *exename;
 	char *exepath;
 	char *ecfs_worker;
+	const char *reason = NULL;
+	struct handler_conf conf;
+	char procpath[64];
+	int slot, procfd;
 
   	if (argc < 2) {
                 fprintf(stdout, "Usage: %s [-peo]\n", argv[0]);
                 fprintf(stdout, "- To be used with /proc/sys/kernel/core_pattern\n");
                 fprintf(stdout, "[-p]   pid of process (Supplied by %%p format arg in core_pattern)\n");
                 fprintf(stdout, "[-e]   executable path (Supplied by %%e format arg in core_pattern)\n");
-                fprintf(stdout, "[-o]   output ecfs file\n\n");
+                fprintf(stdout, "[-o]   output ecfs file\n");
+                fprintf(stdout, "- Concurrency, queueing and per-executable rate limits are read from %s\n\n", ECFS_HANDLER_CONF);
 		fprintf(stdout, "[-t]	Write complete text image of all shlibs (vs. the default 4096 bytes)\n");
 		fprintf(stdout, "[-h]	Turn on heuristics for detecting .so injection attacks\n");
+		fprintf(stdout, "[-s]	Single pass: stream the core directly into the output file\n");
+		fprintf(stdout, "[-z]	Sparse output: leave holes in place of zero pages\n");
+		fprintf(stdout, "[-c]	Compress segment data into randomly accessible chunks\n");
+		fprintf(stdout, "[-d]	With -t, keep shlib texts in /opt/ecfs/textstore and reference them\n");
+		fprintf(stdout, "[-j]	Number of threads used to resolve shared library symbols\n");
+		fprintf(stdout, "[-y]	Use the persistent shared library symbol cache in /opt/ecfs/symcache\n");
+		fprintf(stdout, "[-l]	Log a summary of the per stage capture stats (.ecfs_stats)\n");
+		fprintf(stdout, "[-R]	Record a replayable /proc snapshot and the core into <dir>/<pid>\n");
                 exit(0);
         }
-        while ((c = getopt(argc, argv, "th:o:p:e:")) != -1) {
+        while ((c = getopt(argc, argv, "tszcdylj:h:o:p:e:R:")) != -1) {
                 switch(c) {
                         case 'o':
                                 outfile = strdup(optarg);
@@ -136,6 +332,15 @@ int main(int argc, char **argv, char **envp)
                         case 't':
                                 text_all = 1;
                                 break;
+                        case 's':
+                        case 'z':
+                        case 'c':
+                        case 'd':
+                        case 'j':
+                        case 'y':
+                        case 'l':
+                        case 'R':
+                                break; // passed through to the worker in argv
                         default:
                                 fprintf(stderr, "Unknown option\n");
                                 exit(0);
@@ -147,6 +352,13 @@ int main(int argc, char **argv, char **envp)
 		exit(-1);
 	}
 	
+	load_handler_conf(&conf);
+	if ((slot = admit(&conf, exename, &reason)) < 0) {
+		log_msg(__LINE__, "not converting %s (pid %d) to ECFS: %s", exename, pid, reason == NULL ? "no slot" : reason);
+		write_summary(outfile, exename, pid, reason == NULL ? "no slot" : reason);
+		exit(0);
+	}
+
 	exepath = alloca(512);
 	snprintf(exepath, 512, "/proc/%d/exe", pid);
 	
@@ -170,7 +382,21 @@ int main(int argc, char **argv, char **envp)
 			break;
 	}
 	
+	/*
+	 * Hand the dump to a warm ecfsd worker if one is running; we can
+	 * exit as soon as it has the pipe. Otherwise run the worker here.
+	 */
+	if (arch == 64) {
+		snprintf(procpath, sizeof(procpath), "/proc/%d", pid);
+		argv[0] = ECFS_WORKER_64;
+		if ((procfd = open(procpath, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) >= 0) {
+			if (ecfsd_submit(argc, argv, STDIN_FILENO, procfd) == 0)
+				exit(0);
+			close(procfd);
+		}
+	}
 	load_ecfs_worker(argv, envp, ecfs_worker);
+	close(slot);
 
 	exit(0);
 }
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/ecfsd.h"
+#include "../include/ecfs_handler.h"
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/*
+ * ecfsd: keeps ECFSD_DEFAULT_WORKERS (or -n) warm ecfs workers
+ * waiting on ECFSD_SOCKET and replaces each one as it exits.
+ */
+
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+static pid_t spawn_worker(int lfd, int symcache)
+{
+	char *args[] = { ECFS_WORKER_64, ECFSD_WORKER_ARG, symcache ? "-y" : NULL, NULL };
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		log_msg(__LINE__, "fork %s", strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		if (lfd != ECFSD_LISTEN_FD) {
+			dup2(lfd, ECFSD_LISTEN_FD);
+			close(lfd);
+		}
+		execv(ECFS_WORKER_64, args);
+		log_msg(__LINE__, "execv %s: %s", ECFS_WORKER_64, strerror(errno));
+		_exit(-1);
+	}
+	return pid;
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	int nworkers = ECFSD_DEFAULT_WORKERS;
+	int foreground = 0, symcache = 0;
+	int c, i, lfd, status, running = 0;
+	pid_t *workers, pid;
+
+	while ((c = getopt(argc, argv, "fyn:")) != -1) {
+		switch(c) {
+			case 'f':
+				foreground = 1;
+				break;
+			case 'y':
+				symcache = 1;
+				break;
+			case 'n':
+				nworkers = atoi(optarg);
+				break;
+			default:
+				fprintf(stdout, "Usage: %s [-fyn]\n", argv[0]);
+				fprintf(stdout, "[-f]	stay in the foreground\n");
+				fprintf(stdout, "[-y]	pre-load the symbol cache entries of common libraries in each worker\n");
+				fprintf(stdout, "[-n]	number of warm workers (default %d)\n", ECFSD_DEFAULT_WORKERS);
+				exit(-1);
+		}
+	}
+	if (nworkers <= 0)
+		nworkers = 1;
+
+	/*
+	 * The listening fd must be the one workers look for, and it is
+	 * the only descriptor they inherit from us.
+	 */
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		log_msg(__LINE__, "socket %s", strerror(errno));
+		exit(-1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, ECFSD_SOCKET, sizeof(addr.sun_path) - 1);
+	unlink(ECFSD_SOCKET);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 128) < 0) {
+		log_msg(__LINE__, "bind/listen %s: %s", ECFSD_SOCKET, strerror(errno));
+		exit(-1);
+	}
+	chmod(ECFSD_SOCKET, S_IRUSR|S_IWUSR);
+	if (!foreground && daemon(0, 0) < 0) {
+		log_msg(__LINE__, "daemon %s", strerror(errno));
+		exit(-1);
+	}
+	if (lfd != ECFSD_LISTEN_FD) {
+		if (dup2(lfd, ECFSD_LISTEN_FD) < 0) {
+			log_msg(__LINE__, "dup2 %s", strerror(errno));
+			exit(-1);
+		}
+		close(lfd);
+		lfd = ECFSD_LISTEN_FD;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	workers = heapAlloc(nworkers * sizeof(pid_t));
+	while (!quit) {
+		for (i = 0; i < nworkers; i++) {
+			if (workers[i] == 0 && (workers[i] = spawn_worker(lfd, symcache)) > 0)
+				running++;
+		}
+		if ((pid = wait(&status)) < 0) {
+			if (errno == EINTR)
+				continue;
+			/*
+			 * fork is failing; don't spin.
+			 */
+			sleep(1);
+			continue;
+		}
+		for (i = 0; i < nworkers; i++) {
+			if (workers[i] == pid) {
+				workers[i] = 0;
+				running--;
+				break;
+			}
+		}
+	}
+	/*
+	 * Idle workers are blocked in accept(); busy ones are left to
+	 * finish their dump.
+	 */
+	unlink(ECFSD_SOCKET);
+	close(lfd);
+	for (i = 0; i < nworkers; i++)
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+	log_msg(__LINE__, "ecfsd exiting, %d workers signaled", running);
+	exit(0);
+}
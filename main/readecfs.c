@@ -42,6 +42,7 @@ struct {
 	int gotinfo;
 	int auxv;
 	int personality;
+	int stats;
 	int all;
 } opts = {0};
 
@@ -96,8 +97,8 @@ int main(int argc, char **argv)
 
 usage:
 	if (argc < 3) {
-		printf("Usage: %s [-RAPSslphega] <ecfscore>\n", argv[0]);
-		printf("-a	print all (equiv to -Sslphega)\n");
+		printf("Usage: %s [-RAPTSslphega] <ecfscore>\n", argv[0]);
+		printf("-a	print all (equiv to -TSslphega)\n");
 		printf("-s	print symbol table info\n");
 		printf("-l	print shared library names\n");
 		printf("-p	print ELF program headers\n");
@@ -106,6 +107,7 @@ usage:
 		printf("-g	print PLTGOT info\n");
 		printf("-A	print Auxiliary vector\n");
 		printf("-P	print personality info\n");
+		printf("-T	print per stage capture stats (.ecfs_stats)\n");
 		printf("-e	print ecfs specific (auiliary vector, process state, sockets, pipes, fd's, etc.)\n"); 
 		printf("\n-[Secondary use to view raw data from a section]\n");
 		printf("-R <ecfscore> <section>\n\n");
@@ -119,7 +121,7 @@ usage:
 		exit(-1);
 	}
 	
-	while ((c = getopt(argc, argv, "RAPSslphega")) != -1) {
+	while ((c = getopt(argc, argv, "RAPTSslphega")) != -1) {
 		switch(c) {
 			case 'S':
 				opts.shdrs++;
@@ -148,6 +150,9 @@ usage:
 			case 'A':
 				opts.auxv++;
 				break;
+			case 'T':
+				opts.stats++;
+				break;
 			case 'a':
 				opts.all++;
 				break;
@@ -223,6 +228,9 @@ usage:
                                         printf("\tDST: %s:%d\n", inet_ntoa(fdinfo[i].socket.dst_addr), fdinfo[i].socket.dst_port);
                                         printf("\n");
 					break;
+				case NET_UNIX:
+					printf("\tPROTOCOL: UNIX\n\n");
+					break;
 				}
 
 			}
@@ -310,6 +318,24 @@ usage:
 		}
 	}
 	
+	if (opts.stats || opts.ecfs_stuff || opts.all) {
+		ecfs_stat_t *stats;
+		ret = get_ecfs_stats(desc, &stats);
+		printf("\n- Capture stats (.ecfs_stats):\n");
+		if (ret < 0)
+			printf("\tnone (file was made by an ecfs without stage stats)\n");
+		else {
+			printf("stage            wall(ms)     cpu(ms)      read         written      peak rss(kB)\n");
+			for (i = 0; i < ret; i++) {
+				if (stats[i].name[0] == '\0')
+					continue;
+				printf("%-16.16s %-12.3f %-12.3f %-12lu %-12lu %lu\n", stats[i].name,
+				    stats[i].wall_ns / 1e6, stats[i].cpu_ns / 1e6, stats[i].bytes_read,
+				    stats[i].bytes_written, stats[i].peak_rss_kb);
+			}
+		}
+	}
+
 	ElfW(Ehdr) *ehdr = desc->ehdr;
 	ElfW(Shdr) *shdr = desc->shdr;
 	ElfW(Phdr) *phdr = desc->phdr;
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Post-pass that turns a finished ECFS file into the compressed
+ * variant. Every PT_LOAD body is deflated in ECFS_ZCHUNK_SIZE chunks
+ * which are appended to the end of the file, and the range each chunk
+ * came from is punched out so that it no longer takes up disk space.
+ * All offsets (phdrs, shdrs) stay exactly as they were; libecfs uses
+ * the .zindex section to inflate chunks back into place on demand.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/compress.h"
+#include <zlib.h>
+
+static int append(int fd, const void *buf, size_t len, off_t *end)
+{
+	const uint8_t *p = buf;
+	size_t total = 0;
+	ssize_t n;
+
+	while (total < len) {
+		n = pwrite(fd, p + total, len - total, *end + total);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_msg(__LINE__, "pwrite %s", strerror(errno));
+			return -1;
+		}
+		total += n;
+	}
+	*end += len;
+	return 0;
+}
+
+static void punch_chunk(int fd, ecfs_zchunk_t *chunk)
+{
+	off_t start = (chunk->offset + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	off_t end = (chunk->offset + chunk->size) & ~(PAGE_SIZE - 1);
+
+	if (end <= start)
+		return;
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, start, end - start) < 0) {
+#if DEBUG
+		log_msg(__LINE__, "fallocate(FALLOC_FL_PUNCH_HOLE) %s", strerror(errno));
+#endif
+	}
+}
+
+int compress_ecfs_file(const char *path)
+{
+	ElfW(Ehdr) *ehdr;
+	ElfW(Phdr) *phdr;
+	ElfW(Shdr) *shdr, *new_shdr;
+	ecfs_zchunk_t *chunks;
+	uint8_t *mem, *zbuf;
+	char *shstrtab, *new_shstrtab;
+	size_t shstrtab_size, count, max_chunks, raw = 0, stored = 0;
+	uLongf zlen;
+	off_t end;
+	struct stat st;
+	int fd, i, shnum;
+	ElfW(Off) off, seg_end;
+
+	fd = xopen(path, O_RDWR);
+	xfstat(fd, &st);
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		log_msg(__LINE__, "mmap %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	ehdr = (ElfW(Ehdr) *)mem;
+	phdr = (ElfW(Phdr) *)&mem[ehdr->e_phoff];
+	shdr = (ElfW(Shdr) *)&mem[ehdr->e_shoff];
+	if (ehdr->e_shoff == 0 || ehdr->e_shstrndx == SHN_UNDEF) {
+		log_msg(__LINE__, "compress_ecfs_file(): %s has no section headers", path);
+		goto fail;
+	}
+
+	for (max_chunks = 0, i = 0; i < ehdr->e_phnum; i++)
+		if (phdr[i].p_type == PT_LOAD)
+			max_chunks += (phdr[i].p_filesz + ECFS_ZCHUNK_SIZE - 1) / ECFS_ZCHUNK_SIZE;
+	chunks = (ecfs_zchunk_t *)heapAlloc(sizeof(ecfs_zchunk_t) * (max_chunks + 1));
+	zbuf = heapAlloc(compressBound(ECFS_ZCHUNK_SIZE));
+
+	/*
+	 * Chunks are appended after everything that is already in the
+	 * file. Chunks that don't shrink are left where they are.
+	 */
+	end = (st.st_size + 7) & ~7;
+	for (count = 0, i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type != PT_LOAD || phdr[i].p_filesz == 0)
+			continue;
+		seg_end = phdr[i].p_offset + phdr[i].p_filesz;
+		if (seg_end > st.st_size)
+			seg_end = st.st_size;
+		for (off = phdr[i].p_offset; off < seg_end; off += ECFS_ZCHUNK_SIZE) {
+			ecfs_zchunk_t *c = &chunks[count++];
+
+			c->offset = off;
+			c->size = seg_end - off > ECFS_ZCHUNK_SIZE ? ECFS_ZCHUNK_SIZE : seg_end - off;
+			zlen = compressBound(ECFS_ZCHUNK_SIZE);
+			raw += c->size;
+			if (compress2(zbuf, &zlen, &mem[off], c->size, Z_BEST_SPEED) != Z_OK || zlen >= c->size) {
+				c->stored_offset = c->offset;
+				c->stored_size = 0;
+				stored += c->size;
+				continue;
+			}
+			c->stored_offset = end;
+			c->stored_size = zlen;
+			if (append(fd, zbuf, zlen, &end) < 0)
+				goto fail;
+			stored += zlen;
+			punch_chunk(fd, c);
+		}
+	}
+
+	/*
+	 * Append the index, then a copy of .shstrtab with the new
+	 * section name, then a new section header table that
+	 * describes the index. The ehdr is pointed at the new table.
+	 */
+	end = (end + 7) & ~7;
+	shnum = ehdr->e_shnum;
+	new_shdr = (ElfW(Shdr) *)heapAlloc(sizeof(ElfW(Shdr)) * (shnum + 1));
+	memcpy(new_shdr, shdr, sizeof(ElfW(Shdr)) * shnum);
+
+	new_shdr[shnum].sh_name = shdr[ehdr->e_shstrndx].sh_size;
+	new_shdr[shnum].sh_type = SHT_PROGBITS;
+	new_shdr[shnum].sh_offset = end;
+	new_shdr[shnum].sh_size = count * sizeof(ecfs_zchunk_t);
+	new_shdr[shnum].sh_entsize = sizeof(ecfs_zchunk_t);
+	new_shdr[shnum].sh_addralign = 8;
+	if (append(fd, chunks, count * sizeof(ecfs_zchunk_t), &end) < 0)
+		goto fail;
+
+	shstrtab = (char *)&mem[shdr[ehdr->e_shstrndx].sh_offset];
+	shstrtab_size = shdr[ehdr->e_shstrndx].sh_size;
+	new_shstrtab = heapAlloc(shstrtab_size + sizeof(ECFS_ZINDEX_NAME));
+	memcpy(new_shstrtab, shstrtab, shstrtab_size);
+	memcpy(&new_shstrtab[shstrtab_size], ECFS_ZINDEX_NAME, sizeof(ECFS_ZINDEX_NAME));
+	new_shdr[ehdr->e_shstrndx].sh_offset = end;
+	new_shdr[ehdr->e_shstrndx].sh_size = shstrtab_size + sizeof(ECFS_ZINDEX_NAME);
+	if (append(fd, new_shstrtab, shstrtab_size + sizeof(ECFS_ZINDEX_NAME), &end) < 0)
+		goto fail;
+
+	end = (end + 7) & ~7;
+	ElfW(Ehdr) new_ehdr = *ehdr;
+	new_ehdr.e_shoff = end;
+	new_ehdr.e_shnum = shnum + 1;
+	if (append(fd, new_shdr, sizeof(ElfW(Shdr)) * (shnum + 1), &end) < 0)
+		goto fail;
+	if (pwrite(fd, &new_ehdr, sizeof(new_ehdr), 0) != sizeof(new_ehdr)) {
+		log_msg(__LINE__, "pwrite %s", strerror(errno));
+		goto fail;
+	}
+#if DEBUG
+	log_msg(__LINE__, "compress_ecfs_file(): %lu chunks, %lu bytes of segment data stored in %lu bytes",
+	    (unsigned long)count, (unsigned long)raw, (unsigned long)stored);
+#endif
+	munmap(mem, st.st_size);
+	close(fd);
+	free(new_shstrtab);
+	free(new_shdr);
+	free(chunks);
+	free(zbuf);
+	return 0;
+fail:
+	munmap(mem, st.st_size);
+	close(fd);
+	return -1;
+}
@@ -26,6 +26,10 @@
 #include "../include/ecfs.h"
 #include "../include/util.h"
 #include "../include/eh_frame.h"
+#include "../include/strtab.h"
+#include "../include/stats.h"
+#include <sys/uio.h>
+#include <limits.h>
 
 void build_elf_stats(handle_t *handle)
 {
@@ -68,46 +72,68 @@ void build_elf_stats(handle_t *handle)
  */
 static int text_shdr_index;
 
+/*
+ * With -t the shared library texts are part of the ecfs file, so we
+ * also give their functions local symbols. Returns the number of
+ * entries appended to *fndata (which is grown as needed).
+ */
+static int add_shlib_functions(handle_t *handle, ElfW(Shdr) *shdr, int shnum,
+			       struct fde_func_data **fndata, int fncount, int **shndx)
+{
+	struct lib_mappings *lm = handle->notedesc->lm_files;
+	struct fde_func_data *libfuncs;
+	int i, j, k, count, text_index, total = 0;
+
+	for (i = 0; i < lm->libcount; i++) {
+		/*
+		 * The first mapping of each library is its load base
+		 */
+		for (j = 0; j < i; j++)
+			if (!strcmp(lm->libs[j].path, lm->libs[i].path))
+				break;
+		if (j != i || lm->libs[i].path[0] == '\0')
+			continue;
+		for (text_index = SHN_ABS, j = 0; j < lm->libcount; j++) {
+			if (strcmp(lm->libs[j].path, lm->libs[i].path) || lm->libs[j].flags != (PF_R|PF_X))
+				continue;
+			for (k = 0; k < shnum; k++)
+				if ((shdr[k].sh_type == SHT_SHLIB || shdr[k].sh_type == SHT_INJECTED) &&
+				    shdr[k].sh_addr == lm->libs[j].addr)
+					text_index = k;
+		}
+		count = get_shlib_functions(lm->libs[i].path, lm->libs[i].addr, &libfuncs);
+		if (count <= 0)
+			continue;
+#if DEBUG
+		log_msg(__LINE__, "Found %d functions from .eh_frame of %s", count, lm->libs[i].path);
+#endif
+		*fndata = realloc(*fndata, sizeof(struct fde_func_data) * (fncount + total + count));
+		*shndx = realloc(*shndx, sizeof(int) * (fncount + total + count));
+		if (*fndata == NULL || *shndx == NULL) {
+			log_msg(__LINE__, "realloc %s", strerror(errno));
+			exit(-1);
+		}
+		memcpy(&(*fndata)[fncount + total], libfuncs, sizeof(struct fde_func_data) * count);
+		for (j = 0; j < count; j++)
+			(*shndx)[fncount + total + j] = text_index;
+		total += count;
+		free(libfuncs);
+	}
+	return total;
+}
+
 static int build_local_symtab_and_finalize(const char *outfile, handle_t *handle)
 {
-	struct fde_func_data *fndata, *fdp;
+	struct fde_func_data *fndata = NULL, *fdp;
         int fncount, fd;
         struct stat st;
 	uint8_t *mem;
 	ElfW(Ehdr) *ehdr;
 	ElfW(Shdr) *shdr;
-	int i;
+	int i, *shndx = NULL;
 	char *StringTable;
-	char *strtab = heapAlloc(8192 * 32);
+	symtab_builder_t symtab;
 
-        fncount = get_all_functions(outfile, &fndata);
- 	if (fncount < 0)
-		fncount = 0;             	
-	
-#if DEBUG
-	log_msg(__LINE__, "Found %d local functions from .eh_frame\n", fncount);
-#endif
-        
-	ElfW(Sym) *symtab = (ElfW(Sym) *)heapAlloc(fncount * sizeof(ElfW(Sym)));
-        fdp = (struct fde_func_data *)fndata; 
-        char *sname;
-        int symstroff = 0;
-        int symcount = fncount;
-        int dsymcount = 0;
-        
-        for (i = 0; i < fncount; i++) {
-                symtab[i].st_value = fdp[i].addr;
-                symtab[i].st_size = fdp[i].size;
-                symtab[i].st_info = (((STB_GLOBAL) << 4) + ((STT_FUNC) & 0xf));
-                symtab[i].st_other = 0;
-                symtab[i].st_shndx = text_shdr_index;
-                symtab[i].st_name = symstroff;
-                sname = xfmtstrdup("sub_%lx", fdp[i].addr);
-                strcpy(&strtab[symstroff], sname);
-                symstroff += strlen(sname) + 1;
-                free(sname);    
-                
-        }
  	 /*
          * We append symbol table sections last 
          */
@@ -129,25 +155,53 @@ static int build_local_symtab_and_finalize(const char *outfile, handle_t *handle
         ehdr = (ElfW(Ehdr) *)mem;
         shdr = (ElfW(Shdr) *)&mem[ehdr->e_shoff];
 
+	/*
+	 * .eh_frame_hdr/.eh_frame are parsed straight out of the
+	 * mapped file rather than through libdwarf.
+	 */
+        fncount = get_ecfs_functions(outfile, mem, st.st_size, &fndata);
+ 	if (fncount < 0)
+		fncount = 0;             	
+	
+#if DEBUG
+	log_msg(__LINE__, "Found %d local functions from .eh_frame\n", fncount);
+#endif
+	shndx = (int *)heapAlloc((fncount ? fncount : 1) * sizeof(int));
+	for (i = 0; i < fncount; i++)
+		shndx[i] = text_shdr_index;
+	if (opts.text_all && handle->notedesc->lm_files != NULL)
+		fncount += add_shlib_functions(handle, shdr, ehdr->e_shnum, &fndata, fncount, &shndx);
+        
+	symtab_builder_init(&symtab, fncount);
+        fdp = (struct fde_func_data *)fndata; 
+        int dsymcount = 0;
+        
+        for (i = 0; i < fncount; i++)
+		symtab_builder_add(&symtab, strtab_add_hex(&symtab.strtab, "sub_", fdp[i].addr),
+				   fdp[i].addr, fdp[i].size, (((STB_GLOBAL) << 4) + ((STT_FUNC) & 0xf)), shndx[i]);
+	free(fndata);
+	free(shndx);
+
         if (lseek(fd, 0, SEEK_END) < 0) {
                 log_msg(__LINE__, "lseek %s", strerror(errno));
                 exit(-1);
         }
 	
+	/*
+	 * .symtab followed by .strtab, both in one go
+	 */
         uint64_t symtab_offset = lseek(fd, 0, SEEK_CUR);
-        for (i = 0; i < symcount; i++) {
-                if( write(fd, (char *)&symtab[i], sizeof(ElfW(Sym))) == -1 ) {
-                    log_msg(__LINE__, "write %s", strerror(errno));
-                    exit(-1);
-                }
-        }
+        uint64_t stloff = symtab_offset + symtab.count * sizeof(ElfW(Sym));
+	struct iovec iov[2];
+	iov[0].iov_base = symtab.syms;
+	iov[0].iov_len = symtab.count * sizeof(ElfW(Sym));
+	iov[1].iov_base = symtab.strtab.buf;
+	iov[1].iov_len = symtab.strtab.len;
+	if (writev(fd, iov, 2) != (ssize_t)(iov[0].iov_len + iov[1].iov_len)) {
+		log_msg(__LINE__, "writev %s", strerror(errno));
+		exit(-1);
+	}
       	StringTable = (char *)&mem[shdr[ehdr->e_shstrndx].sh_offset];
-        /* Write section hdr string table */
-        uint64_t stloff = lseek(fd, 0, SEEK_CUR);
-        if( write(fd, strtab, symstroff) == -1) {
-            log_msg(__LINE__, "write %s", strerror(errno));
-            exit(-1);
-        }
         shdr = (ElfW(Shdr) *)(mem + ehdr->e_shoff);
 	
         for (i = 0; i < ehdr->e_shnum; i++) {
@@ -157,7 +211,7 @@ static int build_local_symtab_and_finalize(const char *outfile, handle_t *handle
                 } else
                 if (!strcmp(&StringTable[shdr[i].sh_name], ".strtab")) {
                         shdr[i].sh_offset = stloff;
-                        shdr[i].sh_size = symstroff;
+                        shdr[i].sh_size = symtab.strtab.len;
                 } else
                 if (!strcmp(&StringTable[shdr[i].sh_name], ".dynsym")) 
                         dsymcount = shdr[i].sh_size / sizeof(ElfW(Sym));
@@ -175,7 +229,7 @@ static int build_local_symtab_and_finalize(const char *outfile, handle_t *handle
                 }
         }
         
-	free(strtab);
+	symtab_builder_free(&symtab);
         msync(mem, st.st_size, MS_SYNC);
         munmap(mem, st.st_size);
         close(fd);
@@ -190,9 +244,8 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         notedesc_t *notedesc = handle->notedesc;
         struct section_meta *smeta = &handle->smeta;
 	ElfW(Shdr) *shdr = heapAlloc(sizeof(ElfW(Shdr)) * MAX_SHDR_COUNT);
-        char *StringTable = (char *)heapAlloc(MAX_SHDR_COUNT * 64);
+        strtab_t shstrtab;
 	struct stat st;
-        unsigned int stoffset = 0;
         int scount = 0, dynsym_index;
 	int i, dynamic;
 
@@ -201,6 +254,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
 	 * Get the offset of where the shdrs are being written
 	 */
 	loff_t e_shoff = lseek(fd, 0, SEEK_CUR);
+	strtab_init(&shstrtab, MAX_SHDR_COUNT * 16);
 	
 	shdr[scount].sh_type = SHT_NULL;
         shdr[scount].sh_offset = 0;
@@ -211,8 +265,6 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_size = 0;
         shdr[scount].sh_addralign = 0;
         shdr[scount].sh_name = 0;
-        strcpy(&StringTable[stoffset], "");
-        stoffset += 1;
         scount++;
 	
 	if (dynamic) {
@@ -228,9 +280,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = 0;
         	shdr[scount].sh_size = elfdesc->interpSize;
         	shdr[scount].sh_addralign = 1;
-        	shdr[scount].sh_name = stoffset;
-        	strcpy(&StringTable[stoffset], ".interp");
-        	stoffset += strlen(".interp") + 1;
+        	shdr[scount].sh_name = strtab_add(&shstrtab, ".interp");
         	scount++;
 	}
 	
@@ -246,9 +296,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 0;
         shdr[scount].sh_size = elfdesc->noteSize;
         shdr[scount].sh_addralign = 4;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".note");
-        stoffset += strlen(".note") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".note");
         scount++;
 	
 	if (dynamic) {
@@ -264,9 +312,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = 0;
         	shdr[scount].sh_size = global_hacks.hash_size <= 0 ? UNKNOWN_SHDR_SIZE : global_hacks.hash_size;
         	shdr[scount].sh_addralign = 4;
-        	shdr[scount].sh_name = stoffset;
-        	strcpy(&StringTable[stoffset], ".hash");
-        	stoffset += strlen(".hash") + 1;
+        	shdr[scount].sh_name = strtab_add(&shstrtab, ".hash");
         	scount++;
 	
 	 	/*
@@ -282,9 +328,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = sizeof(ElfW(Sym));
         	shdr[scount].sh_size = smeta->dstrOff - smeta->dsymOff;
         	shdr[scount].sh_addralign = sizeof(long);
-        	shdr[scount].sh_name = stoffset;
-        	strcpy(&StringTable[stoffset], ".dynsym");
-        	stoffset += strlen(".dynsym") + 1;
+        	shdr[scount].sh_name = strtab_add(&shstrtab, ".dynsym");
         	scount++;
 
         	/*
@@ -299,9 +343,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = sizeof(ElfW(Sym));
         	shdr[scount].sh_size = smeta->strSiz;
         	shdr[scount].sh_addralign = 1;
-        	shdr[scount].sh_name = stoffset;
-        	strcpy(&StringTable[stoffset], ".dynstr");
-        	stoffset += strlen(".dynstr") + 1;
+        	shdr[scount].sh_name = strtab_add(&shstrtab, ".dynstr");
         	scount++;
 	
 		/*
@@ -316,14 +358,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = (__ELF_NATIVE_CLASS == 64) ? sizeof(Elf64_Rela) : sizeof(Elf32_Rel);
         	shdr[scount].sh_size = global_hacks.rela_size <= 0 ? UNKNOWN_SHDR_SIZE : global_hacks.rela_size;
         	shdr[scount].sh_addralign = sizeof(long); 
-        	shdr[scount].sh_name = stoffset;
-        	if (__ELF_NATIVE_CLASS == 64) {
-                	strcpy(&StringTable[stoffset], ".rela.dyn");
-                	stoffset += strlen(".rela.dyn") + 1;
-        	} else {
-                	strcpy(&StringTable[stoffset], ".rel.dyn");
-                	stoffset += strlen(".rel.dyn") + 1;
-        	}
+        	shdr[scount].sh_name = strtab_add(&shstrtab, (__ELF_NATIVE_CLASS == 64) ? ".rela.dyn" : ".rel.dyn");
        	 	scount++;
 	
 		/*
@@ -338,14 +373,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = (__ELF_NATIVE_CLASS == 64) ? sizeof(Elf64_Rela) : sizeof(Elf32_Rel);
         	shdr[scount].sh_size = global_hacks.plt_rela_size <= 0 ? UNKNOWN_SHDR_SIZE : global_hacks.plt_rela_size;
         	shdr[scount].sh_addralign = sizeof(long);
-        	shdr[scount].sh_name = stoffset;
-        	if (__ELF_NATIVE_CLASS == 64) {
-                	strcpy(&StringTable[stoffset], ".rela.plt");
-                	stoffset += strlen(".rela.plt") + 1;
-        	} else {
-                	strcpy(&StringTable[stoffset], ".rel.plt");
-                	stoffset += strlen(".rel.plt") + 1;
-        	}
+        	shdr[scount].sh_name = strtab_add(&shstrtab, (__ELF_NATIVE_CLASS == 64) ? ".rela.plt" : ".rel.plt");
         	scount++;
 
 
@@ -361,9 +389,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = 0;
         	shdr[scount].sh_size = global_hacks.init_size <= 0 ? UNKNOWN_SHDR_SIZE : global_hacks.init_size;
         	shdr[scount].sh_addralign = sizeof(long);
-        	shdr[scount].sh_name = stoffset;
-        	strcpy(&StringTable[stoffset], ".init");
-        	stoffset += strlen(".init") + 1;
+        	shdr[scount].sh_name = strtab_add(&shstrtab, ".init");
         	scount++;
 	
 		/*
@@ -385,9 +411,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
 		shdr[scount].sh_entsize = 16;
 		shdr[scount].sh_size = global_hacks.plt_size <= 0 ? UNKNOWN_SHDR_SIZE : global_hacks.plt_size;
 		shdr[scount].sh_addralign = 16;
-		shdr[scount].sh_name = stoffset;
-		strcpy(&StringTable[stoffset], ".plt");
-		stoffset += strlen(".plt") + 1;
+		shdr[scount].sh_name = strtab_add(&shstrtab, ".plt");
 		scount++;
 	}
 
@@ -405,9 +429,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 0;
         shdr[scount].sh_size = elfdesc->textSize;
         shdr[scount].sh_addralign = 16;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".text");
-        stoffset += strlen(".text") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".text");
         scount++;
 
         
@@ -424,9 +446,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = 0;
         	shdr[scount].sh_size = global_hacks.fini_size <= 0 ? UNKNOWN_SHDR_SIZE : global_hacks.fini_size;
         	shdr[scount].sh_addralign = 16;
-        	shdr[scount].sh_name = stoffset;
-        	strcpy(&StringTable[stoffset], ".fini");
-        	stoffset += strlen(".fini") + 1;
+        	shdr[scount].sh_name = strtab_add(&shstrtab, ".fini");
         	scount++;
 
 		/*
@@ -441,9 +461,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = 0;
        	 	shdr[scount].sh_size = elfdesc->ehframe_Size;
         	shdr[scount].sh_addralign = 4;
-        	shdr[scount].sh_name = stoffset;
-        	strcpy(&StringTable[stoffset], ".eh_frame_hdr");
-        	stoffset += strlen(".eh_frame_hdr") + 1;
+        	shdr[scount].sh_name = strtab_add(&shstrtab, ".eh_frame_hdr");
         	scount++;
        } 
        	/*
@@ -471,9 +489,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         size_t ehsz = (ElfW(Off))((elfdesc->ehframe_Vaddr + elfdesc->ehframe_Size) - elfdesc->textVaddr);
         shdr[scount].sh_size = global_hacks.ehframe_size <= 0 ? ehsz : global_hacks.ehframe_size;
 	shdr[scount].sh_addralign = 8;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".eh_frame");
-        stoffset += strlen(".eh_frame") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".eh_frame");
         scount++;
 
 	if (dynamic) {
@@ -489,9 +505,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = (__ELF_NATIVE_CLASS == 64) ? 16 : 8;
         	shdr[scount].sh_size = elfdesc->dynSize;
         	shdr[scount].sh_addralign = sizeof(long);
-        	shdr[scount].sh_name = stoffset;
-        	strcpy(&StringTable[stoffset], ".dynamic");
-        	stoffset += strlen(".dynamic") + 1;
+        	shdr[scount].sh_name = strtab_add(&shstrtab, ".dynamic");
         	scount++;
 
         	/*
@@ -506,9 +520,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         	shdr[scount].sh_entsize = sizeof(long);
 		shdr[scount].sh_size = global_hacks.got_size <= 0 ? UNKNOWN_SHDR_SIZE : global_hacks.got_size;
         	shdr[scount].sh_addralign = sizeof(long);
-        	shdr[scount].sh_name = stoffset;
-        	strcpy(&StringTable[stoffset], ".got.plt");
-       	 	stoffset += strlen(".got.plt") + 1;
+        	shdr[scount].sh_name = strtab_add(&shstrtab, ".got.plt");
         	scount++;
 	}
 	/*
@@ -523,9 +535,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
        	shdr[scount].sh_entsize = 0;
        	shdr[scount].sh_size = elfdesc->dataSize;
        	shdr[scount].sh_addralign = sizeof(long);
-       	shdr[scount].sh_name = stoffset;
-       	strcpy(&StringTable[stoffset], ".data");
-       	stoffset += strlen(".data") + 1;
+       	shdr[scount].sh_name = strtab_add(&shstrtab, ".data");
        	scount++;
 
         /*
@@ -540,9 +550,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 0;
         shdr[scount].sh_size = elfdesc->bssSize;
         shdr[scount].sh_addralign = sizeof(long);
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".bss");
-        stoffset += strlen(".bss") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".bss");
         scount++;
 
         /*
@@ -557,9 +565,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 0;
         shdr[scount].sh_size = memdesc->heap.size;
         shdr[scount].sh_addralign = sizeof(long);
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".heap");
-        stoffset += strlen(".heap") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".heap");
         scount++;
 	
 	if (dynamic) {
@@ -580,7 +586,6 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
 			shdr[scount].sh_entsize = 0;
 			shdr[scount].sh_size = notedesc->lm_files->libs[i].size;
 			shdr[scount].sh_addralign = 8;
-			shdr[scount].sh_name = stoffset;
 			switch(notedesc->lm_files->libs[i].flags) {
 			case PF_R|PF_X:
 				/* .text of library; i.e libc.so.text */
@@ -596,8 +601,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
 				str = xfmtstrdup("%s.undef", notedesc->lm_files->libs[i].name);
 				break;
 			}
-			strcpy(&StringTable[stoffset], str);
-			stoffset += strlen(str) + 1;
+			shdr[scount].sh_name = strtab_add(&shstrtab, str);
 			scount += 1;
 			xfree(str);
 		}
@@ -615,9 +619,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
 	shdr[scount].sh_entsize = sizeof(struct elf_prstatus);
 	shdr[scount].sh_size = ecfs_file->prstatus_size;
 	shdr[scount].sh_addralign = 4;
-	shdr[scount].sh_name = stoffset;
-	strcpy(&StringTable[stoffset], ".prstatus");
-	stoffset += strlen(".prstatus") + 1;
+	shdr[scount].sh_name = strtab_add(&shstrtab, ".prstatus");
 	scount++;
 	
 	/*
@@ -632,9 +634,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = sizeof(fd_info_t);
         shdr[scount].sh_size = ecfs_file->fdinfo_size;
         shdr[scount].sh_addralign = 4;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".fdinfo");
-        stoffset += strlen(".fdinfo") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".fdinfo");
         scount++;
 
 	/*
@@ -649,9 +649,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = sizeof(siginfo_t);
         shdr[scount].sh_size = ecfs_file->siginfo_size;
         shdr[scount].sh_addralign = 4;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".siginfo");
-        stoffset += strlen(".siginfo") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".siginfo");
         scount++;
 
 	/*
@@ -666,9 +664,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 8;
         shdr[scount].sh_size = ecfs_file->auxv_size;
         shdr[scount].sh_addralign = 8;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".auxvector");
-        stoffset += strlen(".auxvector") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".auxvector");
         scount++;
 
 	/*
@@ -683,9 +679,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 8;
         shdr[scount].sh_size = ecfs_file->exepath_size;
         shdr[scount].sh_addralign = 1;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".exepath");
-        stoffset += strlen(".exepath") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".exepath");
         scount++;
 
 	/*
@@ -700,9 +694,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = sizeof(elf_stat_t);
         shdr[scount].sh_size = ecfs_file->personality_size;
         shdr[scount].sh_addralign = 1;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".personality");
-        stoffset += strlen(".personality") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".personality");
         scount++;
 
 	/*
@@ -717,9 +709,39 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
 	shdr[scount].sh_entsize = 1;
 	shdr[scount].sh_size = ecfs_file->arglist_size;
 	shdr[scount].sh_addralign = 1;
-	shdr[scount].sh_name = stoffset;
-	strcpy(&StringTable[stoffset], ".arglist");
-	stoffset += strlen(".arglist") + 1;
+	shdr[scount].sh_name = strtab_add(&shstrtab, ".arglist");
+	scount++;
+
+	/*
+	 * .textrefs
+	 */
+	if (ecfs_file->textrefs_size > 0) {
+		shdr[scount].sh_type = SHT_PROGBITS;
+		shdr[scount].sh_offset = ecfs_file->textrefs_offset;
+		shdr[scount].sh_addr = 0;
+		shdr[scount].sh_flags = 0;
+		shdr[scount].sh_info = 0;
+		shdr[scount].sh_link = 0;
+		shdr[scount].sh_entsize = sizeof(ecfs_textref_t);
+		shdr[scount].sh_size = ecfs_file->textrefs_size;
+		shdr[scount].sh_addralign = 8;
+		shdr[scount].sh_name = strtab_add(&shstrtab, ECFS_TEXTREFS_NAME);
+		scount++;
+	}
+
+	/*
+	 * .ecfs_stats
+	 */
+	shdr[scount].sh_type = SHT_PROGBITS;
+	shdr[scount].sh_offset = ecfs_file->stats_offset;
+	shdr[scount].sh_addr = 0;
+	shdr[scount].sh_flags = 0;
+	shdr[scount].sh_info = 0;
+	shdr[scount].sh_link = 0;
+	shdr[scount].sh_entsize = sizeof(ecfs_stat_t);
+	shdr[scount].sh_size = ecfs_file->stats_size;
+	shdr[scount].sh_addralign = 8;
+	shdr[scount].sh_name = strtab_add(&shstrtab, ECFS_STATS_NAME);
 	scount++;
 
 	/*
@@ -734,9 +756,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 0;
         shdr[scount].sh_size = memdesc->stack.size;
         shdr[scount].sh_addralign = sizeof(long);
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".stack");
-        stoffset += strlen(".stack") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".stack");
         scount++;
 
         /*
@@ -751,9 +771,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 0;
         shdr[scount].sh_size = memdesc->vdso.size;
         shdr[scount].sh_addralign = sizeof(long);
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".vdso");
-        stoffset += strlen(".vdso") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".vdso");
         scount++;
 
         /*
@@ -768,9 +786,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 0;
         shdr[scount].sh_size = memdesc->vsyscall.size;
         shdr[scount].sh_addralign = sizeof(long);
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".vsyscall");
-        stoffset += strlen(".vsyscall") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".vsyscall");
         scount++;
 
 	 /*
@@ -785,9 +801,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = sizeof(ElfW(Sym));
         shdr[scount].sh_size = 0;
         shdr[scount].sh_addralign = 4;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".symtab");
-        stoffset += strlen(".symtab") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".symtab");
         scount++;
 
         /*
@@ -802,9 +816,7 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_entsize = 0;
         shdr[scount].sh_size = 0;
         shdr[scount].sh_addralign = 1;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".strtab");
-        stoffset += strlen(".strtab") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".strtab");
         scount++;
 
         /*
@@ -817,11 +829,9 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
         shdr[scount].sh_info = 0;
         shdr[scount].sh_link = 0;
         shdr[scount].sh_entsize = 0;
-        shdr[scount].sh_size = stoffset + strlen(".shstrtab") + 1; 
         shdr[scount].sh_addralign = 1;
-        shdr[scount].sh_name = stoffset;
-        strcpy(&StringTable[stoffset], ".shstrtab");
-        stoffset += strlen(".shstrtab") + 1;
+        shdr[scount].sh_name = strtab_add(&shstrtab, ".shstrtab");
+        shdr[scount].sh_size = shstrtab.len;
         scount++;
 
 	 /* We will add the actual sections for .symtab and .strtab
@@ -830,13 +840,16 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
          */
 	const char *filepath = outfile;
         int e_shstrndx = scount - 1;
-        for (i = 0; i < scount; i++) 
-                if (write(fd, (char *)&shdr[i], sizeof(ElfW(Shdr))) < 0)
-			log_msg(__LINE__, "write %s", strerror(errno));
-        
-        ssize_t b = write(fd, (char *)StringTable, stoffset);
-	if (b < 0) {
-		log_msg(__LINE__, "write %s", strerror(errno));
+	/*
+	 * Section headers immediately followed by .shstrtab
+	 */
+	struct iovec iov[2];
+	iov[0].iov_base = shdr;
+	iov[0].iov_len = sizeof(ElfW(Shdr)) * scount;
+	iov[1].iov_base = shstrtab.buf;
+	iov[1].iov_len = shstrtab.len;
+	if (writev(fd, iov, 2) != (ssize_t)(iov[0].iov_len + iov[1].iov_len)) {
+		log_msg(__LINE__, "writev %s", strerror(errno));
 		exit(-1);
 	}
         fsync(fd);
@@ -868,16 +881,38 @@ static int build_section_headers(int fd, const char *outfile, handle_t *handle,
 
         close(fd);
 	free(shdr);
-	free(StringTable);
+	strtab_free(&shstrtab);
 
 	return scount;
 }
 
+/*
+ * The prstatus of each thread sits between its other notes in the
+ * core, so the .prstatus section is gathered out of the notes rather
+ * than copied into a contiguous buffer first.
+ */
+static int write_prstatus(int fd, struct thread_core_table *threads)
+{
+	struct iovec iov[IOV_MAX];
+	int i, j, n;
+
+	for (i = 0; i < threads->count; i += n) {
+		n = threads->count - i > IOV_MAX ? IOV_MAX : threads->count - i;
+		for (j = 0; j < n; j++) {
+			iov[j].iov_base = threads->prstatus[i + j];
+			iov[j].iov_len = sizeof(struct elf_prstatus);
+		}
+		if (writev(fd, iov, n) != (ssize_t)(n * sizeof(struct elf_prstatus))) {
+			log_msg(__LINE__, "writev %s", strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
 
 int core2ecfs(const char *outfile, handle_t *handle)
 {
 	struct stat st;
-	int i;
 	elfdesc_t *elfdesc = handle->elfdesc;
 	memdesc_t *memdesc = handle->memdesc;
 	notedesc_t *notedesc = handle->notedesc;
@@ -886,13 +921,24 @@ int core2ecfs(const char *outfile, handle_t *handle)
 	ecfs_file_t *ecfs_file = heapAlloc(sizeof(ecfs_file_t));
 	int fd, ret;
 
-	fd = xopen(outfile, O_CREAT|O_TRUNC|O_RDWR);
-	chmod(outfile, S_IRWXU|S_IRWXG);
-	stat(elfdesc->path, &st); // stat the corefile
+	/*
+	 * In single pass mode the core body (with texts merged in) was
+	 * already streamed into outfile; elfdesc->path is outfile itself
+	 * so we only append to it.
+	 */
+	if (opts.single_pass) {
+		fd = xopen(outfile, O_RDWR);
+		stat(elfdesc->path, &st);
+		xlseek(fd, st.st_size, SEEK_SET);
+	} else {
+		fd = xopen(outfile, O_CREAT|O_TRUNC|O_RDWR);
+		chmod(outfile, S_IRWXU|S_IRWXG);
+		st.st_size = elfdesc->size; // size of the staged corefile
+	}
 	
 	ecfs_file->prstatus_offset = st.st_size;
-	ecfs_file->prstatus_size = notedesc->thread_count * sizeof(struct elf_prstatus);
-	ecfs_file->fdinfo_offset = ecfs_file->prstatus_offset + notedesc->thread_count * sizeof(struct elf_prstatus);
+	ecfs_file->prstatus_size = notedesc->threads.count * sizeof(struct elf_prstatus);
+	ecfs_file->fdinfo_offset = ecfs_file->prstatus_offset + notedesc->threads.count * sizeof(struct elf_prstatus);
 	ecfs_file->fdinfo_size = memdesc->fdinfo_size;
 	ecfs_file->siginfo_offset = ecfs_file->fdinfo_offset + ecfs_file->fdinfo_size;
 	ecfs_file->siginfo_size = sizeof(siginfo_t);
@@ -904,29 +950,30 @@ int core2ecfs(const char *outfile, handle_t *handle)
 	ecfs_file->personality_size = sizeof(elf_stat_t);
 	ecfs_file->arglist_offset = ecfs_file->personality_offset + ecfs_file->personality_size;
 	ecfs_file->arglist_size = ELF_PRARGSZ;
-	ecfs_file->stb_offset = ecfs_file->arglist_offset + ecfs_file->arglist_size;
+	ecfs_file->textrefs_offset = ecfs_file->arglist_offset + ecfs_file->arglist_size;
+	ecfs_file->textrefs_size = memdesc->textref_count * sizeof(ecfs_textref_t);
+	ecfs_file->stats_offset = ecfs_file->textrefs_offset + ecfs_file->textrefs_size;
+	ecfs_file->stats_size = ECFS_STAGE_COUNT * sizeof(ecfs_stat_t);
+	ecfs_file->stb_offset = ecfs_file->stats_offset + ecfs_file->stats_size;
 	
 	/*
-	 * write original body of core file
+	 * write original body of core file (with opts.sparse the
+	 * zero pages of it are left as holes)
 	 */	
-	if (write(fd, elfdesc->mem, st.st_size) != st.st_size) {
-		log_msg(__LINE__, "write %s", strerror(errno));
-		exit(-1);
+	if (!opts.single_pass) {
+		if (sparse_pwrite(fd, elfdesc->mem, st.st_size, 0) != st.st_size) {
+			log_msg(__LINE__, "write %s", strerror(errno));
+			exit(-1);
+		}
+		xlseek(fd, st.st_size, SEEK_SET);
 	}
 
 	/*
-	 * write prstatus structs
+	 * write prstatus structs. They are gathered straight out of the
+	 * notes, IOV_MAX threads per writev().
 	 */
-	if( write(fd, notedesc->prstatus, sizeof(struct elf_prstatus)) == -1 ) {
-            log_msg(__LINE__, "write %s", strerror(errno));
-            exit(-1);
-        }
-	for (i = 1; i < notedesc->thread_count; i++) {
-		if( write(fd, notedesc->thread_core_info[i].prstatus, sizeof(struct elf_prstatus)) == -1) {
-                    log_msg(__LINE__, "write %s", strerror(errno));
-                    exit(-1);
-                }
-        }
+	if (write_prstatus(fd, &notedesc->threads) < 0)
+		exit(-1);
 	
 	/*
 	 * write fdinfo structs
@@ -971,6 +1018,21 @@ int core2ecfs(const char *outfile, handle_t *handle)
             log_msg(__LINE__, "write %s", strerror(errno));
         }
 
+	/*
+	 * write .textrefs (shlib texts that live in the text store)
+	 */
+	if (ecfs_file->textrefs_size > 0) {
+		if (write(fd, memdesc->textrefs, ecfs_file->textrefs_size) == -1)
+			log_msg(__LINE__, "write %s", strerror(errno));
+	}
+
+	/*
+	 * write .ecfs_stats; the stages from here on are filled in by
+	 * stats_update_file() once main() is done.
+	 */
+	if (write(fd, stats_table(), ecfs_file->stats_size) == -1)
+		log_msg(__LINE__, "write %s", strerror(errno));
+
 	/*
 	 * Build section header table
 	 */
@@ -26,8 +26,9 @@
 #include <unistd.h> // for syncfs, _GNU_SOURCE is a required build flag
 #include "../include/ecfs.h"
 #include "../include/util.h"
+#include "../include/orig_elf.h"
 	
-elfdesc_t * load_core_file(const char *path)
+elfdesc_t * load_core_fd(int fd, const char *name)
 {	
 	elfdesc_t *elfdesc = (elfdesc_t *)heapAlloc(sizeof(elfdesc_t));
 	ElfW(Ehdr) *ehdr = NULL;
@@ -35,14 +36,9 @@ elfdesc_t * load_core_file(const char *path)
 	ElfW(Nhdr) *nhdr = NULL; //notes
 	uint8_t *mem = NULL;
 	struct stat st;
-	int i, fd;
+	int i;
 	
-	elfdesc->path = xstrdup(path);
-
-	if ((fd = open(path, O_RDONLY)) < 0) {
-		log_msg(__LINE__, "open %s", strerror(errno));
-		return NULL;
-	}
+	elfdesc->path = xstrdup(name);
 
 	if (fstat(fd, &st) < 0) {
 		log_msg(__LINE__, "fstat %s", strerror(errno));
@@ -59,7 +55,7 @@ elfdesc_t * load_core_file(const char *path)
 	phdr = (ElfW(Phdr) *)&mem[ehdr->e_phoff];
 	
 	if (ehdr->e_type != ET_CORE) {
-		log_msg(__LINE__, "File %s is not an ELF core file. exiting with failure", path);
+		log_msg(__LINE__, "File %s is not an ELF core file. exiting with failure", name);
 		return NULL;
 	}
 	
@@ -89,16 +85,32 @@ elfdesc_t * load_core_file(const char *path)
 	return elfdesc;
 }
 
-elfdesc_t * reload_core_file(elfdesc_t *old)
+elfdesc_t * load_core_file(const char *path)
+{
+	elfdesc_t *elfdesc;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		log_msg(__LINE__, "open %s", strerror(errno));
+		return NULL;
+	}
+	elfdesc = load_core_fd(fd, path);
+	close(fd);
+	return elfdesc;
+}
+
+elfdesc_t * reload_core_file(elfdesc_t *old, int fd)
 {
 	char *path = xstrdup(old->path);
 	
 	munmap(old->mem, old->size);
+	free(old->path);
 	free(old);
 
-	elfdesc_t *new = load_core_file(path);
+	elfdesc_t *new = load_core_fd(fd, path);
+	free(path);
 	if (new == NULL) {
-		log_msg(__LINE__, "reload_core_file(): internal call to load_core_file() failed");
+		log_msg(__LINE__, "reload_core_file(): internal call to load_core_fd() failed");
 		return NULL;
 	}
 	return new;
@@ -202,26 +214,13 @@ ElfW(Off) get_internal_sh_offset(elfdesc_t *elfdesc, memdesc_t *memdesc, int typ
 }
 static ssize_t get_original_shdr_addr(int pid, const char *name)
 {
-	   struct stat st;
-        int i;
-        char *path = xfmtstrdup("/proc/%d/exe", pid);
-        int fd = xopen(path, O_RDONLY);
-        xfree(path);
-        xfstat(fd, &st);
-        uint8_t *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (mem == MAP_FAILED) {
-                log_msg(__LINE__, "mmap %s", strerror(errno));
-                return -1;
-        }
-        ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)mem;
-        ElfW(Shdr) *shdr = (ElfW(Shdr) *)(mem + ehdr->e_shoff);
-        if (ehdr->e_shstrndx == 0 || ehdr->e_shnum == 0)
-                return -1;
-        char *StringTable = (char *)&mem[shdr[ehdr->e_shstrndx].sh_offset];
-        for (i = 0; i < ehdr->e_shnum; i++)
-                if (!strcmp(&StringTable[shdr[i].sh_name], name))
-			return shdr[i].sh_addr;
-	return 0;
+	orig_elf_t *oe = orig_elf_open(pid);
+	ElfW(Shdr) *shdr;
+
+	if (oe->shdr == NULL)
+		return -1;
+	shdr = orig_elf_section(oe, name);
+	return shdr ? shdr->sh_addr : 0;
 }
 
 static void pull_unknown_shdr_addrs(int pid)
@@ -245,26 +244,13 @@ static void pull_unknown_shdr_addrs(int pid)
 
 static ssize_t get_original_shdr_size(int pid, const char *name)
 {
-	struct stat st;
-	int i;
-        char *path = xfmtstrdup("/proc/%d/exe", pid);
-        int fd = xopen(path, O_RDONLY);
-        xfree(path);
-        xfstat(fd, &st);
-        uint8_t *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (mem == MAP_FAILED) {
-                log_msg(__LINE__, "mmap %s", strerror(errno));
-                return -1;
-        }
-        ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)mem;
-	ElfW(Shdr) *shdr = (ElfW(Shdr) *)(mem + ehdr->e_shoff);
-	if (ehdr->e_shstrndx == 0 || ehdr->e_shnum == 0)
+	orig_elf_t *oe = orig_elf_open(pid);
+	ElfW(Shdr) *shdr;
+
+	if (oe->shdr == NULL)
 		return -1;
-	char *StringTable = (char *)&mem[shdr[ehdr->e_shstrndx].sh_offset];
-	for (i = 0; i < ehdr->e_shnum; i++) 
-		if (!strcmp(&StringTable[shdr[i].sh_name], name))
-			return shdr[i].sh_size;
-	return 0;
+	shdr = orig_elf_section(oe, name);
+	return shdr ? shdr->sh_size : 0;
 }
 /*
  * Notice we read these and store them in global variables
@@ -25,6 +25,8 @@
 
 #include "../include/ecfs.h"
 #include "../include/util.h"
+#include "../include/proc.h"
+#include <limits.h>
 
 ElfW(Addr) lookup_text_base(memdesc_t *memdesc, struct nt_file_struct *fmaps)
 {	
@@ -95,6 +97,7 @@ int parse_orig_phdrs(elfdesc_t *elfdesc, memdesc_t *memdesc, notedesc_t *notedes
 	ElfW(Phdr) *phdr;
 	ElfW(Addr) text_base = 0;
 	struct stat st;
+	char path[PATH_MAX];
 	int i;
 
 	/*
@@ -111,11 +114,16 @@ int parse_orig_phdrs(elfdesc_t *elfdesc, memdesc_t *memdesc, notedesc_t *notedes
 		return -1;
 	}
 	
-	/* Instead we use mmap on the original executable file */
+	/*
+	 * Instead we use mmap on the original executable file, through
+	 * /proc/<pid>/exe so that it is the one that was running (and so
+	 * that a replay gets the recorded copy).
+	 */
 #if DEBUG
 	log_msg(__LINE__, "exe_path: %s", memdesc->exe_path);
 #endif
-	fd = xopen(memdesc->exe_path, O_RDONLY);
+	proc_path(path, sizeof(path), memdesc->task.pid, "exe");
+	fd = xopen(path, O_RDONLY);
 	xfstat(fd, &st);
 	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (mem == MAP_FAILED) {
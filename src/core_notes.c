@@ -25,6 +25,8 @@
 
 #include "../include/ecfs.h"
 #include "../include/util.h"
+#include "../include/core_notes.h"
+#include <stddef.h>
 
 /*
  * This function does the opposite of how the kernel packs files into
@@ -99,21 +101,50 @@ static void print_nt_files(struct nt_file_struct *file_maps)
 	}
 }
 
+/*
+ * Make room for one more thread in the register tables. They are sized
+ * for the common case and doubled from there, so a JVM with 10k threads
+ * costs a handful of reallocs rather than one allocation per note.
+ */
+static int grow_thread_table(struct thread_core_table *t)
+{
+	int cap = t->cap ? t->cap * 2 : 64;
+
+	if (t->count < t->cap)
+		return 0;
+	if ((t->prstatus = realloc(t->prstatus, cap * sizeof(*t->prstatus))) == NULL ||
+	    (t->fpregs = realloc(t->fpregs, cap * sizeof(*t->fpregs))) == NULL ||
+	    (t->xstate = realloc(t->xstate, cap * sizeof(*t->xstate))) == NULL ||
+	    (t->xstate_size = realloc(t->xstate_size, cap * sizeof(*t->xstate_size))) == NULL) {
+		log_msg(__LINE__, "realloc %s", strerror(errno));
+		return -1;
+	}
+	t->cap = cap;
+	return 0;
+}
+
 notedesc_t * parse_notes_area(elfdesc_t *elfdesc)
 {
 	notedesc_t *notedesc = (notedesc_t *)heapAlloc(sizeof(notedesc_t));
+	struct thread_core_table *threads = &notedesc->threads;
 	size_t i, len;
-	int tc;
+	int cur;
 	uint8_t *desc;
 	struct nt_file_struct *nt_files; // for parsing NT_FILE in corefile
 	ElfW(Nhdr) *notes = elfdesc->nhdr;
 
+	notedesc->notes = elfdesc->nhdr;
 	for (i = 0; i < elfdesc->noteSize; i += len) {
 		desc = ELFNOTE_DESC(notes);
+		/*
+		 * The kernel emits NT_PRSTATUS first for each thread, followed
+		 * by that threads NT_FPREGSET and NT_X86_XSTATE.
+		 */
+		cur = threads->count - 1;
 		switch(notes->n_type) {
 			case NT_PRSTATUS:
 #if DEBUG
-				log_msg(__LINE__, "Collecting PRSTATUS struct for thread #%d", notedesc->thread_count);
+				log_msg(__LINE__, "Collecting PRSTATUS struct for thread #%d", threads->count);
 #endif
 				if (notes->n_descsz != (size_t)sizeof(struct elf_prstatus)) {
 #if DEBUG
@@ -121,19 +152,17 @@ notedesc_t * parse_notes_area(elfdesc_t *elfdesc)
 #endif
 					break;
 				}
-				tc = !!notedesc->thread_count;
-				switch(tc) {
-				case 1: 
-					notedesc->thread_core_info[notedesc->thread_count].prstatus = (struct elf_prstatus *)heapAlloc(notes->n_descsz);
-					memcpy(notedesc->thread_core_info[notedesc->thread_count].prstatus, desc, notes->n_descsz);
-					break;
-				case 0:
+				if (grow_thread_table(threads) < 0)
+					return NULL;
+				if (threads->count == 0) {
 					notedesc->prstatus = (struct elf_prstatus *)heapAlloc(sizeof(struct elf_prstatus));
 					memcpy(notedesc->prstatus, desc, notes->n_descsz);
-					notedesc->thread_core_info[notedesc->thread_count].prstatus = notedesc->prstatus;
-					break;
 				}
-				notedesc->thread_count++;
+				threads->prstatus[threads->count] = (struct elf_prstatus *)desc;
+				threads->fpregs[threads->count] = NULL;
+				threads->xstate[threads->count] = NULL;
+				threads->xstate_size[threads->count] = 0;
+				threads->count++;
 				break;
 			case NT_PRPSINFO:
 				if (notes->n_descsz != (size_t)sizeof(struct elf_prpsinfo)) {
@@ -173,9 +202,22 @@ notedesc_t * parse_notes_area(elfdesc_t *elfdesc)
 #endif 
 					break;
 				}
-				notedesc->fpu = (elf_fpregset_t *)heapAlloc(sizeof(elf_fpregset_t));
-				memcpy(notedesc->fpu, desc, notes->n_descsz);
+				if (cur < 0)
+					break;
+				threads->fpregs[cur] = (elf_fpregset_t *)desc;
+				if (cur == 0) {
+					notedesc->fpu = (elf_fpregset_t *)heapAlloc(sizeof(elf_fpregset_t));
+					memcpy(notedesc->fpu, desc, notes->n_descsz);
+				}
+				break;
+#ifdef NT_X86_XSTATE
+			case NT_X86_XSTATE:
+				if (cur < 0)
+					break;
+				threads->xstate[cur] = desc;
+				threads->xstate_size[cur] = notes->n_descsz;
 				break;
+#endif
 			
 		}
 		/*
@@ -188,6 +230,24 @@ notedesc_t * parse_notes_area(elfdesc_t *elfdesc)
 	return notedesc;
 }
 
+void rebase_notes(notedesc_t *notedesc, elfdesc_t *elfdesc)
+{
+	struct thread_core_table *threads = &notedesc->threads;
+	ptrdiff_t delta = (uint8_t *)elfdesc->nhdr - (uint8_t *)notedesc->notes;
+	int i;
+
+	if (delta == 0)
+		return;
+	for (i = 0; i < threads->count; i++) {
+		threads->prstatus[i] = (struct elf_prstatus *)((uint8_t *)threads->prstatus[i] + delta);
+		if (threads->fpregs[i] != NULL)
+			threads->fpregs[i] = (elf_fpregset_t *)((uint8_t *)threads->fpregs[i] + delta);
+		if (threads->xstate[i] != NULL)
+			threads->xstate[i] += delta;
+	}
+	notedesc->notes = elfdesc->nhdr;
+}
+
 void fill_in_pstatus(memdesc_t *memdesc, notedesc_t *notedesc)
 {
                 memdesc->task.uid = notedesc->psinfo->pr_uid;
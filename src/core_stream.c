@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Single pass conversion of the core file coming in from the kernel
+ * (via core_pattern pipe) into the body of the ECFS file. The original
+ * code writes the core to a temporary file, then rewrites that file once
+ * for the executables text and once for every shared library text
+ * (with -t) before core2ecfs() copies it a final time into the outfile.
+ * Here we read the ELF header and program headers up front, compute the
+ * final layout of every segment with plan_text_merges(), and then stream
+ * the core straight into its final position in the outfile, substituting
+ * the complete text images as we go.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/core_text.h"
+#include "../include/core_accessors.h"
+#include "../include/core_stream.h"
+
+#define STREAM_BUF_LEN (1024 * 1024)
+
+static ssize_t read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	size_t total = 0;
+	ssize_t n;
+
+	while (total < len) {
+		n = read(fd, p + total, len - total);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		total += n;
+	}
+	return total;
+}
+
+static ssize_t write_full(int fd, const void *buf, size_t len, off_t offset)
+{
+	const uint8_t *p = buf;
+	size_t total = 0;
+	ssize_t n;
+
+	while (total < len) {
+		n = pwrite(fd, p + total, len - total, offset + total);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += n;
+	}
+	return total;
+}
+
+/*
+ * Copy len bytes from the pipe to offset in the outfile. If offset
+ * is -1 the bytes are read and discarded (i.e. the 4096 byte text
+ * fragment that the kernel wrote and that we are replacing).
+ */
+static ssize_t stream_copy(int in, int out, uint8_t *buf, size_t len, off_t offset)
+{
+	size_t total = 0, chunk;
+	ssize_t n;
+
+	while (total < len) {
+		chunk = len - total > STREAM_BUF_LEN ? STREAM_BUF_LEN : len - total;
+		n = read_full(in, buf, chunk);
+		if (n < 0) {
+			log_msg(__LINE__, "read %s", strerror(errno));
+			return -1;
+		}
+		if (n == 0)
+			break;
+		if (offset != -1 && sparse_pwrite(out, buf, n, offset + total) != n) {
+			log_msg(__LINE__, "pwrite %s", strerror(errno));
+			return -1;
+		}
+		total += n;
+	}
+	return total;
+}
+
+static int qsort_cmp_by_old_offset(const void *a, const void *b)
+{
+	const struct text_merge *ma = a;
+	const struct text_merge *mb = b;
+
+	if (ma->old_offset == mb->old_offset)
+		return 0;
+	return ma->old_offset < mb->old_offset ? -1 : 1;
+}
+
+elfdesc_t * stream_core_to_ecfs(int in, const char *outfile, memdesc_t *memdesc)
+{
+	ElfW(Ehdr) ehdr;
+	ElfW(Phdr) *phdr, *orig_phdr;
+	struct text_merge *merges;
+	uint8_t *head, *buf;
+	size_t head_len, len;
+	off_t in_pos, out_pos, shift;
+	ssize_t growth, n;
+	int i, j, fd, count, merged;
+
+	grow_pipe_buffer(in);
+	if (read_full(in, &ehdr, sizeof(ehdr)) != sizeof(ehdr)) {
+		log_msg(__LINE__, "failed to read ELF header from core pipe");
+		return NULL;
+	}
+	if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_type != ET_CORE) {
+		log_msg(__LINE__, "input from core pipe is not an ELF core file");
+		return NULL;
+	}
+	if (ehdr.e_phoff < sizeof(ehdr) || ehdr.e_phnum == 0) {
+		log_msg(__LINE__, "core file has unexpected phdr layout (e_phoff: %lx)", (unsigned long)ehdr.e_phoff);
+		return NULL;
+	}
+
+	/*
+	 * The head of the core file is everything up until the first
+	 * segment that has file contents; the ehdr, phdrs, and the notes.
+	 * We have to read the phdrs before we know how big the head is.
+	 */
+	head_len = ehdr.e_phoff + ehdr.e_phnum * sizeof(ElfW(Phdr));
+	head = heapAlloc(head_len);
+	memcpy(head, &ehdr, sizeof(ehdr));
+	if (read_full(in, head + sizeof(ehdr), head_len - sizeof(ehdr)) != head_len - sizeof(ehdr)) {
+		log_msg(__LINE__, "failed to read phdrs from core pipe");
+		return NULL;
+	}
+	orig_phdr = heapAlloc(ehdr.e_phnum * sizeof(ElfW(Phdr)));
+	memcpy(orig_phdr, head + ehdr.e_phoff, ehdr.e_phnum * sizeof(ElfW(Phdr)));
+
+	for (len = 0, i = 0; i < ehdr.e_phnum; i++) {
+		if (orig_phdr[i].p_type != PT_LOAD || orig_phdr[i].p_filesz == 0)
+			continue;
+		if (len == 0 || orig_phdr[i].p_offset < len)
+			len = orig_phdr[i].p_offset;
+	}
+	if (len > head_len) {
+		head = realloc(head, len);
+		if (head == NULL) {
+			log_msg(__LINE__, "realloc %s", strerror(errno));
+			exit(-1);
+		}
+		if (read_full(in, head + head_len, len - head_len) != len - head_len) {
+			log_msg(__LINE__, "failed to read notes from core pipe");
+			return NULL;
+		}
+		head_len = len;
+	}
+
+	/*
+	 * Work out where everything is going to end up before writing
+	 * anything. phdr (inside of head) gets the final layout.
+	 */
+	phdr = (ElfW(Phdr) *)(head + ehdr.e_phoff);
+	count = get_text_merges(memdesc, &merges);
+	growth = plan_text_merges(phdr, ehdr.e_phnum, merges, count);
+	qsort(merges, count, sizeof(struct text_merge), qsort_cmp_by_old_offset);
+#if DEBUG
+	log_msg(__LINE__, "stream_core_to_ecfs(): %d text images to merge, file grows by %ld bytes", count, (long)growth);
+#endif
+
+	fd = xopen(outfile, O_CREAT|O_TRUNC|O_RDWR);
+	chmod(outfile, S_IRWXU|S_IRWXG);
+	if (write_full(fd, head, head_len, 0) < 0) {
+		log_msg(__LINE__, "pwrite %s", strerror(errno));
+		return NULL;
+	}
+
+	/*
+	 * Stream the rest of the pipe in order. The gaps between merged
+	 * text segments are copied verbatim, shifted by however much the
+	 * merges before them have grown the file. The kernels copy of a
+	 * merged text segment is discarded and replaced by the image.
+	 */
+	buf = HUGE_ALLOC(STREAM_BUF_LEN);
+	in_pos = head_len;
+	shift = 0;
+	for (merged = 0, i = 0; i < count; i++) {
+		struct text_merge *m = &merges[i];
+
+		if (m->phdr_index < 0 || m->old_offset < in_pos)
+			continue;
+		n = stream_copy(in, fd, buf, m->old_offset - in_pos, in_pos + shift);
+		if (n < 0 || n != m->old_offset - in_pos) {
+			log_msg(__LINE__, "core pipe ended before text segment at offset %lx", (unsigned long)m->old_offset);
+			return NULL;
+		}
+		in_pos = m->old_offset;
+		if (stream_copy(in, fd, buf, m->old_filesz, -1) < 0)
+			return NULL;
+		in_pos += m->old_filesz;
+		len = m->len < m->new_filesz ? m->len : m->new_filesz;
+		if (write_full(fd, m->image, len, m->new_offset) < 0) {
+			log_msg(__LINE__, "pwrite %s", strerror(errno));
+			return NULL;
+		}
+		shift += m->new_filesz - m->old_filesz;
+		merged++;
+	}
+	for (;;) {
+		n = read_full(in, buf, STREAM_BUF_LEN);
+		if (n < 0) {
+			log_msg(__LINE__, "read %s", strerror(errno));
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		if (sparse_pwrite(fd, buf, n, in_pos + shift) != n) {
+			log_msg(__LINE__, "pwrite %s", strerror(errno));
+			return NULL;
+		}
+		in_pos += n;
+	}
+	out_pos = in_pos + shift;
+	if (ftruncate(fd, out_pos) < 0)
+		log_msg(__LINE__, "ftruncate %s", strerror(errno));
+	close(fd);
+
+	/*
+	 * The shared library text images are no longer needed
+	 * once they are in the file; the executables text is
+	 * still used later on.
+	 */
+	for (j = 0; j < memdesc->mapcount; j++) {
+		if (memdesc->maps[j].text_image != NULL && memdesc->maps[j].text_image != MAP_FAILED) {
+			munmap(memdesc->maps[j].text_image, memdesc->maps[j].text_len);
+			memdesc->maps[j].text_image = NULL;
+		}
+	}
+#if DEBUG
+	log_msg(__LINE__, "stream_core_to_ecfs(): merged %d text images, wrote %ld bytes to %s", merged, (long)out_pos, outfile);
+#endif
+	munmap(buf, STREAM_BUF_LEN);
+	free(orig_phdr);
+	free(merges);
+	free(head);
+	return load_core_file(outfile);
+}
@@ -25,12 +25,33 @@
 
 #include "../include/ecfs.h"
 #include "../include/util.h"
+#include "../include/core_text.h"
+#include "../include/proc.h"
+#include "../include/replay.h"
+#include <sys/uio.h>
+#include <limits.h>
+
+/*
+ * /proc/$pid/mem is opened once and the fd is kept around for
+ * every subsequent read from the same process.
+ */
+static int pmem_fd = -1;
+static pid_t pmem_pid;
 
 static ssize_t read_pmem(pid_t pid, uint8_t *ptr, unsigned long vaddr, size_t len)
 {	
-	char *path = xfmtstrdup("/proc/%d/mem", pid);
-	int fd = xopen(path, O_RDONLY);
-	ssize_t bytes = pread(fd, ptr, len, vaddr);
+	char path[PATH_MAX];
+
+	if (opts.replay_dir != NULL)
+		return replay_read_mem(pid, ptr, vaddr, len);
+	if (pmem_fd < 0 || pmem_pid != pid) {
+		proc_path(path, sizeof(path), pid, "mem");
+		if (pmem_fd >= 0)
+			close(pmem_fd);
+		pmem_fd = xopen(path, O_RDONLY);
+		pmem_pid = pid;
+	}
+	ssize_t bytes = pread(pmem_fd, ptr, len, vaddr);
 	if (bytes != len) {
 		log_msg(__LINE__, "pread failed [read %d bytes]: %s", (int)bytes, strerror(errno));
 		return -1;
@@ -66,7 +87,7 @@ ssize_t get_segment_from_pmem(unsigned long vaddr, memdesc_t *memdesc, uint8_t *
 	
 }
 
-int merge_exe_text_into_core(const char *path, memdesc_t *memdesc)
+int merge_exe_text_into_core(int *core_fd, memdesc_t *memdesc)
 {
         ElfW(Ehdr) *ehdr;
         ElfW(Phdr) *phdr;
@@ -76,29 +97,18 @@ int merge_exe_text_into_core(const char *path, memdesc_t *memdesc)
         //size_t textSize;
         uint8_t *mem;
         struct stat st;
-        int in, out, i = 0;
+        int in = *core_fd, out, i = 0;
         int data_index;
 
-	in = xopen(path, O_RDWR);
 	xfstat(in, &st);
 	
 	/*
-	 * tmp will point to the new temporary file that contains
-	 * our corefile with a merged in program text segment and
-	 * with updated p_filesz, and updated p_offsets for phdr's 
-	 * that follow it.
+	 * out is a new staging file that contains our corefile
+	 * with a merged in program text segment and with updated
+	 * p_filesz, and updated p_offsets for phdr's that follow it.
 	 */
-	char *tmp_dir = opts.use_ramdisk ? ECFS_RAMDISK_DIR : ECFS_CORE_DIR;
-	char *tmp = xfmtstrdup("%s/.tmp_merged_core", tmp_dir);
-        do {
-                if (access(tmp, F_OK) == 0) {
-                        free(tmp);
-                        tmp = xfmtstrdup("%s/.tmp_merged_core.%d", tmp_dir, ++i);
-                } else
-                        break;
-
-        } while(1);
-        out = xopen(tmp, O_RDWR|O_CREAT);
+	if ((out = ecfs_tmpfile("ecfs_merged_core")) < 0)
+		return -1;
 
         /*
          * Earlier on we read the text segment from /proc/$pid/mem
@@ -112,22 +122,13 @@ int merge_exe_text_into_core(const char *path, memdesc_t *memdesc)
 	textVaddr = memdesc->text.base;
 	if (textVaddr == 0) {
 		log_msg(__LINE__, "(From merge_exe_text_into_core function) Could not find text address");
-		return -1;
+		goto fail;
 	}
 
-        /*
-         * Get textVaddr as it pertains to the mappings
-         */
-        textVaddr = memdesc->text.base;
-        if (textVaddr == 0) {
-            log_msg(__LINE__, "(From merge_texts_into_core function) Could not find text address");
-            return -1;
-        }
-
         mem = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, in, 0);
         if (mem == MAP_FAILED) {
             log_msg(__LINE__, "mmap %s", strerror(errno));
-            return -1;
+            goto fail;
         }
         ehdr = (ElfW(Ehdr) *)mem;
         phdr = (ElfW(Phdr) *)(mem + ehdr->e_phoff);
@@ -152,198 +153,365 @@ int merge_exe_text_into_core(const char *path, memdesc_t *memdesc)
 		}
 	}
 				
-	if (textVaddr == 0) {
+	if (!found_text) {
 		log_msg(__LINE__, "Failed to merge texts into core");
-		return -1;
-	}
-	if (write(out, mem, textOffset) < 0) {
-		log_msg(__LINE__, "write %s", strerror(errno));
-		return -1;
-	}
-	if (write(out, textseg, tlen) < 0) {
-		log_msg(__LINE__, "write %s", strerror(errno));
-		return -1;
+		munmap(mem, st.st_size);
+		goto fail;
 	}
-	if (write(out, &mem[dataOffset], st.st_size - textOffset) < 0) {
+	/*
+	 * The final size is known up front, so size the staging file
+	 * once and fill it in with pwrite()s. Everything from the data
+	 * segment on moves by the same amount as the phdrs above.
+	 */
+	if (ftruncate(out, st.st_size + (tlen - 4096)) < 0 ||
+	    pwrite(out, mem, textOffset, 0) != textOffset ||
+	    pwrite(out, textseg, tlen, textOffset) != tlen ||
+	    pwrite(out, &mem[dataOffset], st.st_size - dataOffset, dataOffset + (tlen - 4096)) != st.st_size - dataOffset) {
 		log_msg(__LINE__, "write %s", strerror(errno));
-		return -1;
+		munmap(mem, st.st_size);
+		goto fail;
 	}
-
-	fsync(out);
-	close(out);
-	close(in);
-
 	munmap(mem, st.st_size);
 
 #if DEBUG
-	log_msg(__LINE__, "merge_exe_text_into_core(): renaming %s back to %s", tmp, path);
+	log_msg(__LINE__, "merge_exe_text_into_core(): replacing staged core fd %d with %d", in, out);
 #endif
-	if (rename(tmp, path) < 0) {
-		log_msg(__LINE__, "rename %s", strerror(errno));
-		return -1;
-	}
-  	chmod(path, S_IRWXU|S_IRWXG|S_IROTH|S_IWOTH|S_IXOTH);
+	ecfs_seal(out);
+	close(in);
+	*core_fd = out;
 	return 0;
+fail:
+	close(out);
+	return -1;
 }
 
-static int merge_text_image(const char *path, unsigned long text_addr, uint8_t *text_image, ssize_t text_len)
+static int qsort_cmp_by_offset(const void *a, const void *b)
 {
-        ElfW(Ehdr) *ehdr;
-        ElfW(Phdr) *phdr;
-        ElfW(Off) textOffset; // offset of text segment in question
-        ElfW(Off) nextOffset; // offset of phdr after the text segment in question
-        size_t textSize;
-        uint8_t *mem;
-        struct stat st;
-        int in, out, i = 0;
-	ssize_t tlen = text_len;
-	
-	log_msg(__LINE__, "xopen path: %s", path);
-        in = xopen(path, O_RDONLY);
-        xfstat(in, &st);
-	
-        /*
-         * tmp will point to the new temporary file that contains
-         * our corefile with a merged in program text segment and
-         * with updated p_filesz, and updated p_offsets for phdr's 
-         * that follow it.
-         */
-	char *tmp_dir = opts.use_ramdisk ? ECFS_RAMDISK_DIR : ECFS_CORE_DIR;
-        char *tmp = xfmtstrdup("%s/.tmp_merging_shlibs", tmp_dir);
-        do {
-                if (access(tmp, F_OK) == 0) {
-                        free(tmp);
-                        tmp = xfmtstrdup("%s/.tmp_merging_shlibs.%d", tmp_dir, ++i);
-                } else
-                        break;
-
-        } while(1);
-        out = xopen(tmp, O_RDWR|O_CREAT);
-        //fchmod(out, S_IRWXU|S_IRWXG|S_IROTH|S_IWOTH|S_IXOTH);
+	const struct text_merge *ma = *(const struct text_merge **)a;
+	const struct text_merge *mb = *(const struct text_merge **)b;
 
+	if (ma->old_offset == mb->old_offset)
+		return 0;
+	return ma->old_offset < mb->old_offset ? -1 : 1;
+}
+
+/*
+ * Merge every text image in merges[] into the staged core file with
+ * a single rewrite into a new staging file, which replaces *core_fd. plan_text_merges() works out the final location of
+ * every segment first; then the gaps between merged segments are copied
+ * from the original file and the images are written in their place.
+ */
+static int merge_text_images(int *core_fd, struct text_merge *merges, int count)
+{
+	ElfW(Ehdr) *ehdr;
+	ElfW(Phdr) *phdr;
+	struct text_merge **sorted;
+	uint8_t *mem;
+	struct stat st;
+	ElfW(Off) in_pos;
+	off_t out_pos;
+	size_t len;
+	ssize_t growth;
+	int in = *core_fd, out, i, j, valid;
+
+	xfstat(in, &st);
 	mem = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, in, 0);
-        if (mem == MAP_FAILED) {
-                log_msg(__LINE__, "mmap %s", strerror(errno));
-                return -1;
-        }
-        ehdr = (ElfW(Ehdr) *)mem;
-        phdr = (ElfW(Phdr) *)(mem + ehdr->e_phoff);
-        int found_text = 0;
-	
+	if (mem == MAP_FAILED) {
+		log_msg(__LINE__, "mmap %s", strerror(errno));
+		return -1;
+	}
+	ehdr = (ElfW(Ehdr) *)mem;
+	phdr = (ElfW(Phdr) *)(mem + ehdr->e_phoff);
+
 	/*
-	 * XXX
-	 * we must plan to make room for the case where the text segment
-	 * in question is the very last phdr in the file in which case phdr[i + 1]
-	 * will cause a segfault. (highly unlikely since any real shared library
-	 * should have a data segment following the text segment)
+	 * phdr lives in our private mapping so the planned layout
+	 * is written out along with the rest of the head.
 	 */
-	for (i = 0; i < ehdr->e_phnum; i++) {
-		if (text_addr == phdr[i].p_vaddr) {
-		 	textOffset = phdr[i].p_offset;
-                        nextOffset = phdr[i + 1].p_offset;   // data segment usually always i + 1 after text
-                        textSize = phdr[i].p_memsz;         // get memsz of text
-                        phdr[i].p_filesz = phdr[i].p_memsz; // make filesz same as memsz
-                        found_text++;
-
-                }
-                else
-                if (found_text && phdr[i].p_type == PT_LOAD) {
-#if DEBUG
-			log_msg(__LINE__, "re-adjusting offset for phdr(0x%lx) from %lx to %lx\n", 
-				phdr[i].p_vaddr, phdr[i].p_offset, phdr[i].p_offset + (tlen - 4096));
-#endif
-                        phdr[i].p_offset += (tlen - 4096); // we must push the other segments forward to make room for whole text image
-                }
-        }
-        if (found_text == 0) {
-                log_msg(__LINE__, "Failed to merge texts into core");
-                return -1;
-        }
-        if (write(out, mem, textOffset) < 0) {
-                log_msg(__LINE__, "[FAILURE] write(): %s", strerror(errno));
-                return -1;
-        }
-        if (write(out, text_image, tlen) < 0) {
-                log_msg(__LINE__, "[FAILURE] write(): %s", strerror(errno));
-                return -1;
-        }
-	/*
-	 * Take special care to free text_image 
-	 * we likely have alot of memory mappings taking up	
- 	 * memory if we are dealing with a large process and
-	 * must free up these mappings as soon as we are done
-	 * with them. otherwise resource hogging will happen.	
- 	 */
-	if (munmap(text_image, tlen) < 0) {
-		log_msg(__LINE__, "[FAILURE] munmap(): %s", strerror(errno));
-		return -1;
+	growth = plan_text_merges(phdr, ehdr->e_phnum, merges, count);
+	for (valid = 0, i = 0; i < count; i++)
+		if (merges[i].phdr_index >= 0)
+			valid++;
+	if (valid == 0) {
+		munmap(mem, st.st_size);
+		return 0;
 	}
+	sorted = (struct text_merge **)heapAlloc(sizeof(struct text_merge *) * valid);
+	for (j = 0, i = 0; i < count; i++)
+		if (merges[i].phdr_index >= 0)
+			sorted[j++] = &merges[i];
+	qsort(sorted, valid, sizeof(struct text_merge *), qsort_cmp_by_offset);
 
-        if (write(out, &mem[nextOffset], st.st_size - textOffset) < 0) {
-                log_msg(__LINE__, "[FAILURE] write(): %s", strerror(errno));
-                return -1;
-        }
+	if ((out = ecfs_tmpfile("ecfs_merged_shlibs")) < 0) {
+		munmap(mem, st.st_size);
+		free(sorted);
+		return -1;
+	}
+	if (ftruncate(out, st.st_size + growth) < 0) {
+		log_msg(__LINE__, "ftruncate %s", strerror(errno));
+		goto fail;
+	}
 
-        fsync(out);
-        close(out);
-        close(in);
+	for (in_pos = 0, out_pos = 0, i = 0; i < valid; i++) {
+		len = sorted[i]->old_offset - in_pos;
+		if (pwrite(out, &mem[in_pos], len, out_pos) != len) {
+			log_msg(__LINE__, "pwrite %s", strerror(errno));
+			goto fail;
+		}
+		len = sorted[i]->len < sorted[i]->new_filesz ? sorted[i]->len : sorted[i]->new_filesz;
+		if (pwrite(out, sorted[i]->image, len, sorted[i]->new_offset) != len) {
+			log_msg(__LINE__, "pwrite %s", strerror(errno));
+			goto fail;
+		}
+		in_pos = sorted[i]->old_offset + sorted[i]->old_filesz;
+		out_pos = sorted[i]->new_offset + sorted[i]->new_filesz;
+	}
+	len = st.st_size - in_pos;
+	if (pwrite(out, &mem[in_pos], len, out_pos) != len) {
+		log_msg(__LINE__, "pwrite %s", strerror(errno));
+		goto fail;
+	}
 	munmap(mem, st.st_size);
+	free(sorted);
 
 #if DEBUG
-	log_msg(__LINE__, "merge_text_image(): renaming %s back to %s", tmp, path);
+	log_msg(__LINE__, "merge_text_images(): merged %d text images, replacing staged core fd %d with %d", valid, in, out);
 #endif
-        if (rename(tmp, path) < 0) {
-                log_msg(__LINE__, "rename %s", strerror(errno));
-                return -1;
-        }
-	chmod(path, S_IRWXU|S_IRWXG|S_IROTH|S_IWOTH|S_IXOTH); 
-        return 0;
-
+	ecfs_seal(out);
+	close(in);
+	*core_fd = out;
+	return 0;
+fail:
+	close(out);
+	munmap(mem, st.st_size);
+	free(sorted);
+	return -1;
 }
 
-void create_shlib_text_mappings(memdesc_t *memdesc)
+struct text_capture {
+	unsigned long base;
+	size_t len;
+	uint8_t **image;	// where to store the allocated image
+	ssize_t *image_len;	// where to store its length (NULL for the exe)
+};
+
+int capture_text_segments(memdesc_t *memdesc)
 {
-	int i;
 	mappings_t *maps = memdesc->maps;
-	ssize_t tlen;
-	
+	struct text_capture *cap;
+	struct iovec *local, *remote;
+	pid_t pid = memdesc->task.pid;
+	int i, j, k, n, count = 0, failed = 0;
+	ssize_t ret, got;
+
+	cap = (struct text_capture *)heapAlloc(sizeof(struct text_capture) * (memdesc->mapcount + 1));
 	for (i = 0; i < memdesc->mapcount; i++) {
-		if (!maps[i].shlib)
+		if (memdesc->text.base >= maps[i].base && memdesc->text.base < maps[i].base + maps[i].size) {
+			cap[count].base = maps[i].base;
+			cap[count].len = maps[i].size;
+			cap[count].image = &memdesc->textseg;
+			cap[count].image_len = NULL;
+			count++;
 			continue;
-		if (!(maps[i].p_flags & PF_X))
-			continue;
-		tlen = get_segment_from_pmem(maps[i].base, memdesc, &(maps[i].text_image));
-		if (tlen < 0) {
-			log_msg(__LINE__, "get_segment_from_pmem(%lx, ...) failed", maps[i].base);
+		}
+		if (!opts.text_all || !maps[i].shlib || !(maps[i].p_flags & PF_X))
 			continue;
+		cap[count].base = maps[i].base;
+		cap[count].len = maps[i].size;
+		cap[count].image = &maps[i].text_image;
+		cap[count].image_len = &maps[i].text_len;
+		count++;
+	}
+
+	local = (struct iovec *)heapAlloc(sizeof(struct iovec) * (count + 1));
+	remote = (struct iovec *)heapAlloc(sizeof(struct iovec) * (count + 1));
+	for (i = 0; i < count; i++) {
+		*cap[i].image = HUGE_ALLOC(cap[i].len);
+		local[i].iov_base = *cap[i].image;
+		local[i].iov_len = cap[i].len;
+		remote[i].iov_base = (void *)cap[i].base;
+		remote[i].iov_len = cap[i].len;
+	}
+
+	/*
+	 * Stop the task once for every range rather than once per
+	 * mapping, and pull IOV_MAX ranges per process_vm_readv().
+	 * process_vm_readv() stops at the first range it can't read,
+	 * so anything after that in the batch goes through the (single)
+	 * /proc/$pid/mem fd instead.
+	 */
+	deliver_signal(pid, SIGSTOP);
+	for (i = 0; i < count; i += n) {
+		n = count - i > IOV_MAX ? IOV_MAX : count - i;
+		if (opts.replay_dir == NULL)
+			ret = process_vm_readv(pid, &local[i], n, &remote[i], n, 0);
+		else
+			ret = -1; // everything comes out of the snapshot
+		for (got = 0, j = i; j < i + n; j++) {
+			if (ret >= 0 && got + (ssize_t)cap[j].len <= ret) {
+				got += cap[j].len;
+				continue;
+			}
+			for (k = j; k < i + n; k++) {
+				if (read_pmem(pid, *cap[k].image, cap[k].base, cap[k].len) < 0) {
+					log_msg(__LINE__, "failed to read text segment at %lx", cap[k].base);
+					munmap(*cap[k].image, cap[k].len);
+					*cap[k].image = NULL;
+					failed++;
+				}
+			}
+			break;
 		}
-		maps[i].text_len = tlen;
 	}
+	deliver_signal(pid, SIGCONT);
+
+	for (i = 0; i < count; i++) {
+		if (opts.record_dir != NULL && *cap[i].image != NULL)
+			replay_record_mem(pid, cap[i].base, *cap[i].image, cap[i].len);
+		if (cap[i].image_len != NULL)
+			*cap[i].image_len = *cap[i].image == NULL ? 0 : cap[i].len;
+		else
+		if (*cap[i].image == NULL)
+			failed = -1; // the executables text is required
+	}
+#if DEBUG
+	log_msg(__LINE__, "capture_text_segments(): captured %d text segments", count);
+#endif
+	if (pmem_fd >= 0) {
+		close(pmem_fd);
+		pmem_fd = -1;
+	}
+	free(local);
+	free(remote);
+	free(cap);
+	return failed < 0 ? -1 : 0;
 }
 
-int merge_shlib_texts_into_core(const char *corefile, memdesc_t *memdesc)
+int merge_shlib_texts_into_core(int *core_fd, memdesc_t *memdesc)
 {
-	int i, ret = -1;
-	mappings_t *maps = memdesc->maps;
+	struct text_merge *merges;
+	int i, count, ret;
 #if DEBUG
 	log_msg(__LINE__, "merge_shlib_texts_into_core() has been called");
 #endif
+	/*
+	 * The executables text has already been merged by now, so
+	 * plan_text_merges() skips it (its p_filesz == p_memsz) and
+	 * only the shared library texts are merged, all at once.
+	 */
+	count = get_text_merges(memdesc, &merges);
+	ret = merge_text_images(core_fd, merges, count);
+	if (ret < 0)
+		log_msg(__LINE__, "merge_text_images() failed to merge %d shlib text images", count);
 	for (i = 0; i < memdesc->mapcount; i++) {
-		if (!maps[i].shlib)
+		if (memdesc->maps[i].text_image != NULL) {
+			munmap(memdesc->maps[i].text_image, memdesc->maps[i].text_len);
+			memdesc->maps[i].text_image = NULL;
+		}
+	}
+	free(merges);
+	return ret;
+}
+
+int get_text_merges(memdesc_t *memdesc, struct text_merge **merges)
+{
+	mappings_t *maps = memdesc->maps;
+	int i, count = 0;
+
+	*merges = (struct text_merge *)heapAlloc(sizeof(struct text_merge) * (memdesc->mapcount + 1));
+	if (memdesc->textseg != NULL && memdesc->textseg != MAP_FAILED && memdesc->text.base != 0) {
+		(*merges)[count].vaddr = memdesc->text.base;
+		(*merges)[count].image = memdesc->textseg;
+		(*merges)[count].len = memdesc->text.size;
+		count++;
+	}
+	if (!opts.text_all)
+		return count;
+
+	for (i = 0; i < memdesc->mapcount; i++) {
+		if (!maps[i].shlib || !(maps[i].p_flags & PF_X))
 			continue;
-		if (!(maps[i].p_flags & PF_X))
+		if (maps[i].text_image == NULL || maps[i].text_image == MAP_FAILED || maps[i].text_len <= 0)
 			continue;
-		/* If we got here we have an executable
-	 	 * segment of a shared library.
-	 	 */
+		(*merges)[count].vaddr = maps[i].base;
+		(*merges)[count].image = maps[i].text_image;
+		(*merges)[count].len = maps[i].text_len;
+		count++;
+	}
+	return count;
+}
+
+ssize_t plan_text_merges(ElfW(Phdr) *phdr, int phnum, struct text_merge *merges, int count)
+{
+	struct text_merge **sorted;
+	ssize_t *growth, total = 0;
+	int i, j, lo, hi, valid = 0;
+
+	/*
+	 * Resolve every image to the PT_LOAD it belongs to while the
+	 * offsets are still the ones written by the kernel. Segments
+	 * that are already complete (p_filesz == p_memsz) are left alone.
+	 */
+	for (i = 0; i < count; i++) {
+		merges[i].phdr_index = -1;
+		for (j = 0; j < phnum; j++) {
+			if (phdr[j].p_type != PT_LOAD)
+				continue;
+			if (merges[i].vaddr < phdr[j].p_vaddr || merges[i].vaddr >= phdr[j].p_vaddr + phdr[j].p_memsz)
+				continue;
+			if (phdr[j].p_filesz < phdr[j].p_memsz) {
+				merges[i].phdr_index = j;
+				merges[i].old_offset = phdr[j].p_offset;
+				merges[i].old_filesz = phdr[j].p_filesz;
+				merges[i].new_filesz = phdr[j].p_memsz;
+			}
+			break;
+		}
+		for (j = 0; j < i && merges[i].phdr_index >= 0; j++) {
+			if (merges[j].phdr_index == merges[i].phdr_index)
+				merges[i].phdr_index = -1; // same segment listed twice
+		}
+		if (merges[i].phdr_index >= 0)
+			valid++;
+	}
+	if (valid == 0)
+		return 0;
+
+	/*
+	 * Sort the merges by their original file offset and keep a running
+	 * total of how much each one grows the file. The new offset of any
+	 * segment is then its old offset plus the growth of every merged
+	 * segment that came before it, found with a binary search.
+	 */
+	sorted = (struct text_merge **)heapAlloc(sizeof(struct text_merge *) * valid);
+	growth = (ssize_t *)heapAlloc(sizeof(ssize_t) * (valid + 1));
+	for (j = 0, i = 0; i < count; i++)
+		if (merges[i].phdr_index >= 0)
+			sorted[j++] = &merges[i];
+	qsort(sorted, valid, sizeof(struct text_merge *), qsort_cmp_by_offset);
+	for (growth[0] = 0, i = 0; i < valid; i++)
+		growth[i + 1] = growth[i] + (sorted[i]->new_filesz - sorted[i]->old_filesz);
+	total = growth[valid];
+
+	for (j = 0; j < phnum; j++) {
+		for (lo = 0, hi = valid; lo < hi;) {
+			int mid = (lo + hi) / 2;
+			if (sorted[mid]->old_offset < phdr[j].p_offset)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		phdr[j].p_offset += growth[lo];
+	}
+	for (i = 0; i < valid; i++) {
+		phdr[sorted[i]->phdr_index].p_filesz = sorted[i]->new_filesz;
+		sorted[i]->new_offset = phdr[sorted[i]->phdr_index].p_offset;
 #if DEBUG
-		log_msg(__LINE__, "call merge_text_image(%s, %lx, %p, %u)", corefile, maps[i].base, maps[i].text_image, maps[i].text_len);
+		log_msg(__LINE__, "plan_text_merges(): segment %lx moves from offset %lx to %lx (filesz %lx -> %lx)",
+		    phdr[sorted[i]->phdr_index].p_vaddr, sorted[i]->old_offset, sorted[i]->new_offset,
+		    sorted[i]->old_filesz, sorted[i]->new_filesz);
 #endif
-		ret = merge_text_image(corefile, maps[i].base, maps[i].text_image, maps[i].text_len); 
-		if (ret < 0) {
-			log_msg(__LINE__, "get_segment_from_pmem(%lx, ...) failed\n", maps[i].base);
-			continue;
-		}
 	}
-        return ret;
+	free(sorted);
+	free(growth);
+	return total;
 }
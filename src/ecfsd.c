@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/ecfsd.h"
+#include <sys/un.h>
+
+int ecfsd_submit(int argc, char **argv, int core_fd, int proc_fd)
+{
+	struct sockaddr_un addr;
+	struct ecfsd_request req;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov[2];
+	char args[ECFSD_MAX_ARGV_LEN];
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	size_t len = 0, n;
+	char ack;
+	int i, sock;
+
+	if (argc > ECFSD_MAX_ARGS)
+		return -1;
+	for (i = 0; i < argc; i++) {
+		n = strlen(argv[i]) + 1;
+		if (len + n > sizeof(args))
+			return -1;
+		memcpy(&args[len], argv[i], n);
+		len += n;
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, ECFSD_SOCKET, sizeof(addr.sun_path) - 1);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	req.magic = ECFSD_MAGIC;
+	req.argc = argc;
+	req.argv_len = len;
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = args;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	((int *)CMSG_DATA(cmsg))[0] = core_fd;
+	((int *)CMSG_DATA(cmsg))[1] = proc_fd;
+
+	/*
+	 * The request is small enough to always go out in one piece
+	 * on a unix stream socket. We then block until a worker has
+	 * taken it; if the connection goes away without the ack then
+	 * nobody read from the pipe and the caller can fall back.
+	 */
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(req) + len ||
+	    read(sock, &ack, 1) != 1) {
+		close(sock);
+		return -1;
+	}
+	close(sock);
+	return 0;
+}
+
+static int recv_request(int sock, int *argc, char ***argv, int *core_fd, int *proc_fd)
+{
+	struct ecfsd_request req;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	char *args, *p;
+	ssize_t n;
+	int i, *fds;
+
+	*core_fd = *proc_fd = -1;
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sock, &msg, MSG_WAITALL|MSG_CMSG_CLOEXEC) != sizeof(req))
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+			fds = (int *)CMSG_DATA(cmsg);
+			*core_fd = fds[0];
+			*proc_fd = fds[1];
+		}
+	}
+	if (*core_fd < 0 || req.magic != ECFSD_MAGIC || req.argc == 0 ||
+	    req.argc > ECFSD_MAX_ARGS || req.argv_len > ECFSD_MAX_ARGV_LEN)
+		return -1;
+	args = heapAlloc(req.argv_len + 1);
+	if ((n = recv(sock, args, req.argv_len, MSG_WAITALL)) != req.argv_len)
+		return -1;
+	*argv = (char **)heapAlloc((req.argc + 1) * sizeof(char *));
+	for (p = args, i = 0; i < req.argc; i++) {
+		if (p >= args + req.argv_len)
+			return -1;
+		(*argv)[i] = p;
+		p += strlen(p) + 1;
+	}
+	*argc = req.argc;
+	return 0;
+}
+
+/*
+ * The /proc/<pid> fd was opened by the handler while the pid was
+ * certainly the crashing process; refuse the dump if the pid we are
+ * about to read from is a different process.
+ */
+static int check_proc_fd(int argc, char **argv, int proc_fd)
+{
+	struct stat st1, st2;
+	char path[64];
+	int i, pid = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p") && i + 1 < argc)
+			pid = atoi(argv[i + 1]);
+		else if (!strncmp(argv[i], "-p", 2) && argv[i][2] != '\0')
+			pid = atoi(&argv[i][2]);
+	}
+	if (pid <= 0 || proc_fd < 0)
+		return -1;
+	snprintf(path, sizeof(path), "/proc/%d", pid);
+	if (fstat(proc_fd, &st1) < 0 || stat(path, &st2) < 0)
+		return -1;
+	return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino ? 0 : -1;
+}
+
+int ecfsd_accept(int *argc, char ***argv)
+{
+	struct ucred cred;
+	socklen_t len;
+	int sock, core_fd, proc_fd, ret;
+	char ack = 0;
+
+	for (;;) {
+		if ((sock = accept4(ECFSD_LISTEN_FD, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			log_msg(__LINE__, "ecfsd accept %s", strerror(errno));
+			return -1;
+		}
+		len = sizeof(cred);
+		if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != 0) {
+			log_msg(__LINE__, "ecfsd: rejecting request from uid %d", (int)cred.uid);
+			close(sock);
+			continue;
+		}
+		ret = recv_request(sock, argc, argv, &core_fd, &proc_fd);
+		if (ret == 0)
+			ret = check_proc_fd(*argc, *argv, proc_fd);
+		if (ret == 0 && dup2(core_fd, STDIN_FILENO) < 0)
+			ret = -1;
+		if (core_fd >= 0)
+			close(core_fd);
+		if (proc_fd >= 0)
+			close(proc_fd);
+		if (ret < 0) {
+			log_msg(__LINE__, "ecfsd: dropping malformed or stale request");
+			close(sock);
+			continue;
+		}
+		break;
+	}
+	/*
+	 * One dump per worker: nobody else may be handed to us, and the
+	 * handler can go away now that we hold the pipe.
+	 */
+	close(ECFSD_LISTEN_FD);
+	signal(SIGTERM, SIG_IGN);
+	if (write(sock, &ack, 1) != 1)
+		log_msg(__LINE__, "ecfsd: handler went away before the ack");
+	close(sock);
+	return 0;
+}
@@ -167,6 +167,467 @@ int get_all_functions(const char *filepath, struct fde_func_data **funcs)
 	return fde_element_count;
 }
 
+/*
+ * Native .eh_frame/.eh_frame_hdr parsing. This walks the unwind tables
+ * straight out of a mapped ELF image instead of going through libdwarf,
+ * which is far cheaper on binaries with a large number of functions.
+ * A region describes a chunk of memory and the vaddr it is loaded at,
+ * so that pc-relative and data-relative pointers can be resolved.
+ */
+struct eh_region {
+	const uint8_t *mem;
+	size_t len;
+	uint64_t vaddr;
+};
 
-	
-	
+#define EH_VADDR(r, p) ((r)->vaddr + (uint64_t)((const uint8_t *)(p) - (r)->mem))
+
+static int read_uleb128(const uint8_t **pp, const uint8_t *end, uint64_t *val)
+{
+	const uint8_t *p = *pp;
+	uint64_t result = 0;
+	int shift = 0;
+
+	do {
+		if (p >= end || shift > 63)
+			return -1;
+		result |= (uint64_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	*pp = p;
+	*val = result;
+	return 0;
+}
+
+static int read_sleb128(const uint8_t **pp, const uint8_t *end, int64_t *val)
+{
+	const uint8_t *p = *pp;
+	uint64_t result = 0;
+	int shift = 0;
+	uint8_t byte;
+
+	do {
+		if (p >= end || shift > 63)
+			return -1;
+		byte = *p++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	if (shift < 64 && (byte & 0x40))
+		result |= -((uint64_t)1 << shift);
+	*pp = p;
+	*val = (int64_t)result;
+	return 0;
+}
+
+/*
+ * Read a DW_EH_PE_* encoded pointer. datarel is the base used for
+ * DW_EH_PE_datarel (the .eh_frame_hdr address). The indirect bit is
+ * ignored; callers only use this for values that are never indirect,
+ * or that they just want to skip (the personality pointer).
+ */
+static int read_encoded(const struct eh_region *r, const uint8_t **pp, uint8_t enc,
+			uint64_t datarel, uint64_t *val)
+{
+	const uint8_t *p = *pp, *end = r->mem + r->len;
+	uint64_t pc = EH_VADDR(r, p), v;
+	int64_t sv;
+	size_t n;
+
+	if (enc == DW_EH_PE_omit)
+		return -1;
+	switch (enc & 0x0f) {
+	case DW_EH_PE_absptr:
+		n = sizeof(ElfW(Addr));
+		break;
+	case DW_EH_PE_udata2:
+	case DW_EH_PE_sdata2:
+		n = 2;
+		break;
+	case DW_EH_PE_udata4:
+	case DW_EH_PE_sdata4:
+		n = 4;
+		break;
+	case DW_EH_PE_udata8:
+	case DW_EH_PE_sdata8:
+		n = 8;
+		break;
+	case DW_EH_PE_uleb128:
+		if (read_uleb128(&p, end, &v) < 0)
+			return -1;
+		n = 0;
+		break;
+	case DW_EH_PE_sleb128:
+		if (read_sleb128(&p, end, &sv) < 0)
+			return -1;
+		v = (uint64_t)sv;
+		n = 0;
+		break;
+	default:
+		return -1;
+	}
+	if (n) {
+		if ((size_t)(end - p) < n)
+			return -1;
+		switch (enc & 0x0f) {
+		case DW_EH_PE_absptr:
+			v = sizeof(ElfW(Addr)) == 8 ? *(uint64_t *)p : *(uint32_t *)p;
+			break;
+		case DW_EH_PE_udata2:
+			v = *(uint16_t *)p;
+			break;
+		case DW_EH_PE_sdata2:
+			v = (uint64_t)(int64_t)*(int16_t *)p;
+			break;
+		case DW_EH_PE_udata4:
+			v = *(uint32_t *)p;
+			break;
+		case DW_EH_PE_sdata4:
+			v = (uint64_t)(int64_t)*(int32_t *)p;
+			break;
+		default:
+			v = *(uint64_t *)p;
+			break;
+		}
+		p += n;
+	}
+	switch (enc & 0x70) {
+	case DW_EH_PE_absptr:
+		break;
+	case DW_EH_PE_pcrel:
+		v += pc;
+		break;
+	case DW_EH_PE_datarel:
+		v += datarel;
+		break;
+	default:
+		return -1;
+	}
+	if (sizeof(ElfW(Addr)) == 4)
+		v &= 0xffffffff;
+	*pp = p;
+	*val = v;
+	return 0;
+}
+
+/*
+ * Read the length and id fields of a CIE/FDE record. On success *body
+ * points just past the id field and *next to the following record.
+ * Returns 1 for the zero terminator.
+ */
+static int read_record_header(const struct eh_region *r, const uint8_t *rec, const uint8_t **idp,
+			      uint64_t *id, const uint8_t **body, const uint8_t **next)
+{
+	const uint8_t *p = rec, *end = r->mem + r->len;
+	uint64_t len;
+	int wide = 0;
+
+	if ((size_t)(end - p) < 4)
+		return -1;
+	len = *(uint32_t *)p;
+	p += 4;
+	if (len == 0)
+		return 1;
+	if (len == 0xffffffff) {
+		if ((size_t)(end - p) < 8)
+			return -1;
+		len = *(uint64_t *)p;
+		p += 8;
+		wide = 1;
+	}
+	if (len > (uint64_t)(end - p) || len < (wide ? 8 : 4))
+		return -1;
+	*next = p + len;
+	*idp = p;
+	*id = wide ? *(uint64_t *)p : *(uint32_t *)p;
+	*body = p + (wide ? 8 : 4);
+	return 0;
+}
+
+/*
+ * We only need the FDE pointer encoding ('R' augmentation) out of a CIE.
+ */
+static int parse_cie(const struct eh_region *r, const uint8_t *cie, uint8_t *fde_enc)
+{
+	const uint8_t *idp, *p, *end, *aug;
+	uint64_t id, uval;
+	int64_t sval;
+	uint8_t version, penc;
+
+	if (read_record_header(r, cie, &idp, &id, &p, &end) != 0 || id != 0)
+		return -1;
+	if (p >= end)
+		return -1;
+	version = *p++;
+	aug = p;
+	while (p < end && *p)
+		p++;
+	if (p++ >= end)
+		return -1;
+	if (read_uleb128(&p, end, &uval) < 0 || read_sleb128(&p, end, &sval) < 0)
+		return -1;
+	if (version == 1)
+		p++;
+	else if (read_uleb128(&p, end, &uval) < 0)
+		return -1;
+	*fde_enc = DW_EH_PE_absptr;
+	if (*aug != 'z')
+		return 0;
+	if (read_uleb128(&p, end, &uval) < 0)
+		return -1;
+	for (aug++; *aug && p < end; aug++) {
+		switch (*aug) {
+		case 'R':
+			*fde_enc = *p++;
+			return 0;
+		case 'L':
+			p++;
+			break;
+		case 'P':
+			penc = *p++;
+			if (read_encoded(r, &p, penc & 0x7f, 0, &uval) < 0)
+				return -1;
+			break;
+		case 'S':
+		case 'B':
+			break;
+		default:
+			return 0;
+		}
+	}
+	return 0;
+}
+
+struct cie_cache {
+	const uint8_t *cie;
+	uint8_t fde_enc;
+};
+
+/*
+ * Parse the FDE at 'fde'. Returns 0 when func_data was filled in, 1 if
+ * the record is a CIE, 2 for the terminator and -1 on malformed input.
+ */
+static int parse_fde(const struct eh_region *r, const uint8_t *fde, struct cie_cache *cache,
+		     struct fde_func_data *func_data, const uint8_t **next)
+{
+	const uint8_t *idp, *p, *cie;
+	uint64_t id, pc_begin, pc_range;
+	int ret;
+
+	if ((ret = read_record_header(r, fde, &idp, &id, &p, next)) != 0)
+		return ret < 0 ? -1 : 2;
+	if (id == 0)
+		return 1;
+	if (id > (uint64_t)(idp - r->mem))
+		return -1;
+	cie = idp - id;
+	if (cie != cache->cie) {
+		if (parse_cie(r, cie, &cache->fde_enc) < 0)
+			return -1;
+		cache->cie = cie;
+	}
+	if (read_encoded(r, &p, cache->fde_enc, 0, &pc_begin) < 0)
+		return -1;
+	if (read_encoded(r, &p, cache->fde_enc & 0x0f, 0, &pc_range) < 0)
+		return -1;
+	func_data->addr = pc_begin;
+	func_data->size = pc_range;
+	return 0;
+}
+
+/*
+ * Use the binary search table of .eh_frame_hdr; it gives us the exact
+ * FDE count up front and lets us skip every CIE. r covers the
+ * .eh_frame_hdr through the end of the image (.eh_frame follows it).
+ */
+static int parse_eh_frame_hdr(const struct eh_region *r, uint64_t bias, struct fde_func_data **funcs)
+{
+	const uint8_t *p = r->mem, *end = r->mem + r->len, *fde, *next;
+	struct fde_func_data *fndata;
+	struct cie_cache cache = { 0 };
+	uint64_t eh_frame_ptr, fde_count, i;
+	uint8_t table_enc;
+	int32_t *table;
+
+	if (r->len < 4 || p[0] != 1)
+		return -1;
+	table_enc = p[3];
+	p += 4;
+	if (read_encoded(r, &p, r->mem[1], r->vaddr, &eh_frame_ptr) < 0)
+		return -1;
+	if (read_encoded(r, &p, r->mem[2], r->vaddr, &fde_count) < 0)
+		return -1;
+	/*
+	 * Every linker emits datarel|sdata4 for the table; anything
+	 * else gets handled by the linear .eh_frame pass.
+	 */
+	if (table_enc != (DW_EH_PE_datarel|DW_EH_PE_sdata4))
+		return -1;
+	if (fde_count == 0 || fde_count > (uint64_t)(end - p) / 8)
+		return -1;
+	fndata = malloc(sizeof(struct fde_func_data) * fde_count);
+	if (fndata == NULL) {
+		log_msg(__LINE__, "malloc %s", strerror(errno));
+		return -1;
+	}
+	table = (int32_t *)p;
+	for (i = 0; i < fde_count; i++) {
+		uint64_t fde_vaddr = r->vaddr + (int64_t)table[i * 2 + 1];
+
+		if (fde_vaddr < r->vaddr || fde_vaddr - r->vaddr >= r->len)
+			goto bad;
+		fde = r->mem + (fde_vaddr - r->vaddr);
+		if (parse_fde(r, fde, &cache, &fndata[i], &next) != 0)
+			goto bad;
+		fndata[i].addr += bias;
+	}
+	*funcs = fndata;
+	return (int)fde_count;
+bad:
+	free(fndata);
+	return -1;
+}
+
+/*
+ * One linear pass over .eh_frame; used when there is no .eh_frame_hdr
+ * (static binaries) or it can't be used. adjust is added to every
+ * function address (see global_hacks.eh_frame_offset_workaround).
+ */
+static int parse_eh_frame(const struct eh_region *r, uint64_t bias, int adjust, struct fde_func_data **funcs)
+{
+	const uint8_t *p, *idp, *body, *next;
+	struct fde_func_data *fndata;
+	struct cie_cache cache = { 0 };
+	uint64_t id;
+	int count, i, ret;
+
+	/*
+	 * Size the array by hopping over the record lengths first,
+	 * which counts CIEs too but is a cheap upper bound.
+	 */
+	for (count = 0, p = r->mem; read_record_header(r, p, &idp, &id, &body, &next) == 0; p = next)
+		count++;
+	if (count == 0)
+		return -1;
+	fndata = malloc(sizeof(struct fde_func_data) * count);
+	if (fndata == NULL) {
+		log_msg(__LINE__, "malloc %s", strerror(errno));
+		return -1;
+	}
+	for (i = 0, p = r->mem; i < count; p = next) {
+		ret = parse_fde(r, p, &cache, &fndata[i], &next);
+		if (ret == 1)
+			continue;
+		if (ret != 0)
+			break;
+		fndata[i++].addr += bias + adjust;
+	}
+	if (i == 0) {
+		free(fndata);
+		return -1;
+	}
+	*funcs = fndata;
+	return i;
+}
+
+static int eh_frame_functions(const uint8_t *mem, size_t len, uint64_t bias, int adjust,
+			      struct fde_func_data **funcs)
+{
+	ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)mem;
+	ElfW(Shdr) *shdr, *hdr = NULL, *ehf = NULL;
+	struct eh_region r;
+	char *StringTable;
+	int i, ret;
+
+	if (len < sizeof(ElfW(Ehdr)) || memcmp(mem, ELFMAG, SELFMAG) != 0)
+		return -1;
+	if (ehdr->e_shnum == 0 || ehdr->e_shstrndx >= ehdr->e_shnum ||
+	    ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(ElfW(Shdr)) > len)
+		return -1;
+	shdr = (ElfW(Shdr) *)&mem[ehdr->e_shoff];
+	if (shdr[ehdr->e_shstrndx].sh_offset >= len)
+		return -1;
+	StringTable = (char *)&mem[shdr[ehdr->e_shstrndx].sh_offset];
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (shdr[i].sh_offset >= len || shdr[i].sh_size == 0 || shdr[i].sh_type == SHT_NOBITS)
+			continue;
+		if (!strcmp(&StringTable[shdr[i].sh_name], ".eh_frame_hdr"))
+			hdr = &shdr[i];
+		else
+		if (!strcmp(&StringTable[shdr[i].sh_name], ".eh_frame"))
+			ehf = &shdr[i];
+	}
+	if (hdr != NULL) {
+		r.mem = &mem[hdr->sh_offset];
+		r.len = len - hdr->sh_offset;
+		r.vaddr = hdr->sh_addr;
+		if ((ret = parse_eh_frame_hdr(&r, bias, funcs)) >= 0)
+			return ret;
+	}
+	if (ehf == NULL)
+		return -1;
+	r.mem = &mem[ehf->sh_offset];
+	r.len = ehf->sh_offset + ehf->sh_size > len ? len - ehf->sh_offset : ehf->sh_size;
+	r.vaddr = ehf->sh_addr;
+	return parse_eh_frame(&r, bias, adjust, funcs);
+}
+
+/*
+ * Function discovery for the ecfs file itself; mem is the mapped
+ * output file. Falls back to libdwarf if its tables can't be parsed.
+ */
+int get_ecfs_functions(const char *filepath, const uint8_t *mem, size_t len, struct fde_func_data **funcs)
+{
+	int ret, workaround_offset = global_hacks.eh_frame_offset_workaround ? 4 : 0;
+
+	ret = eh_frame_functions(mem, len, 0, workaround_offset, funcs);
+	if (ret >= 0)
+		return ret;
+#if DEBUG
+	log_msg(__LINE__, "native eh_frame parsing failed, falling back to libdwarf");
+#endif
+	return get_all_functions(filepath, funcs);
+}
+
+/*
+ * Function discovery for a shared library; base is the address the
+ * library is mapped at, which is added when it is position independent.
+ */
+int get_shlib_functions(const char *path, unsigned long base, struct fde_func_data **funcs)
+{
+	ElfW(Ehdr) *ehdr;
+	ElfW(Phdr) *phdr;
+	struct stat st;
+	uint8_t *mem;
+	uint64_t bias = 0;
+	int fd, i, ret;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		log_msg(__LINE__, "open %s", strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(ElfW(Ehdr))) {
+		close(fd);
+		return -1;
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		log_msg(__LINE__, "mmap %s", strerror(errno));
+		return -1;
+	}
+	ehdr = (ElfW(Ehdr) *)mem;
+	if (ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(ElfW(Phdr)) <= st.st_size) {
+		phdr = (ElfW(Phdr) *)&mem[ehdr->e_phoff];
+		for (i = 0; i < ehdr->e_phnum; i++) {
+			if (phdr[i].p_type == PT_LOAD) {
+				if (phdr[i].p_vaddr == 0)
+					bias = base;
+				break;
+			}
+		}
+	}
+	ret = eh_frame_functions(mem, st.st_size, bias, 0, funcs);
+	munmap(mem, st.st_size);
+	return ret;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Open addressing (linear probing) hash table keyed by strings.
+ * Keys are not copied; the caller guarantees they outlive the table
+ * (i.e. names interned in a symvector, or a string table in a mapping).
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/hash.h"
+
+#define HASH_MIN_SIZE 64
+
+static uint64_t hash_key(const char *key)
+{
+	uint64_t h = hash_bytes(key, strlen(key));
+	return h ? h : 1; // 0 marks an empty slot
+}
+
+hash_table_t * hash_create(size_t hint)
+{
+	hash_table_t *table = (hash_table_t *)heapAlloc(sizeof(hash_table_t));
+
+	for (table->size = HASH_MIN_SIZE; table->size < hint * 2; table->size <<= 1)
+		;
+	table->entries = (hash_entry_t *)heapAlloc(table->size * sizeof(hash_entry_t));
+	table->count = 0;
+	return table;
+}
+
+void hash_destroy(hash_table_t *table)
+{
+	free(table->entries);
+	free(table);
+}
+
+static hash_entry_t * hash_slot(hash_table_t *table, const char *key, uint64_t h)
+{
+	size_t mask = table->size - 1;
+	size_t i = h & mask;
+
+	for (;; i = (i + 1) & mask) {
+		hash_entry_t *e = &table->entries[i];
+		if (e->hash == 0)
+			return e;
+		if (e->hash == h && !strcmp(e->key, key))
+			return e;
+	}
+}
+
+static void hash_grow(hash_table_t *table)
+{
+	hash_entry_t *old = table->entries;
+	size_t i, old_size = table->size;
+
+	table->size <<= 1;
+	table->entries = (hash_entry_t *)heapAlloc(table->size * sizeof(hash_entry_t));
+	for (i = 0; i < old_size; i++) {
+		if (old[i].hash == 0)
+			continue;
+		*hash_slot(table, old[i].key, old[i].hash) = old[i];
+	}
+	free(old);
+}
+
+int hash_insert(hash_table_t *table, const char *key, unsigned long value, int replace)
+{
+	uint64_t h = hash_key(key);
+	hash_entry_t *e;
+
+	if ((table->count + 1) * 10 > table->size * 7)
+		hash_grow(table);
+	e = hash_slot(table, key, h);
+	if (e->hash != 0) {
+		if (replace)
+			e->value = value;
+		return 0;
+	}
+	e->hash = h;
+	e->key = key;
+	e->value = value;
+	table->count++;
+	return 1;
+}
+
+int hash_lookup(hash_table_t *table, const char *key, unsigned long *value)
+{
+	hash_entry_t *e = hash_slot(table, key, hash_key(key));
+
+	if (e->hash == 0)
+		return 0;
+	if (value != NULL)
+		*value = e->value;
+	return 1;
+}
@@ -33,146 +33,136 @@
  */
 #include "../include/ecfs.h"
 #include "../include/util.h"
+#include "../include/symcache.h"
+#include "../include/libpath.h"
+#include "../include/hash.h"
+#include "../include/heuristics.h"
 
 #define OFFSET_2_PUSH 6 // # of bytes int PLT entry where push instruction begins
 #define MAX_NEEDED_LIBS 512
-#define MAX_STRINGS 1024
 
-int build_rodata_strings(char ***stra, uint8_t *rodata_ptr, size_t rodata_size)
+/*
+ * Finding ".so" in .rodata: the three bytes are compared at offsets
+ * 0, 1 and 2 of each block, so a hit is any lane where all of them
+ * match. Each returns the offset of the next ".so" at or after pos,
+ * or len if there isn't one.
+ */
+static size_t find_so_scalar(const uint8_t *p, size_t pos, size_t len)
 {
-	int i, j, index = 0;
-	*stra = (char **)heapAlloc(sizeof(char *) * MAX_STRINGS); 
-	char *string = alloca(8192 * 2);
-	char *p;
-	size_t cursize = MAX_STRINGS;
-	
-	for (p = (char *)rodata_ptr, j = 0, i = 0; i < rodata_size; i++) {
-		if (p[i] != '\0') {
-			string[j++] = p[i];
-			continue;
-		} else {
-			string[j] = '\0';
-			if (strstr(string, ".so")) {
-				*((*stra) + index++) = xstrdup(string);
-			}
-			j = 0;
-		}
-		if (index >= MAX_STRINGS) {
-#if DEBUG
-			log_msg(__LINE__, "build_rodata_strings() performing realloc on %p", *stra);
-#endif
-			cursize <<= 1;
-			*stra = (char **)realloc(*stra, sizeof(char *) * cursize);
-		}
+	const uint8_t *q;
+
+	while (pos + 3 <= len) {
+		if ((q = memchr(p + pos, '.', len - pos - 2)) == NULL)
+			return len;
+		pos = q - p;
+		if (p[pos + 1] == 's' && p[pos + 2] == 'o')
+			return pos;
+		pos++;
 	}
-	return index;
+	return len;
 }
 
+#ifdef __SSE2__
+#include <immintrin.h>
 
-/* 
- * Find the actual path to DT_NEEDED libraries
- * and take possible symlinks into consideration 
- * XXX this function will not work if the path is
- * a symlink to a file in a different directory.
- * fix this bug by seeing if readlink returns a
- * totally different file path as the resultant link
- * or if it returns just the base name (Which means
- * that the linked file is in the same dir as the
- * symlink.
- */
-static char * get_real_lib_path(char *name)
+static size_t find_so_sse2(const uint8_t *p, size_t pos, size_t len)
 {
-	char tmp[512] = {0};
-	char real[512] = {0};
-	char *ptr;
+	const __m128i dot = _mm_set1_epi8('.'), s = _mm_set1_epi8('s'), o = _mm_set1_epi8('o');
+	__m128i m;
+	int mask;
 
-	int ret;
-	
-	/*
-	 * Since this function is recursive and since there are
-	 * times when 'name' is passed as a path (As the result of
-	 * some readlink() calls, we must handle that specially since
-	 * we don't want to append a path to a path which will be
-	 * incorrect.
-	 */
-	if (strchr(name, '/') != NULL) {
-		ret = readlink(name, real, 512);
-		if (ret > 0) {
-			if (strchr(real, '/') != NULL)
-				return xstrdup(real);
-			else {
-				ptr = get_real_lib_path(real);
-				return xstrdup(ptr);
-			}
-		}
-		return xstrdup(name);
+	for (; pos + 18 <= len; pos += 16) {
+		m = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + pos)), dot),
+		    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + pos + 1)), s));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + pos + 2)), o));
+		if ((mask = _mm_movemask_epi8(m)) != 0)
+			return pos + __builtin_ctz(mask);
 	}
-	/*
-	 * Check most common paths
-	 */
+	return find_so_scalar(p, pos, len);
+}
 
-	snprintf(tmp, 512, "/usr/lib/x86_64-linux-gnu/%s", name);
-        if (access(tmp, F_OK) == 0) {
-                ret = readlink(tmp, real, 512);
-                if (ret > 0) {
-                        ptr = get_real_lib_path(real);
-                        return xstrdup(ptr);
-                }
-                else
-                        return xstrdup(tmp);
-        }
+#ifdef __x86_64__
+__attribute__((target("avx2")))
+static size_t find_so_avx2(const uint8_t *p, size_t pos, size_t len)
+{
+	const __m256i dot = _mm256_set1_epi8('.'), s = _mm256_set1_epi8('s'), o = _mm256_set1_epi8('o');
+	__m256i m;
+	unsigned int mask;
 
-	snprintf(tmp, 512, "/lib/x86_64-linux-gnu/%s", name);
-	if (access(tmp, F_OK) == 0) {
-		ret = readlink(tmp, real, 512);
-		if (ret > 0) {
-			ptr = get_real_lib_path(real);
-			return xstrdup(ptr);
-		}
-		else
-			return xstrdup(tmp);
+	for (; pos + 34 <= len; pos += 32) {
+		m = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + pos)), dot),
+		    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + pos + 1)), s));
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + pos + 2)), o));
+		if ((mask = _mm256_movemask_epi8(m)) != 0)
+			return pos + __builtin_ctz(mask);
 	}
+	return find_so_sse2(p, pos, len);
+}
+#endif
+#endif
 
-	snprintf(tmp, 512, "/usr/lib/%s", name);
-	if (access(tmp, F_OK) == 0) {
-		ret = readlink(tmp, real, 512);
-        	if (ret > 0) {
-			ptr = get_real_lib_path(real);
-                	return xstrdup(ptr);
-		}
-		else
-			return xstrdup(tmp);
-	}
+static size_t find_so(const uint8_t *p, size_t pos, size_t len)
+{
+#ifdef __SSE2__
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx2"))
+		return find_so_avx2(p, pos, len);
+#endif
+	return find_so_sse2(p, pos, len);
+#else
+	return find_so_scalar(p, pos, len);
+#endif
+}
 
-	snprintf(tmp, 512, "/lib/%s", name);
-	
-	if (access(tmp, F_OK) == 0) {
-		ret = readlink(tmp, real, 512);
-		if (ret > 0) {
-			ptr = get_real_lib_path(real);
-			return xstrdup(ptr);
+/*
+ * Locate every NUL terminated string in .rodata that contains ".so",
+ * in place. Only the bytes around a hit are looked at; everything
+ * else is skipped by find_so(). A string that runs off the end of
+ * the section isn't terminated and is ignored.
+ */
+int scan_rodata_strings(const uint8_t *rodata_ptr, size_t rodata_size, struct rodata_string **out)
+{
+	struct rodata_string *strs;
+	const uint8_t *end;
+	size_t pos, start, cap = 16;
+	int count = 0;
+
+	strs = (struct rodata_string *)heapAlloc(cap * sizeof(struct rodata_string));
+	for (pos = 0; (pos = find_so(rodata_ptr, pos, rodata_size)) < rodata_size;) {
+		for (start = pos; start > 0 && rodata_ptr[start - 1] != '\0'; start--)
+			;
+		end = memchr(rodata_ptr + pos, '\0', rodata_size - pos);
+		if (end == NULL)
+			break;
+		if (count == cap) {
+			cap <<= 1;
+			strs = (struct rodata_string *)realloc(strs, cap * sizeof(struct rodata_string));
 		}
-		else
-			return xstrdup(tmp);
+		strs[count].offset = start;
+		strs[count].len = end - rodata_ptr - start;
+		count++;
+		pos = end - rodata_ptr + 1;
 	}
-	
- 	snprintf(tmp, 512, "/usr/lib/x86_64-linux-gnu/gio/modules/%s", name);
-        if (access(tmp, F_OK) == 0) {
-                ret = readlink(tmp, real, 512);
-                if (ret > 0) {
-                        ptr = get_real_lib_path(real);
-                        return xstrdup(ptr);
-                }
-                else
-                        return xstrdup(tmp);
-        }
+	*out = strs;
+	return count;
+}
 
-	/*
-	 * If we get here then lets try directly from ld.so.cache
-	 */
-	return NULL;
+int build_rodata_strings(char ***stra, uint8_t *rodata_ptr, size_t rodata_size)
+{
+	struct rodata_string *strs;
+	int i, count;
+
+	count = scan_rodata_strings(rodata_ptr, rodata_size, &strs);
+	*stra = (char **)heapAlloc(sizeof(char *) * (count + 1));
+	for (i = 0; i < count; i++) {
+		(*stra)[i] = arena_alloc(strs[i].len + 1);
+		memcpy((*stra)[i], rodata_ptr + strs[i].offset, strs[i].len);
+	}
+	free(strs);
+	return count;
 }
 
+
 /* 
  * From DT_NEEDED (We pass the executable and each shared library to this function)
  */
@@ -185,7 +175,21 @@ static int get_dt_needed_libs(const char *bin_path, struct needed_libs *needed_l
 	int fd, i,  needed_count;
 	uint8_t *mem;
 	struct stat st;
-	char *dynstr = NULL;
+	char *dynstr = NULL, *runpath = NULL, *origin, *p;
+	symcache_t cache;
+
+	origin = arena_strdup(bin_path);
+	if ((p = strrchr(origin, '/')) != NULL)
+		*p = '\0';
+	if (opts.symcache && symcache_get(bin_path, &cache) == 0) {
+		runpath = libpath_get_runpath(bin_path, 0);
+		for (i = 0; i < cache.hdr->needed_count; i++) {
+			needed_libs[index + i].libname = arena_strdup(&cache.names[cache.needed[i]]);
+			needed_libs[index + i].libpath = libpath_resolve(needed_libs[index + i].libname, runpath, origin);
+			needed_libs[index + i].master = arena_strdup(bin_path);
+		}
+		return cache.hdr->needed_count;
+	}
 
 	fd = xopen(bin_path, O_RDONLY);
 	fstat(fd, &st);
@@ -218,56 +222,55 @@ static int get_dt_needed_libs(const char *bin_path, struct needed_libs *needed_l
 	if (dyn == NULL)
 		return 0;
 	
+	for (i = 0; dyn[i].d_tag != DT_NULL; i++) {
+		if (dyn[i].d_tag == DT_RUNPATH) {
+			runpath = &dynstr[dyn[i].d_un.d_val];
+			break;
+		}
+	}
 	for (needed_count = 0, i = 0; dyn[i].d_tag != DT_NULL; i++) {
 		switch(dyn[i].d_tag) {
 			case DT_NEEDED:
-				needed_libs[index + needed_count].libname = xstrdup(&dynstr[dyn[i].d_un.d_val]);
-				needed_libs[index + needed_count].libpath = get_real_lib_path(needed_libs[index + needed_count].libname);
-				needed_libs[index + needed_count].master = xstrdup(bin_path);
+				needed_libs[index + needed_count].libname = arena_strdup(&dynstr[dyn[i].d_un.d_val]);
+				needed_libs[index + needed_count].libpath = libpath_resolve(needed_libs[index + needed_count].libname, runpath, origin);
+				needed_libs[index + needed_count].master = arena_strdup(bin_path);
 				needed_count++;
 				break;
 			default:
 				break;
 		}
 	}
+	munmap(mem, st.st_size);
+	close(fd);
 	return needed_count;
 }
 
 /*
- * If you pass libc.so and libdl.so
- * the strings "libc" and "libdl" will be
- * compared.
- * if you pass libc.test.so and libdl.hello.so
- * the string "libc.test" and "libdl.hello" will
- * be compared.
+ * Returns the part of a library name before ".so", i.e
+ * "libc" for libc.so.6 and "libc.test" for libc.test.so. Unresolved
+ * DT_NEEDED entries are matched against mapped libraries by this.
  */
-static int cmp_till_dot(const char *lib1, const char *lib2)
+static char * soname_stem(const char *lib)
 {
-	char *p;
-	char *s1 = xstrdup(lib1);
-	char *s2 = xstrdup(lib2);
+	char *s = arena_strdup(lib);
 	int i;
 
-	for (i = 0, p = s1; p[i] != '\0'; i++) {
-		if (p[i] == '.' && p[i + 1] == 's' && p[i + 2] == 'o') {
-			p[i] = '\0';	
+	for (i = 0; s[i] != '\0'; i++) {
+		if (s[i] == '.' && s[i + 1] == 's' && s[i + 2] == 'o') {
+			s[i] = '\0';
 			break;
 		}
 	}
-        for (i = 0, p = s2; p[i] != '\0'; i++) {
-                if (p[i] == '.' && p[i + 1] == 's' && p[i + 2] == 'o') {
-                        p[i] = '\0';
-                        break;
-                }
-        }
-	
-	return strcmp(s1, s2);
+	return s;
 }
 
 static int qsort_cmp_by_str(const void *a, const void *b)
 { 
     struct needed_libs *ia = (struct needed_libs *)a;
     struct needed_libs *ib = (struct needed_libs *)b;
+    /* unresolved libs (NULL libpath) sort first */
+    if (ia->libpath == NULL || ib->libpath == NULL)
+	return (ia->libpath != NULL) - (ib->libpath != NULL);
     return strcmp(ia->libpath, ib->libpath);
 } 
 
@@ -284,6 +287,7 @@ int get_dt_needed_libs_all(memdesc_t *memdesc, struct needed_libs **needed_libs)
 	struct needed_libs *all_libs = heapAlloc(currsize);
 	struct needed_libs *initial_libs = heapAlloc(512 * sizeof(struct needed_libs));
 	
+	libpath_init(memdesc->pid, memdesc->exe_path);
 	int total_needed = get_dt_needed_libs(memdesc->exe_path, all_libs, 0);
 	if (total_needed == 0)
 		return 0;
@@ -295,7 +299,9 @@ int get_dt_needed_libs_all(memdesc_t *memdesc, struct needed_libs **needed_libs)
 	memcpy(initial_libs, all_libs, (total_needed * sizeof(struct needed_libs)));
 	
 	for (i = 0; i < init_count; i++) {
-		if (i >= 1) {
+		if (initial_libs[i].libpath == NULL)
+			continue;
+		if (i >= 1 && initial_libs[i - 1].libpath) {
 			if (!strcmp(initial_libs[i].libpath, initial_libs[i - 1].libpath))
 				continue;
 		}
@@ -310,7 +316,9 @@ int get_dt_needed_libs_all(memdesc_t *memdesc, struct needed_libs **needed_libs)
 	qsort(all_libs, total_needed, sizeof(struct needed_libs), qsort_cmp_by_str);
 #if DEBUG
 	for (i = 0; i < total_needed; i++) {
-		if (i >= 1)
+		if (all_libs[i].libpath == NULL)
+			continue;
+		if (i >= 1 && all_libs[i - 1].libpath)
 			if (!strcmp(all_libs[i].libpath, all_libs[i - 1].libpath))
 				continue;
 		log_msg(__LINE__, "[%s] needs dependency: %s", all_libs[i].master, all_libs[i].libpath);
@@ -320,23 +328,47 @@ int get_dt_needed_libs_all(memdesc_t *memdesc, struct needed_libs **needed_libs)
 	return total_needed;
 }
 /*
- * Get dlopen libs
+ * Append one dlopen() candidate found in .rodata to dl_libs, growing
+ * it as necessary. Symlinks are resolved so that the path compares
+ * equal to the one in /proc/pid/maps.
+ */
+static void add_dlopen_lib(struct dlopen_libs **dl_libs, int index, size_t *cap, const char *str)
+{
+	char tmp[PATH_MAX];
+	ssize_t ret;
+
+	if (index >= *cap) {
+		*cap <<= 1;
+		*dl_libs = (struct dlopen_libs *)realloc(*dl_libs, *cap * sizeof(struct dlopen_libs));
+	}
+	memset(&(*dl_libs)[index], 0, sizeof(struct dlopen_libs));
+	ret = readlink(str, tmp, sizeof(tmp) - 1);
+	if (ret >= 0)
+		tmp[ret] = '\0';
+	(*dl_libs)[index].libpath = arena_strdup(ret < 0 ? str : tmp);
+#if DEBUG
+	log_msg(__LINE__, "dlopen lib: %s", (*dl_libs)[index].libpath);
+#endif
+}
+
+/*
+ * Get dlopen libs. Returns the number of entries appended to
+ * *dl_libs at index (*cap is its allocated size in entries).
  */
-int get_dlopen_libs(const char *exe_path, struct dlopen_libs *dl_libs, int index)
+int get_dlopen_libs(const char *exe_path, struct dlopen_libs **dl_libs, int index, size_t *cap)
 {	
 	ElfW(Ehdr) *ehdr = NULL;
 	ElfW(Shdr) *shdr = NULL;
-	ElfW(Phdr) *phdr = NULL;
 	ElfW(Rela) *rela = NULL;
 	ElfW(Sym) *symtab = NULL;
-	//ElfW(Off) dataOffset;
-	//ElfW(Addr) dataVaddr, textVaddr;
+	struct rodata_string *strs;
 	uint8_t *mem = NULL;
 	uint8_t *text_ptr = NULL, *rodata_ptr = NULL;
-	size_t /*text_size, dataSize,*/ rodata_size = 0, i; //text_size refers to size of .text not the text segment
-	int ret, fd, scount = 0, /*relcount = 0,*/ symcount = 0, found_dlopen = 0;
-	char **strings, *dynstr, tmp[512];
+	size_t rodata_size = 0, i;
+	int fd, scount = 0, symcount = 0, found_dlopen = 0;
+	char *dynstr = NULL;
 	struct stat st;
+	symcache_t cache;
 	
 	/*
 	 * If there are is no dlopen() symbol then obviously
@@ -344,6 +376,13 @@ int get_dlopen_libs(const char *exe_path, struct dlopen_libs *dl_libs, int index
 	 * its possible __libc_dlopen_mode() was called by an
 	 * attacker
 	 */
+	if (opts.symcache && symcache_get(exe_path, &cache) == 0) {
+		if (!cache.hdr->calls_dlopen)
+			return 0;
+		for (i = 0; i < cache.hdr->rodata_count; i++)
+			add_dlopen_lib(dl_libs, index + i, cap, &cache.names[cache.rodata[i]]);
+		return cache.hdr->rodata_count;
+	}
 	
 	fd = xopen(exe_path, O_RDONLY);
 	xfstat(fd, &st);
@@ -352,34 +391,18 @@ int get_dlopen_libs(const char *exe_path, struct dlopen_libs *dl_libs, int index
 		perror("mmap");
 		exit(-1);
 	}
+	close(fd);
 	ehdr = (ElfW(Ehdr) *)mem;
 	shdr = (ElfW(Shdr) *)&mem[ehdr->e_shoff];
-	phdr = (ElfW(Phdr) *)&mem[ehdr->e_phoff];
-	
-	for (i = 0; i < ehdr->e_phnum; i++) {
-		if (phdr[i].p_type == PT_LOAD) {	
-			if (phdr[i].p_offset == 0 && phdr[i].p_flags & PF_X) {
-				//textVaddr = phdr[i].p_vaddr;
-			} else
-			if (phdr[i].p_offset != 0 && phdr[i].p_flags & PF_W) {
-				//dataOffset = phdr[i].p_offset;
-				//dataVaddr = phdr[i].p_vaddr;
-				//dataSize = phdr[i].p_memsz;
-				break;
-			}
-		}
-	}
 	char *shstrtab = (char *)&mem[shdr[ehdr->e_shstrndx].sh_offset];
 	
 	for (i = 0; i < ehdr->e_shnum; i++) {
 		if (!strcmp(&shstrtab[shdr[i].sh_name], ".text")) {
 			text_ptr = (uint8_t *)&mem[shdr[i].sh_offset];
-			//text_size = shdr[i].sh_size;	
 		} else
 		if (!strcmp(&shstrtab[shdr[i].sh_name], ".rela.plt")) {
 			rela = (ElfW(Rela) *)&mem[shdr[i].sh_offset];
 			symtab = (ElfW(Sym) *)&mem[shdr[shdr[i].sh_link].sh_offset];
-			//relcount = shdr[i].sh_size / sizeof(ElfW(Rela));
 		} else
 		if (!strcmp(&shstrtab[shdr[i].sh_name], ".rodata")) {
 			rodata_ptr = (uint8_t *)&mem[shdr[i].sh_offset];
@@ -391,11 +414,11 @@ int get_dlopen_libs(const char *exe_path, struct dlopen_libs *dl_libs, int index
 		if (!strcmp(&shstrtab[shdr[i].sh_name], ".dynsym"))
 			symcount = shdr[i].sh_size / sizeof(ElfW(Sym));
 	}
-	if (text_ptr == NULL || rela == NULL || symtab == NULL) {
+	if (text_ptr == NULL || rela == NULL || symtab == NULL || dynstr == NULL) {
 #if DEBUG
 		log_msg(__LINE__, "get_dlopen_libs() failing for path: %s", exe_path);
 #endif
-		return -1;
+		goto done;
 	}
 	
 	for (found_dlopen = 0, i = 0; i < symcount; i++) {
@@ -408,7 +431,7 @@ int get_dlopen_libs(const char *exe_path, struct dlopen_libs *dl_libs, int index
 #if DEBUG
 		log_msg(__LINE__, "no calls to dlopen found in %s", exe_path);
 #endif
-		return 0;			
+		goto done;
 	}
 	/*
 	 * For now (until we have integrated a disassembler in)
@@ -418,19 +441,14 @@ int get_dlopen_libs(const char *exe_path, struct dlopen_libs *dl_libs, int index
 	 * that dlopen is used at all in the program, is decent
 	 * enough hueristic.
 	 */
-	scount = build_rodata_strings(&strings, rodata_ptr, rodata_size);
-	if (scount == 0)
-		return 0;
-	for (i = 0; i < scount; i++) {
-		ret = readlink(strings[i], tmp, 512);
-		dl_libs[index + i].libpath = ret < 0 ? xstrdup(strings[i]) : xstrdup(tmp);
-		free(strings[i]);
-	}
-	
-#if DEBUG
+	if (rodata_ptr == NULL)
+		goto done;
+	scount = scan_rodata_strings(rodata_ptr, rodata_size, &strs);
 	for (i = 0; i < scount; i++)
-		printf("dlopen lib: %s\n", dl_libs[index + i].libpath);
-#endif
+		add_dlopen_lib(dl_libs, index + i, cap, (char *)&rodata_ptr[strs[i].offset]);
+	free(strs);
+done:
+	munmap(mem, st.st_size);
 	return scount;
 }
 
@@ -440,19 +458,17 @@ int get_dlopen_libs(const char *exe_path, struct dlopen_libs *dl_libs, int index
 int get_dlopen_libs_all(memdesc_t *memdesc, struct needed_libs *needed_libs, int needed_count, struct dlopen_libs **dlopen_libs)
 {
 	int dlopen_count, i;
-	size_t currsize = sizeof(struct dlopen_libs) * 8192;
-	struct dlopen_libs *all_libs = heapAlloc(sizeof(struct dlopen_libs) * 8192);
+	size_t cap = 64;
+	struct dlopen_libs *all_libs = heapAlloc(sizeof(struct dlopen_libs) * cap);
 	
-	dlopen_count = get_dlopen_libs(memdesc->exe_path, all_libs, 0);
+	dlopen_count = get_dlopen_libs(memdesc->exe_path, &all_libs, 0, &cap);
 	for (i = 0; i < needed_count; i++) {
-		if (i >= 1) 
+		if (needed_libs[i].libpath == NULL)
+			continue;
+		if (i >= 1 && needed_libs[i - 1].libpath)
 			if (!strcmp(needed_libs[i].libpath, needed_libs[i - 1].libpath))
 				continue;
-		if ((dlopen_count * sizeof(struct dlopen_libs)) >= currsize) {
-			currsize <<= 1;
-			all_libs = (struct dlopen_libs *)realloc(all_libs, currsize);
-		}		
-		dlopen_count += get_dlopen_libs(needed_libs[i].libpath, all_libs, dlopen_count);
+		dlopen_count += get_dlopen_libs(needed_libs[i].libpath, &all_libs, dlopen_count, &cap);
 	}
 	*dlopen_libs = all_libs;
 	return dlopen_count;
@@ -463,10 +479,11 @@ void mark_dll_injection(notedesc_t *notedesc, memdesc_t *memdesc, elfdesc_t *elf
 	struct lib_mappings *lm_files = notedesc->lm_files;
 	struct needed_libs *needed_libs;
 	struct dlopen_libs *dlopen_libs;
+	hash_table_t *needed_paths, *needed_stems, *dlopen_paths;
+	unsigned long unused;
 	int needed_count;
 	int dlopen_count;
-	int valid;
-	int i, j, c;
+	int i;
 	
 	/*
  	 * Get all dependencies from executable and its shared libraries
@@ -477,52 +494,41 @@ void mark_dll_injection(notedesc_t *notedesc, memdesc_t *memdesc, elfdesc_t *elf
 	dlopen_count = get_dlopen_libs_all(memdesc, needed_libs, needed_count, &dlopen_libs);
 #if DEBUG
 	for (i = 0; i < dlopen_count; i++)
-		log_msg(__LINE__, "dlopen lib from .rodata: %s", dlopen_libs[i]);
+		log_msg(__LINE__, "dlopen lib from .rodata: %s", dlopen_libs[i].libpath);
 #endif
+	/*
+	 * Build the sets of legitimately loaded libraries once so that
+	 * each mapped library is classified with a few hash probes:
+	 * canonical paths of resolved DT_NEEDED entries, name stems of
+	 * the ones that couldn't be resolved, and dlopen() candidates.
+	 */
+	needed_paths = hash_create(needed_count);
+	needed_stems = hash_create(16);
+	dlopen_paths = hash_create(dlopen_count);
+	for (i = 0; i < needed_count; i++) {
+		if (needed_libs[i].libpath != NULL)
+			hash_insert(needed_paths, needed_libs[i].libpath, 1, 0);
+		else
+			hash_insert(needed_stems, soname_stem(needed_libs[i].libname), 1, 0);
+	}
+	for (i = 0; i < dlopen_count; i++)
+		if (dlopen_libs[i].libpath != NULL)
+			hash_insert(dlopen_paths, dlopen_libs[i].libpath, 1, 0);
+
 	for (i = 0; i < lm_files->libcount; i++) {
-		for (j = 0; j < needed_count; j++) {
-			if (lm_files->libs[i].path[0] == '\0') { // empty string, no paths.
-				break;
-                        }
-			if (needed_libs[j].libpath == NULL) {
-				/* Compare by name since full path couldn't be found */
-				if (!cmp_till_dot(needed_libs[j].libname, lm_files->libs[i].name)) {
-					valid++;
-					break;	
-				}
-			}	
-			if (j >= 1) // avoid duplicates
-				if (!strcmp(needed_libs[j].libpath, needed_libs[j - 1].libpath))
-					continue;
-#if DEBUG
-			log_msg(__LINE__, "mark_dll_injection(): Comparing %s and %s", lm_files->libs[i].path, needed_libs[j].libpath);
-#endif
-			if (!strcmp(lm_files->libs[i].path, needed_libs[j].libpath) || !strncmp(lm_files->libs[i].name, "ld-", 3)) {
-				valid++;
-				break;
-			} else { 
-				for (c = 0; c < dlopen_count; c++) {
-					if (!strcmp(lm_files->libs[i].path, dlopen_libs[c].libpath)) {
-						valid++;
-						break;
-					}
-				}
-			}
-		}
-		if (valid == 0) {
-			lm_files->libs[i].injected++;
+		if (lm_files->libs[i].path[0] == '\0') // empty string, no paths.
+			continue;
+		if (!strncmp(lm_files->libs[i].name, "ld-", 3) ||
+		    hash_lookup(needed_paths, lm_files->libs[i].path, &unused) ||
+		    hash_lookup(dlopen_paths, lm_files->libs[i].path, &unused) ||
+		    hash_lookup(needed_stems, soname_stem(lm_files->libs[i].name), &unused))
+			continue;
+		lm_files->libs[i].injected++;
 #if DEBUG
-			log_msg(__LINE__, "mark_dll_injection(): injected library found: %s", lm_files->libs[i].name);
+		log_msg(__LINE__, "mark_dll_injection(): injected library found: %s", lm_files->libs[i].name);
 #endif
-		}
-		else
-			valid = 0;
-				
 	}
-				
-
+	hash_destroy(needed_paths);
+	hash_destroy(needed_stems);
+	hash_destroy(dlopen_paths);
 }
-
-
-
-	
@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/hash.h"
+#include "../include/libpath.h"
+#include "../include/proc.h"
+
+/*
+ * Shared library path resolution for the injection heuristics. This
+ * follows the dynamic linker's search order closely enough for our
+ * purposes: DT_RPATH (when there is no DT_RUNPATH), LD_LIBRARY_PATH
+ * (unless AT_SECURE), DT_RUNPATH, /etc/ld.so.cache and then the
+ * default directories. /etc/ld.so.cache is parsed once and every
+ * result is memoized, so resolving the DT_NEEDED entries of every
+ * loaded library costs a hash lookup after the first time a name
+ * is seen.
+ */
+#define LD_SO_CACHE "/etc/ld.so.cache"
+#define LD_CACHE_MAGIC_OLD "ld.so-1.7.0"
+#define LD_CACHE_MAGIC_NEW "glibc-ld.so.cache1.1"
+
+struct ld_cache_new_hdr {
+	char magic[20];
+	uint32_t nlibs;
+	uint32_t len_strings;
+	uint8_t flags;
+	uint8_t padding[3];
+	uint32_t extension_offset;
+	uint32_t unused[3];
+};
+
+struct ld_cache_new_entry {
+	int32_t flags;
+	uint32_t key;
+	uint32_t value;
+	uint32_t osversion;
+	uint64_t hwcap;
+};
+
+struct ld_cache_old_entry {
+	int32_t flags;
+	uint32_t key;
+	uint32_t value;
+};
+
+#define LD_CACHE_FLAG_ARCH_MASK 0xff00
+#if __x86_64__
+#define LD_CACHE_FLAG_ARCH 0x0300	/* FLAG_X8664_LIB64 */
+#else
+#define LD_CACHE_FLAG_ARCH 0x0000
+#endif
+
+static const char *default_dirs[] = {
+#if __x86_64__
+	"/lib/x86_64-linux-gnu",
+	"/usr/lib/x86_64-linux-gnu",
+	"/lib64",
+	"/usr/lib64",
+#else
+	"/lib/i386-linux-gnu",
+	"/usr/lib/i386-linux-gnu",
+#endif
+	"/lib",
+	"/usr/lib",
+	NULL
+};
+
+static struct {
+	int initialized;
+	hash_table_t *cache;	// soname -> path from ld.so.cache
+	hash_table_t *memo;	// [runpath:]name -> resolved path (0 if not found)
+	char *ld_library_path;
+	char *exe_rpath;	// DT_RPATH of the executable
+	char *exe_origin;	// directory of the executable, for $ORIGIN
+	uint8_t *cache_mem;
+	size_t cache_size;
+} resolver;
+
+static void load_ld_so_cache(void)
+{
+	struct ld_cache_new_hdr *hdr;
+	struct ld_cache_new_entry *ent;
+	struct stat st;
+	uint8_t *mem;
+	size_t off = 0;
+	uint32_t i, nold;
+	int fd;
+
+	resolver.cache = hash_create(2048);
+	if ((fd = open(LD_SO_CACHE, O_RDONLY)) < 0)
+		return;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct ld_cache_new_hdr)) {
+		close(fd);
+		return;
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return;
+	resolver.cache_mem = mem;
+	resolver.cache_size = st.st_size;
+
+	/*
+	 * The old format may prefix the new one, in which case the new
+	 * cache starts after the old entries, aligned to 8 bytes.
+	 */
+	if (!memcmp(mem, LD_CACHE_MAGIC_OLD, sizeof(LD_CACHE_MAGIC_OLD) - 1)) {
+		nold = *(uint32_t *)&mem[12];
+		off = (16 + (size_t)nold * sizeof(struct ld_cache_old_entry) + 7) & ~(size_t)7;
+	}
+	if (off + sizeof(*hdr) > st.st_size ||
+	    memcmp(&mem[off], LD_CACHE_MAGIC_NEW, sizeof(LD_CACHE_MAGIC_NEW) - 1))
+		return;
+	hdr = (struct ld_cache_new_hdr *)&mem[off];
+	if (off + sizeof(*hdr) + (size_t)hdr->nlibs * sizeof(*ent) > st.st_size)
+		return;
+	ent = (struct ld_cache_new_entry *)(hdr + 1);
+	/*
+	 * String offsets are relative to the start of the new header.
+	 * Like ld.so, the first matching entry for a name wins.
+	 */
+	for (i = 0; i < hdr->nlibs; i++) {
+		if ((ent[i].flags & LD_CACHE_FLAG_ARCH_MASK) != LD_CACHE_FLAG_ARCH)
+			continue;
+		if (off + ent[i].key >= st.st_size || off + ent[i].value >= st.st_size)
+			continue;
+		hash_insert(resolver.cache, (char *)&mem[off + ent[i].key], off + ent[i].value, 0);
+	}
+}
+
+/*
+ * Pull LD_LIBRARY_PATH out of /proc/<pid>/environ, unless the process
+ * runs with AT_SECURE in which case the linker ignored it too.
+ */
+static void load_process_env(pid_t pid)
+{
+	char path[PATH_MAX], buf[65536], *p;
+	ElfW(auxv_t) auxv[512];
+	ssize_t len;
+	int fd, i;
+
+	proc_path(path, sizeof(path), pid, "auxv");
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		len = read(fd, auxv, sizeof(auxv));
+		close(fd);
+		for (i = 0; len > 0 && i < len / sizeof(auxv[0]) && auxv[i].a_type != AT_NULL; i++)
+			if (auxv[i].a_type == AT_SECURE && auxv[i].a_un.a_val)
+				return;
+	}
+	proc_path(path, sizeof(path), pid, "environ");
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (!strncmp(p, "LD_LIBRARY_PATH=", 16)) {
+			resolver.ld_library_path = arena_strdup(p + 16);
+			break;
+		}
+	}
+}
+
+/*
+ * Returns the DT_RUNPATH (or DT_RPATH if want_rpath) of an ELF file
+ */
+char * libpath_get_runpath(const char *path, int want_rpath)
+{
+	ElfW(Ehdr) *ehdr;
+	ElfW(Phdr) *phdr;
+	ElfW(Dyn) *dyn = NULL;
+	ElfW(Shdr) *shdr;
+	uint8_t *mem;
+	struct stat st;
+	char *dynstr = NULL, *shstrtab, *ret = NULL;
+	long tag = want_rpath ? DT_RPATH : DT_RUNPATH;
+	int fd, i;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(ElfW(Ehdr))) {
+		close(fd);
+		return NULL;
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return NULL;
+	ehdr = (ElfW(Ehdr) *)mem;
+	if (ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(ElfW(Shdr)) > st.st_size ||
+	    ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(ElfW(Phdr)) > st.st_size ||
+	    ehdr->e_shstrndx >= ehdr->e_shnum)
+		goto done;
+	shdr = (ElfW(Shdr) *)&mem[ehdr->e_shoff];
+	phdr = (ElfW(Phdr) *)&mem[ehdr->e_phoff];
+	shstrtab = (char *)&mem[shdr[ehdr->e_shstrndx].sh_offset];
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (!strcmp(&shstrtab[shdr[i].sh_name], ".dynstr")) {
+			dynstr = (char *)&mem[shdr[i].sh_offset];
+			break;
+		}
+	}
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type == PT_DYNAMIC) {
+			dyn = (ElfW(Dyn) *)&mem[phdr[i].p_offset];
+			break;
+		}
+	}
+	if (dynstr == NULL || dyn == NULL)
+		goto done;
+	for (i = 0; dyn[i].d_tag != DT_NULL; i++) {
+		/*
+		 * DT_RPATH is ignored by the linker when DT_RUNPATH is present
+		 */
+		if (want_rpath && dyn[i].d_tag == DT_RUNPATH) {
+			ret = NULL;
+			break;
+		}
+		if (dyn[i].d_tag == tag && ret == NULL)
+			ret = arena_strdup(&dynstr[dyn[i].d_un.d_val]);
+	}
+done:
+	munmap(mem, st.st_size);
+	return ret;
+}
+
+static void resolver_setup(void)
+{
+	if (resolver.memo != NULL)
+		return;
+	resolver.memo = hash_create(1024);
+	load_ld_so_cache();
+}
+
+void libpath_prewarm(void)
+{
+	resolver_setup();
+}
+
+int libpath_init(pid_t pid, const char *exe_path)
+{
+	char *p;
+
+	if (resolver.initialized)
+		return 0;
+	resolver_setup();
+	load_process_env(pid);
+	resolver.exe_origin = arena_strdup(exe_path);
+	if ((p = strrchr(resolver.exe_origin, '/')) != NULL)
+		*p = '\0';
+	resolver.exe_rpath = libpath_get_runpath(exe_path, 1);
+	resolver.initialized = 1;
+	return 0;
+}
+
+/*
+ * Try name in each directory of a ':' separated list; $ORIGIN is
+ * replaced with origin.
+ */
+static char * search_dirs(const char *list, const char *name, const char *origin, char *out)
+{
+	char dir[PATH_MAX], tmp[PATH_MAX];
+	const char *p, *end, *prefix, *rest;
+	size_t len;
+
+	for (p = list; p && *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ':');
+		if (end == NULL)
+			end = p + strlen(p);
+		len = end - p;
+		if (len == 0 || len >= sizeof(dir))
+			continue;
+		memcpy(dir, p, len);
+		dir[len] = '\0';
+		prefix = "";
+		rest = dir;
+		if (origin && !strncmp(dir, "$ORIGIN", 7)) {
+			prefix = origin;
+			rest = &dir[7];
+		} else
+		if (origin && !strncmp(dir, "${ORIGIN}", 9)) {
+			prefix = origin;
+			rest = &dir[9];
+		}
+		if (snprintf(tmp, sizeof(tmp), "%s%s/%s", prefix, rest, name) >= (int)sizeof(tmp))
+			continue;
+		if (realpath(tmp, out) != NULL)
+			return out;
+	}
+	return NULL;
+}
+
+static char * resolve_uncached(const char *name, const char *runpath, const char *origin, char *out)
+{
+	unsigned long value;
+	int i;
+
+	if (strchr(name, '/') != NULL)
+		return realpath(name, out);
+	if (resolver.exe_rpath && search_dirs(resolver.exe_rpath, name, resolver.exe_origin, out))
+		return out;
+	if (resolver.ld_library_path && search_dirs(resolver.ld_library_path, name, NULL, out))
+		return out;
+	if (runpath && search_dirs(runpath, name, origin, out))
+		return out;
+	if (hash_lookup(resolver.cache, name, &value) && realpath((char *)&resolver.cache_mem[value], out))
+		return out;
+	for (i = 0; default_dirs[i] != NULL; i++)
+		if (search_dirs(default_dirs[i], name, NULL, out))
+			return out;
+	return NULL;
+}
+
+/*
+ * Resolve a DT_NEEDED name (or a path) to the canonical path of the
+ * file the linker would have mapped. runpath is the DT_RUNPATH of the
+ * object that needs it, and origin that object's directory. Returns
+ * NULL if it can't be found; results are memoized either way.
+ */
+char * libpath_resolve(const char *name, const char *runpath, const char *origin)
+{
+	char out[PATH_MAX], *key, *ret;
+	unsigned long value;
+
+	resolver_setup();
+	key = runpath ? arena_fmtstrdup("%s:%s:%s", runpath, origin ? origin : "", name) : (char *)name;
+	if (hash_lookup(resolver.memo, key, &value))
+		return (char *)value;
+	ret = resolve_uncached(name, runpath, origin, out);
+	if (ret != NULL)
+		ret = arena_strdup(out);
+	if (key == name)
+		key = arena_strdup(name);
+	hash_insert(resolver.memo, key, (unsigned long)ret, 1);
+	return ret;
+}
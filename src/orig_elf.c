@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/hash.h"
+#include "../include/orig_elf.h"
+#include "../include/proc.h"
+#include <limits.h>
+
+/*
+ * The original executable (/proc/<pid>/exe) is consulted by several
+ * passes early on (pie check, stripped check, entry point and the
+ * global_hacks section sizes/addrs). It is mapped and its section
+ * names indexed once here, and every one of those passes shares it.
+ */
+static orig_elf_t *orig_elf;
+
+orig_elf_t * orig_elf_open(int pid)
+{
+	orig_elf_t *oe;
+	struct stat st;
+	ElfW(Shdr) *shdr;
+	char path[PATH_MAX];
+	int fd, i;
+
+	if (orig_elf != NULL && orig_elf->pid == pid)
+		return orig_elf;
+	orig_elf_close();
+
+	proc_path(path, sizeof(path), pid, "exe");
+	fd = xopen(path, O_RDONLY);
+	xfstat(fd, &st);
+	oe = (orig_elf_t *)heapAlloc(sizeof(orig_elf_t));
+	oe->pid = pid;
+	oe->size = st.st_size;
+	oe->mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (oe->mem == MAP_FAILED) {
+		log_msg(__LINE__, "mmap %s", strerror(errno));
+		exit(-1);
+	}
+	oe->ehdr = (ElfW(Ehdr) *)oe->mem;
+	oe->phdr = (ElfW(Phdr) *)&oe->mem[oe->ehdr->e_phoff];
+	oe->stripped = oe->ehdr->e_shnum == 0 || oe->ehdr->e_shoff == SHN_UNDEF;
+	if (oe->stripped || oe->ehdr->e_shstrndx == 0 ||
+	    oe->ehdr->e_shoff + (uint64_t)oe->ehdr->e_shnum * sizeof(ElfW(Shdr)) > oe->size) {
+		orig_elf = oe;
+		return oe;
+	}
+	shdr = (ElfW(Shdr) *)&oe->mem[oe->ehdr->e_shoff];
+	oe->shdr = shdr;
+	oe->shstrtab = (char *)&oe->mem[shdr[oe->ehdr->e_shstrndx].sh_offset];
+	oe->sections = hash_create(oe->ehdr->e_shnum);
+	/*
+	 * Keep the first section of a given name, like a linear scan would
+	 */
+	for (i = 0; i < oe->ehdr->e_shnum; i++)
+		hash_insert(oe->sections, &oe->shstrtab[shdr[i].sh_name], i, 0);
+	orig_elf = oe;
+	return oe;
+}
+
+/*
+ * Returns NULL if there is no section header table or no such section.
+ */
+ElfW(Shdr) * orig_elf_section(orig_elf_t *oe, const char *name)
+{
+	unsigned long index;
+
+	if (oe->sections == NULL || !hash_lookup(oe->sections, name, &index))
+		return NULL;
+	return &oe->shdr[index];
+}
+
+void orig_elf_close(void)
+{
+	if (orig_elf == NULL)
+		return;
+	if (orig_elf->sections)
+		hash_destroy(orig_elf->sections);
+	munmap(orig_elf->mem, orig_elf->size);
+	free(orig_elf);
+	orig_elf = NULL;
+}
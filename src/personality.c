@@ -25,26 +25,15 @@
 
 #include "../include/ecfs.h"
 #include "../include/util.h"
+#include "../include/orig_elf.h"
 
 int check_for_pie(int pid)
 {
+	orig_elf_t *oe = orig_elf_open(pid);
+	ElfW(Phdr) *phdr = oe->phdr;
 	int i;
-	uint8_t *mem;
-	struct stat st;
-	
-	char *path = xfmtstrdup("/proc/%d/exe", pid);
-	int fd = xopen(path, O_RDONLY);
-	fstat(fd, &st);
-	
-	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (mem == MAP_FAILED) {
-		log_msg(__LINE__, "mmap %s", strerror(errno));
-		exit(-1);
-	}
-	free(path);
-	ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)mem;
-	ElfW(Phdr) *phdr = (ElfW(Phdr) *)&mem[ehdr->e_phoff];
-	for (i = 0; i < ehdr->e_phnum; i++) {
+
+	for (i = 0; i < oe->ehdr->e_phnum; i++) {
 		if (phdr[i].p_type == PT_LOAD) {
 			if (phdr[i].p_flags & PF_X) {
 				if (phdr[i].p_vaddr == 0)
@@ -57,26 +46,5 @@ int check_for_pie(int pid)
 	
 int check_for_stripped_shdr(int pid)
 {
-        uint8_t *mem;
-        struct stat st;
-
-        char *path = xfmtstrdup("/proc/%d/exe", pid);
-        int fd = xopen(path, O_RDONLY);
-        fstat(fd, &st);
-
-        mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (mem == MAP_FAILED) {
-                log_msg(__LINE__, "mmap %s", strerror(errno));
-                exit(-1);
-        }
-        free(path);
-        ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)mem;
-	
-	if (ehdr->e_shnum == 0 || ehdr->e_shoff == SHN_UNDEF) {
-		munmap(mem, st.st_size);
-		return 1;
-	}
-	munmap(mem, st.st_size);
-	return 0;
+	return orig_elf_open(pid)->stripped;
 }
-
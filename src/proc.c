@@ -25,6 +25,22 @@
 
 #include "../include/ecfs.h"
 #include "../include/util.h"
+#include "../include/proc.h"
+#include <sched.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/unix_diag.h>
+
+/*
+ * The live /proc, or with ecfs -r the snapshot recorded by ecfs -R
+ * (which is laid out the same way; see replay.h).
+ */
+int proc_path(char *buf, size_t len, pid_t pid, const char *name)
+{
+	return snprintf(buf, len, "%s/%d/%s", opts.replay_dir ? opts.replay_dir : "/proc", pid, name);
+}
 
 static ElfW(Addr) get_mapping_flags(ElfW(Addr) addr, memdesc_t *memdesc)
 {
@@ -81,258 +97,518 @@ void lookup_lib_maps(elfdesc_t *elfdesc, memdesc_t *memdesc, struct nt_file_stru
 		
 }
 
-int get_maps(pid_t pid, mappings_t *maps, const char *path)
+/*
+ * Read all of /proc/<pid>/maps into one buffer. The file reports
+ * a size of 0, so we just keep doubling until read() comes up short.
+ */
+static char * read_proc_file(const char *path, size_t *len)
+{
+	size_t cap = 64 * 1024, off = 0;
+	ssize_t ret;
+	char *buf;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	buf = heapAlloc(cap + 1);
+	for (;;) {
+		ret = read(fd, buf + off, cap - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			close(fd);
+			return NULL;
+		}
+		if (ret == 0)
+			break;
+		off += ret;
+		if (off == cap) {
+			cap <<= 1;
+			if ((buf = realloc(buf, cap + 1)) == NULL) {
+				log_msg(__LINE__, "realloc %s", strerror(errno));
+				exit(-1);
+			}
+		}
+	}
+	close(fd);
+	buf[off] = '\0';
+	*len = off;
+	return buf;
+}
+
+static unsigned long parse_hex(char **pp)
+{
+	unsigned long val = 0;
+	char *p = *pp;
+
+	for (;; p++) {
+		if (*p >= '0' && *p <= '9')
+			val = (val << 4) | (*p - '0');
+		else
+		if (*p >= 'a' && *p <= 'f')
+			val = (val << 4) | (*p - 'a' + 10);
+		else
+			break;
+	}
+	*pp = p;
+	return val;
+}
+
+/*
+ * Parses /proc/<pid>/maps in a single pass, growing the maps array as
+ * needed. Each line looks like:
+ * 00400000-00452000 r-xp 00000000 08:02 173521      /usr/bin/dbus-daemon
+ * Returns the number of mappings, or -1.
+ */
+int get_maps(pid_t pid, mappings_t **mapsp, const char *path)
 {
-        char mpath[256], buf[256], tmp[256], *p, *chp, *q = alloca(32);
-        FILE *fd;
-        int lc, i;
-        
-        snprintf(mpath, sizeof(mpath), "/proc/%d/maps", pid);
-        if ((fd = fopen(mpath, "r")) == NULL) 
-                return -1;
-
-        for (lc = 0; (fgets(buf, sizeof(buf), fd) != NULL); lc++) {
-                strcpy(tmp, buf); //tmp and buf are same sized buffers
-                p = strchr(buf, '-');
-                *p = '\0';
-                p++;
-                maps[lc].elfmap = 0;
-                maps[lc].base = strtoul(buf, NULL, 16);
-                maps[lc].size = strtoul(p, NULL, 16) - maps[lc].base;
-		chp = strrchr(tmp, '/'); 
-		if (chp) 
-			*(char *)strchr(chp, '\n') = '\0';
-		if (chp && !strcmp(&chp[1], path)) {
-                        if (!strstr(tmp, "---p")) {
-                                maps[lc].filename = xstrdup(strchr(tmp, '/'));
-                                maps[lc].elfmap++;
-				if (strstr(tmp, "r-xp") || strstr(tmp, "rwxp")) //sometimes text is polymorphic
+	char mpath[256], *buf, *p, *eol, *perms, *file, *comm;
+	mappings_t *maps;
+	size_t len, cap = 256;
+	int lc, field;
+
+	proc_path(mpath, sizeof(mpath), pid, "maps");
+	if ((buf = read_proc_file(mpath, &len)) == NULL)
+		return -1;
+	maps = (mappings_t *)heapAlloc(sizeof(mappings_t) * cap);
+
+	for (lc = 0, p = buf; p < buf + len; p = eol + 1, lc++) {
+		if ((eol = strchr(p, '\n')) == NULL)
+			eol = buf + len;
+		*eol = '\0';
+		if (lc == cap) {
+			maps = realloc(maps, sizeof(mappings_t) * cap * 2);
+			if (maps == NULL) {
+				log_msg(__LINE__, "realloc %s", strerror(errno));
+				exit(-1);
+			}
+			memset(&maps[cap], 0, sizeof(mappings_t) * cap);
+			cap <<= 1;
+		}
+		maps[lc].base = parse_hex(&p);
+		if (*p++ != '-')
+			break;
+		maps[lc].size = parse_hex(&p) - maps[lc].base;
+		if (*p++ != ' ' || eol - p < 4)
+			break;
+		perms = p;
+		/*
+		 * skip the perms, offset, dev and inode fields
+		 */
+		for (field = 0; field < 4 && p < eol; field++) {
+			while (p < eol && *p != ' ')
+				p++;
+			while (p < eol && *p == ' ')
+				p++;
+		}
+		file = p;
+		comm = strrchr(file, '/');
+
+		if (comm && !strcmp(comm + 1, path)) {
+			if (memcmp(perms, "---p", 4)) {
+				maps[lc].filename = arena_strdup(file);
+				maps[lc].elfmap++;
+				if (perms[0] == 'r' && perms[2] == 'x' && perms[3] == 'p') //sometimes text is polymorphic
 					maps[lc].textbase++;
 			}
-                }
-                else
-                if (strstr(tmp, "[heap]")) 
-                        maps[lc].heap++;
-                else
-                if (strstr(tmp, "[stack]"))
-                        maps[lc].stack++;
-                else
-                if (strstr(tmp, "[stack:")) { /* thread stack */
-                        for (i = 0, p = strchr(tmp, ':') + 1; *p != ']'; p++, i++)
-                                q[i] = *p;
-                        maps[i].thread_stack++;
-                        maps[i].stack_tid = atoi(q);
-                }
-                else 
-                if (strstr(tmp, "---p")) 
-                        maps[lc].padding++;
-                else
-                if (strstr(tmp, "[vdso]")) 
-                        maps[lc].vdso++; 
-                else
-                if (strstr(tmp, "[vsyscall]"))
-                        maps[lc].vsyscall++;
-                else
-                if ((p = strrchr(tmp, '/'))) {
-                        if (strstr(p, ".so")) {
+		}
+		else
+		if (!strcmp(file, "[heap]"))
+			maps[lc].heap++;
+		else
+		if (!strcmp(file, "[stack]"))
+			maps[lc].stack++;
+		else
+		if (!strncmp(file, "[stack:", 7)) { /* thread stack */
+			maps[lc].thread_stack++;
+			maps[lc].stack_tid = atoi(file + 7);
+		}
+		else
+		if (!memcmp(perms, "---p", 4))
+			maps[lc].padding++;
+		else
+		if (!strcmp(file, "[vdso]"))
+			maps[lc].vdso++;
+		else
+		if (!strcmp(file, "[vsyscall]"))
+			maps[lc].vsyscall++;
+		else
+		if (comm) {
+			maps[lc].filename = arena_strdup(file);
+			if (strstr(comm, ".so")) {
 #if DEBUG
-				log_msg(__LINE__, "marked %s as shared library", p);
+				log_msg(__LINE__, "marked %s as shared library", comm);
 #endif
-                                maps[lc].shlib++;
-                                maps[lc].filename = xstrdup(strchr(tmp, '/'));
-                        }
-                        else
-                        if (strstr(p, "rwxp") || strstr(p, "r-xp")) {
-                                maps[lc].filename = xstrdup(strchr(tmp, '/'));
-                                maps[lc].filemap_exe++; // executable file mapping
-                        }
-                        else {
-                                maps[lc].filename = xstrdup(strchr(tmp, '/'));
-                                maps[lc].filemap++; // regular file mapping
-                        }       
-                } else
-                if (strstr(tmp, "rwxp") || strstr(tmp, "r-xp")) 
-                        maps[lc].anonmap_exe++; // executable anonymous mapping
-                
-                /*      
-                 * Set segment permissions (Or is it a special file?)
-                 */
-                if (strstr(tmp, "r--p")) 
-                        maps[lc].p_flags = PF_R;
-                else
-                if (strstr(tmp, "rw-p"))
-                        maps[lc].p_flags = PF_R|PF_W;
-                else
-                if (strstr(tmp, "-w-p"))
-                        maps[lc].p_flags = PF_W;
-                else
-                if (strstr(tmp, "--xp"))
-                        maps[lc].p_flags = PF_X;
-                else
-                if (strstr(tmp, "r-xp"))
-                        maps[lc].p_flags = PF_X|PF_R;
-                else
-                if (strstr(tmp, "-wxp"))
-                        maps[lc].p_flags = PF_X|PF_W;
- 		else
-                if (strstr(tmp, "rwxp"))
-                        maps[lc].p_flags = PF_X|PF_W|PF_R;
-                else
-                if (strstr(tmp, "r--s"))
-                        maps[lc].special++;
-                else
-                if (strstr(tmp, "rw-s"))
-                        maps[lc].special++;
-                else
-                if (strstr(tmp, "-w-s"))
-                        maps[lc].special++;
-                else
-                if (strstr(tmp, "--xs"))
-                        maps[lc].special++;
-                else
-                if (strstr(tmp, "r-xs"))
-                        maps[lc].special++;
-                else
-                if (strstr(tmp, "-wxs"))
-                        maps[lc].special++;
-                else
-                if (strstr(tmp, "rwxs"))
-                        maps[lc].special++;
-                
-        }
-        fclose(fd);
+				maps[lc].shlib++;
+			}
+			else
+			if (perms[0] == 'r' && perms[2] == 'x' && perms[3] == 'p')
+				maps[lc].filemap_exe++; // executable file mapping
+			else
+				maps[lc].filemap++; // regular file mapping
+		} else
+		if (perms[0] == 'r' && perms[2] == 'x' && perms[3] == 'p')
+			maps[lc].anonmap_exe++; // executable anonymous mapping
 
-        return 0;
+		/*
+		 * Set segment permissions (Or is it a special file?)
+		 */
+		if (perms[3] == 'p')
+			maps[lc].p_flags = (perms[0] == 'r' ? PF_R : 0) |
+			    (perms[1] == 'w' ? PF_W : 0) | (perms[2] == 'x' ? PF_X : 0);
+		else
+		if (memcmp(perms, "---s", 4))
+			maps[lc].special++;
+	}
+	free(buf);
+	*mapsp = maps;
+	return lc;
 }
 
-static void fill_sock_info(fd_info_t *fdinfo, unsigned int inode)
+/*
+ * inode -> connection index of every socket in the target's network
+ * namespace. It is built once (the first time get_fd_links() sees a
+ * socket) so each socket fd costs one lookup rather than a re-parse
+ * of /proc/net/tcp and /proc/net/udp.
+ */
+typedef struct sock_entry {
+	unsigned long inode;	// 0 if the slot is empty
+	struct in_addr src_addr;
+	struct in_addr dst_addr;
+	uint16_t src_port;
+	uint16_t dst_port;
+	char net;
+} sock_entry_t;
+
+typedef struct sock_index {
+	sock_entry_t *entries;
+	size_t size;		// always a power of 2
+	size_t count;
+} sock_index_t;
+
+static sock_entry_t * sock_index_slot(sock_index_t *idx, unsigned long inode)
 {
-	FILE *fp = fopen("/proc/net/tcp", "r");
-	char buf[512], local_addr[64], rem_addr[64];
-	char more[512];
-	int local_port, rem_port, d, state, timer_run, uid, timeout;
-	unsigned long rxq, txq, time_len, retr, _inode;
-	if( fgets(buf, sizeof(buf), fp) == NULL ) {
-		log_msg(__LINE__, "fgets %s", strerror(errno));
-		exit(-1);
-        }
-	while (fgets(buf, sizeof(buf), fp)) {
-		sscanf(buf, "%d: %64[0-9A-Fa-f]:%X %64[0-9A-Fa-f]:%X %X %lX:%lX %X:%lX %lX %d %d %ld %512s\n",
-			&d, local_addr, &local_port, rem_addr, &rem_port, &state,
-			&txq, &rxq, &timer_run, &time_len, &retr, &uid, &timeout, &_inode, more);
-		if (_inode == inode) {
-#if DEBUG
-			log_msg(__LINE__, "socket (TCP) inode match");
-#endif
-			sscanf(local_addr, "%X", &(fdinfo->socket.src_addr.s_addr));
-			sscanf(rem_addr, "%X", &(fdinfo->socket.dst_addr.s_addr));
-			fdinfo->socket.src_port = local_port;
-			fdinfo->socket.dst_port = rem_port;
-			fdinfo->net = NET_TCP;
+	size_t i = (inode * 0x9e3779b97f4a7c15ULL) & (idx->size - 1);
+
+	while (idx->entries[i].inode && idx->entries[i].inode != inode)
+		i = (i + 1) & (idx->size - 1);
+	return &idx->entries[i];
+}
+
+static void sock_index_add(sock_index_t *idx, sock_entry_t *ent)
+{
+	sock_entry_t *old, *slot;
+	size_t i, oldsize;
+
+	if (ent->inode == 0)
+		return;
+	if ((idx->count + 1) * 10 > idx->size * 7) {
+		old = idx->entries;
+		oldsize = idx->size;
+		idx->size = idx->size ? idx->size << 1 : 1024;
+		idx->entries = (sock_entry_t *)heapAlloc(idx->size * sizeof(sock_entry_t));
+		for (i = 0; i < oldsize; i++)
+			if (old[i].inode)
+				*sock_index_slot(idx, old[i].inode) = old[i];
+		free(old);
+	}
+	slot = sock_index_slot(idx, ent->inode);
+	if (slot->inode == 0)
+		idx->count++;
+	*slot = *ent;
+}
+
+static sock_entry_t * sock_index_lookup(sock_index_t *idx, unsigned long inode)
+{
+	sock_entry_t *slot;
+
+	if (idx->size == 0 || inode == 0)
+		return NULL;
+	slot = sock_index_slot(idx, inode);
+	return slot->inode ? slot : NULL;
+}
+
+/*
+ * IPv6 sockets only carry an address we can store in fd_info_t
+ * if it is v4-mapped (::ffff:a.b.c.d); ports are kept either way.
+ */
+static void set_v6_addr(struct in_addr *addr, const uint32_t *v6)
+{
+	addr->s_addr = (v6[0] == 0 && v6[1] == 0 && v6[2] == htonl(0xffff)) ? v6[3] : 0;
+}
+
+static int diag_dump(int nl, void *req, size_t reqlen, char net, sock_index_t *idx)
+{
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+	struct nlmsghdr *nlh;
+	struct inet_diag_msg *msg;
+	struct unix_diag_msg *umsg;
+	sock_entry_t ent;
+	char buf[32768];
+	struct {
+		struct nlmsghdr nlh;
+		char body[64];
+	} request;
+	ssize_t len;
+
+	memset(&request, 0, sizeof(request));
+	request.nlh.nlmsg_len = NLMSG_LENGTH(reqlen);
+	request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	request.nlh.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+	memcpy(request.body, req, reqlen);
+	if (sendto(nl, &request, request.nlh.nlmsg_len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		return -1;
+	for (;;) {
+		if ((len = recv(nl, buf, sizeof(buf), 0)) <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			return -1;
 		}
-	}	/* Try for UDP if we don't find the socket inode in TCP */
-	
-	fclose(fp);
-	fp = fopen("/proc/net/udp", "r");
-	if( fgets(buf, sizeof(buf), fp) == NULL ) {
-		log_msg(__LINE__, "fgets %s", strerror(errno));
-		exit(-1);
-        }
-        while (fgets(buf, sizeof(buf), fp)) {
-                sscanf(buf, "%d: %64[0-9A-Fa-f]:%X %64[0-9A-Fa-f]:%X %X %lX:%lX %X:%lX %lX %d %d %ld %512s\n",
-                        &d, local_addr, &local_port, rem_addr, &rem_port, &state,
-                        &txq, &rxq, &timer_run, &time_len, &retr, &uid, &timeout, &_inode, more);
-                if (_inode == inode) {
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+				return -1;
+			memset(&ent, 0, sizeof(ent));
+			ent.net = net;
+			if (net == NET_UNIX) {
+				umsg = NLMSG_DATA(nlh);
+				ent.inode = umsg->udiag_ino;
+			} else {
+				msg = NLMSG_DATA(nlh);
+				ent.inode = msg->idiag_inode;
+				ent.src_port = ntohs(msg->id.idiag_sport);
+				ent.dst_port = ntohs(msg->id.idiag_dport);
+				if (msg->idiag_family == AF_INET) {
+					ent.src_addr.s_addr = msg->id.idiag_src[0];
+					ent.dst_addr.s_addr = msg->id.idiag_dst[0];
+				} else {
+					set_v6_addr(&ent.src_addr, msg->id.idiag_src);
+					set_v6_addr(&ent.dst_addr, msg->id.idiag_dst);
+				}
+			}
+			sock_index_add(idx, &ent);
+		}
+	}
+}
+
+/*
+ * Parse the address and port of a /proc/net/{tcp,udp}{,6} line
+ */
+static int parse_proc_net_addr(const char *str, struct in_addr *addr, uint16_t *port)
+{
+	uint32_t v6[4];
+	char word[9];
+	size_t len = strcspn(str, ":");
+	int i;
+
+	if (len == 8) {
+		addr->s_addr = strtoul(str, NULL, 16);
+	} else
+	if (len == 32) {
+		for (i = 0; i < 4; i++) {
+			memcpy(word, &str[i * 8], 8);
+			word[8] = '\0';
+			v6[i] = strtoul(word, NULL, 16);
+		}
+		set_v6_addr(addr, v6);
+	} else
+		return -1;
+	*port = strtoul(&str[len + 1], NULL, 16);
+	return 0;
+}
+
+static void index_proc_net(pid_t pid, const char *name, char net, sock_index_t *idx)
+{
+	char path[256], netname[64], *buf, *line, *eol, local[128], remote[128];
+	sock_entry_t ent;
+	size_t len;
+
+	snprintf(netname, sizeof(netname), "net/%s", name);
+	proc_path(path, sizeof(path), pid, netname);
+	if ((buf = read_proc_file(path, &len)) == NULL)
+		return;
+	/*
+	 * skip the header line
+	 */
+	for (line = strchr(buf, '\n'); line && *++line; line = eol) {
+		if ((eol = strchr(line, '\n')) != NULL)
+			*eol = '\0';
+		memset(&ent, 0, sizeof(ent));
+		ent.net = net;
+		if (net == NET_UNIX) {
+			if (sscanf(line, "%*s %*x %*x %*x %*x %*x %lu", &ent.inode) != 1)
+				goto next;
+		} else {
+			if (sscanf(line, "%*d: %127s %127s %*x %*x:%*x %*x:%*x %*x %*d %*d %lu",
+			    local, remote, &ent.inode) != 3)
+				goto next;
+			if (parse_proc_net_addr(local, &ent.src_addr, &ent.src_port) < 0 ||
+			    parse_proc_net_addr(remote, &ent.dst_addr, &ent.dst_port) < 0)
+				goto next;
+		}
+		sock_index_add(idx, &ent);
+next:
+		if (eol == NULL)
+			break;
+	}
+	free(buf);
+}
+
+/*
+ * Open a NETLINK_SOCK_DIAG socket in the network namespace of pid.
+ * Returns -1 if we can't get into it, in which case the caller falls
+ * back to /proc/<pid>/net which always shows the target's namespace.
+ */
+static int open_diag_socket(pid_t pid)
+{
+	struct stat st_target, st_self;
+	char path[64];
+	int nl, target, self;
+
+	if (opts.replay_dir != NULL)
+		return -1; // the recorded /proc/<pid>/net files are all there is
+	snprintf(path, sizeof(path), "/proc/%d/ns/net", pid);
+	if (stat(path, &st_target) < 0 || stat("/proc/self/ns/net", &st_self) < 0)
+		return -1;
+	if (st_target.st_ino == st_self.st_ino && st_target.st_dev == st_self.st_dev)
+		return socket(AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+
+	if ((target = open(path, O_RDONLY)) < 0)
+		return -1;
+	if ((self = open("/proc/self/ns/net", O_RDONLY)) < 0) {
+		close(target);
+		return -1;
+	}
+	nl = -1;
+	if (setns(target, CLONE_NEWNET) == 0) {
+		nl = socket(AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+		if (setns(self, CLONE_NEWNET) < 0) {
+			log_msg(__LINE__, "setns %s", strerror(errno));
+			exit(-1);
+		}
+	}
+	close(target);
+	close(self);
+	return nl;
+}
+
+static void build_sock_index(pid_t pid, sock_index_t *idx)
+{
+	static const struct {
+		uint8_t family;
+		uint8_t protocol;
+		char net;
+		const char *procname;
+	} inet[] = {
+		{ AF_INET, IPPROTO_TCP, NET_TCP, "tcp" },
+		{ AF_INET6, IPPROTO_TCP, NET_TCP, "tcp6" },
+		{ AF_INET, IPPROTO_UDP, NET_UDP, "udp" },
+		{ AF_INET6, IPPROTO_UDP, NET_UDP, "udp6" },
+	};
+	struct inet_diag_req_v2 req;
+	struct unix_diag_req ureq;
+	int nl, i;
+
+	memset(idx, 0, sizeof(*idx));
+	nl = open_diag_socket(pid);
+	for (i = 0; i < sizeof(inet) / sizeof(inet[0]); i++) {
+		memset(&req, 0, sizeof(req));
+		req.sdiag_family = inet[i].family;
+		req.sdiag_protocol = inet[i].protocol;
+		req.idiag_states = ~0U;
+		/*
+		 * udp_diag may not be loaded; fall back per table
+		 */
+		if (nl < 0 || diag_dump(nl, &req, sizeof(req), inet[i].net, idx) < 0)
+			index_proc_net(pid, inet[i].procname, inet[i].net, idx);
+	}
+	memset(&ureq, 0, sizeof(ureq));
+	ureq.sdiag_family = AF_UNIX;
+	ureq.udiag_states = ~0U;
+	if (nl < 0 || diag_dump(nl, &ureq, sizeof(ureq), NET_UNIX, idx) < 0)
+		index_proc_net(pid, "unix", NET_UNIX, idx);
+	if (nl >= 0)
+		close(nl);
 #if DEBUG
-                        log_msg(__LINE__, "socket (UDP) inode match");
+	log_msg(__LINE__, "indexed %zu sockets (%s)", idx->count, nl < 0 ? "/proc/net" : "sock_diag");
 #endif
-                        sscanf(local_addr, "%X", &(fdinfo->socket.src_addr.s_addr));
-                        sscanf(rem_addr, "%X", &(fdinfo->socket.dst_addr.s_addr));
-                        fdinfo->socket.src_port = local_port;
-                        fdinfo->socket.dst_port = rem_port;
-                        fdinfo->net = NET_UDP;
-                        log_msg(__LINE__, "setting net UDP");
-                }
-        }
-
-	fclose(fp);
 }
 
 int get_fd_links(memdesc_t *memdesc, fd_info_t **fdinfo)
 {
 	DIR *dp;
 	struct dirent *dptr = NULL;
-	char tmp[256];
-	char *dpath = xfmtstrdup("/proc/%d/fd", memdesc->task.pid);
-	*fdinfo = (fd_info_t *)heapAlloc(sizeof(fd_info_t) * 256);
-	fd_info_t fdinfo_tmp;
-	unsigned int inode;
-	char *p;
+	char tmp[PATH_MAX + 256], dpath[PATH_MAX];
+	size_t cap = 256;
+	sock_index_t sockets = { 0 };
+	sock_entry_t *sock;
+	int indexed = 0;
+	unsigned long inode;
 	int fdcount;
  	
+	proc_path(dpath, sizeof(dpath), memdesc->task.pid, "fd");
+	*fdinfo = (fd_info_t *)heapAlloc(sizeof(fd_info_t) * cap);
         for (fdcount = 0, dp = opendir(dpath); dp != NULL;) {
                 dptr = readdir(dp);
                 if (dptr == NULL) 
                         break;
 		if (dptr->d_name[0] == '.')
 			continue;
+		if (fdcount == cap) {
+			*fdinfo = realloc(*fdinfo, sizeof(fd_info_t) * cap * 2);
+			if (*fdinfo == NULL) {
+				log_msg(__LINE__, "realloc %s", strerror(errno));
+				exit(-1);
+			}
+			memset(&(*fdinfo)[cap], 0, sizeof(fd_info_t) * cap);
+			cap <<= 1;
+		}
 		snprintf(tmp, sizeof(tmp), "%s/%s", dpath, dptr->d_name); // i.e /proc/pid/fd/3
-		if( readlink(tmp, (*fdinfo)[fdcount].path, MAX_PATH) == -1 ) {
+		if( readlink(tmp, (*fdinfo)[fdcount].path, MAX_PATH - 1) == -1 ) {
                     log_msg(__LINE__, "readlink %s", strerror(errno));
                     exit(-1);
                 }
-		if (strstr((*fdinfo)[fdcount].path, "socket")) {
-			p = strchr((*fdinfo)[fdcount].path, ':') + 2;
-			if (p == NULL) {
-				fdcount++;
-				continue;
+		if (!strncmp((*fdinfo)[fdcount].path, "socket:[", 8)) {
+			if (!indexed) {
+				build_sock_index(memdesc->task.pid, &sockets);
+				indexed++;
 			}
-			
-			inode = atoi(p);
-			fill_sock_info(&fdinfo_tmp, inode);
-			if (fdinfo_tmp.net) {
-				(*fdinfo)[fdcount].net = fdinfo_tmp.net;
-				(*fdinfo)[fdcount].socket = fdinfo_tmp.socket;
+			inode = strtoul(&(*fdinfo)[fdcount].path[8], NULL, 10);
+			if ((sock = sock_index_lookup(&sockets, inode)) != NULL) {
+				(*fdinfo)[fdcount].net = sock->net;
+				(*fdinfo)[fdcount].socket.src_addr = sock->src_addr;
+				(*fdinfo)[fdcount].socket.dst_addr = sock->dst_addr;
+				(*fdinfo)[fdcount].socket.src_port = sock->src_port;
+				(*fdinfo)[fdcount].socket.dst_port = sock->dst_port;
 			}
 		}
 		(*fdinfo)[fdcount].fd = atoi(dptr->d_name);
 		fdcount++;
 	}
+	if (dp != NULL)
+		closedir(dp);
+	free(sockets.entries);
 	return fdcount;
 }
 
-int get_map_count(pid_t pid)
-{
-        FILE *pd;
-        char cmd[256], buf[256];
-        int lc;
-  	      
-        snprintf(cmd, sizeof(cmd), "/usr/bin/wc -l /proc/%d/maps", pid);
-	if ((pd = popen(cmd, "r")) == NULL) {
-            	log_msg(__LINE__, "popen %s", strerror(errno));
-		return -1;
-        }
-        if( fgets(buf, sizeof(buf), pd) == NULL ) {
-            log_msg(__LINE__, "fgets %s", strerror(errno));
-            exit(-1);
-        }
-        lc = atoi(buf);
-        pclose(pd);
-        return lc;
-}
-
 char * get_executable_path(int pid)
 {
-	char *path = xfmtstrdup("/proc/%d/exe", pid);
+	char path[PATH_MAX];
 	char *ret = (char *)heapAlloc(MAX_PATH);
 	char *ret2 = (char *)heapAlloc(MAX_PATH);
 	
 	memset(ret, 0, MAX_PATH); // for null termination padding
+	/*
+	 * A snapshot's exe is a copy of the binary; the link is kept
+	 * alongside it as exe.link
+	 */
+	proc_path(path, sizeof(path), pid, opts.replay_dir ? "exe.link" : "exe");
 	if( readlink(path, ret, MAX_PATH) == -1) {
             log_msg(__LINE__, "readlink %s", strerror(errno));
             exit(-1);
         }
-	free(path);
 	/* Now is our new path also a symbolic link? */
 	int rval = readlink(ret, ret2, MAX_PATH);
 	return rval < 0 ? ret : ret2;
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Recording and replaying the /proc/<pid> state of a crashed process;
+ * see replay.h for the snapshot layout.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/proc.h"
+#include "../include/replay.h"
+#include <sys/sendfile.h>
+#include <limits.h>
+
+static const char *proc_files[] = {
+	"maps", "auxv", "environ", "comm", "cmdline", "status", "exe",
+	"net/tcp", "net/tcp6", "net/udp", "net/udp6", "net/unix"
+};
+
+static struct replay_mem {
+	unsigned long vaddr;
+	size_t len;
+	off_t offset;
+} *mem_index;
+static size_t mem_count;
+static int mem_fd = -1;
+
+static void record_path(char *buf, size_t len, pid_t pid, const char *name)
+{
+	snprintf(buf, len, "%s/%d/%s", opts.record_dir, pid, name);
+}
+
+static int copy_file(const char *src, const char *dst)
+{
+	char buf[65536];
+	ssize_t n;
+	int in, out, ret = 0;
+
+	if ((in = open(src, O_RDONLY)) < 0)
+		return -1;
+	if ((out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+		close(in);
+		return -1;
+	}
+	while ((n = read(in, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+		if (write(out, buf, n) != n) {
+			ret = -1;
+			break;
+		}
+	}
+	close(in);
+	close(out);
+	return ret;
+}
+
+static int copy_link(const char *src, const char *dst)
+{
+	char target[PATH_MAX];
+	ssize_t n;
+
+	if ((n = readlink(src, target, sizeof(target) - 1)) < 0)
+		return -1;
+	target[n] = '\0';
+	unlink(dst);
+	return symlink(target, dst);
+}
+
+int replay_record(pid_t pid)
+{
+	char src[PATH_MAX], dst[PATH_MAX], name[NAME_MAX + 4];
+	struct dirent *d;
+	DIR *dp;
+	int i;
+
+	mkdir(opts.record_dir, 0700);
+	record_path(dst, sizeof(dst), pid, "");
+	if (mkdir(dst, 0700) < 0 && errno != EEXIST) {
+		log_msg(__LINE__, "mkdir %s: %s", dst, strerror(errno));
+		return -1;
+	}
+	record_path(dst, sizeof(dst), pid, "fd");
+	mkdir(dst, 0700);
+	record_path(dst, sizeof(dst), pid, "net");
+	mkdir(dst, 0700);
+
+	for (i = 0; i < sizeof(proc_files) / sizeof(proc_files[0]); i++) {
+		proc_path(src, sizeof(src), pid, proc_files[i]);
+		record_path(dst, sizeof(dst), pid, proc_files[i]);
+		if (copy_file(src, dst) < 0) {
+			log_msg(__LINE__, "failed to record %s: %s", src, strerror(errno));
+			if (i == 0 || !strcmp(proc_files[i], "exe"))
+				return -1;
+		}
+	}
+	proc_path(src, sizeof(src), pid, "exe");
+	record_path(dst, sizeof(dst), pid, "exe.link");
+	if (copy_link(src, dst) < 0) {
+		log_msg(__LINE__, "failed to record %s: %s", src, strerror(errno));
+		return -1;
+	}
+
+	proc_path(src, sizeof(src), pid, "fd");
+	if ((dp = opendir(src)) != NULL) {
+		while ((d = readdir(dp)) != NULL) {
+			if (d->d_name[0] == '.')
+				continue;
+			snprintf(name, sizeof(name), "fd/%s", d->d_name);
+			proc_path(src, sizeof(src), pid, name);
+			record_path(dst, sizeof(dst), pid, name);
+			copy_link(src, dst);
+		}
+		closedir(dp);
+	}
+
+	/*
+	 * The text images are appended as they are read
+	 */
+	record_path(dst, sizeof(dst), pid, "mem");
+	unlink(dst);
+	record_path(dst, sizeof(dst), pid, "mem.idx");
+	unlink(dst);
+	return 0;
+}
+
+void replay_record_mem(pid_t pid, unsigned long vaddr, const uint8_t *buf, size_t len)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int fd, idx;
+
+	record_path(path, sizeof(path), pid, "mem");
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0600)) < 0) {
+		log_msg(__LINE__, "open %s: %s", path, strerror(errno));
+		return;
+	}
+	record_path(path, sizeof(path), pid, "mem.idx");
+	if ((idx = open(path, O_WRONLY|O_CREAT|O_APPEND, 0600)) < 0) {
+		log_msg(__LINE__, "open %s: %s", path, strerror(errno));
+		close(fd);
+		return;
+	}
+	if (fstat(fd, &st) == 0 && write(fd, buf, len) == (ssize_t)len)
+		dprintf(idx, "%lx %zx %lx\n", vaddr, len, (unsigned long)st.st_size);
+	else
+		log_msg(__LINE__, "failed to record text image at %lx", vaddr);
+	close(idx);
+	close(fd);
+}
+
+int replay_record_core(pid_t pid, int core_fd)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	off_t off = 0;
+	ssize_t n;
+	int fd;
+
+	if (fstat(core_fd, &st) < 0)
+		return -1;
+	record_path(path, sizeof(path), pid, "core");
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+		log_msg(__LINE__, "open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	while (off < st.st_size) {
+		n = sendfile(fd, core_fd, &off, st.st_size - off);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			log_msg(__LINE__, "sendfile %s", strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static int load_mem_index(pid_t pid)
+{
+	char path[PATH_MAX];
+	unsigned long vaddr, offset;
+	size_t len, cap = 64;
+	FILE *fp;
+
+	proc_path(path, sizeof(path), pid, "mem.idx");
+	if ((fp = fopen(path, "r")) == NULL) {
+		log_msg(__LINE__, "fopen %s: %s", path, strerror(errno));
+		return -1;
+	}
+	mem_index = heapAlloc(sizeof(*mem_index) * cap);
+	while (fscanf(fp, "%lx %zx %lx", &vaddr, &len, &offset) == 3) {
+		if (mem_count == cap) {
+			cap <<= 1;
+			if ((mem_index = realloc(mem_index, sizeof(*mem_index) * cap)) == NULL) {
+				log_msg(__LINE__, "realloc %s", strerror(errno));
+				exit(-1);
+			}
+		}
+		mem_index[mem_count].vaddr = vaddr;
+		mem_index[mem_count].len = len;
+		mem_index[mem_count].offset = offset;
+		mem_count++;
+	}
+	fclose(fp);
+	proc_path(path, sizeof(path), pid, "mem");
+	if ((mem_fd = open(path, O_RDONLY)) < 0) {
+		log_msg(__LINE__, "open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t replay_read_mem(pid_t pid, uint8_t *buf, unsigned long vaddr, size_t len)
+{
+	size_t i;
+
+	if (mem_fd < 0 && load_mem_index(pid) < 0)
+		return -1;
+	for (i = 0; i < mem_count; i++) {
+		if (vaddr < mem_index[i].vaddr || vaddr + len > mem_index[i].vaddr + mem_index[i].len)
+			continue;
+		if (pread(mem_fd, buf, len, mem_index[i].offset + (vaddr - mem_index[i].vaddr)) != (ssize_t)len)
+			break;
+		return len;
+	}
+	log_msg(__LINE__, "%lx-%lx is not in the recorded text images", vaddr, vaddr + len);
+	return -1;
+}
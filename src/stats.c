@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Capture instrumentation: wall/CPU time, I/O and peak RSS of each
+ * stage of the pipeline. See stats.h and ECFS_STATS_NAME in ecfs.h.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/stats.h"
+
+static const char *stage_names[ECFS_STAGE_COUNT] = {
+	[ECFS_STAGE_PROC] = "proc",
+	[ECFS_STAGE_TEXT] = "text",
+	[ECFS_STAGE_CORE] = "core",
+	[ECFS_STAGE_NOTES] = "notes",
+	[ECFS_STAGE_MERGE] = "merge",
+	[ECFS_STAGE_PHDRS] = "phdrs",
+	[ECFS_STAGE_SYMBOLS] = "symbols",
+	[ECFS_STAGE_HEURISTICS] = "heuristics",
+	[ECFS_STAGE_WRITE] = "write",
+	[ECFS_STAGE_SYMVALS] = "symvals",
+	[ECFS_STAGE_COMPRESS] = "compress"
+};
+
+static struct stage_sample {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	uint64_t rchar;
+	uint64_t wchar;
+} stage_start[ECFS_STAGE_COUNT];
+
+static ecfs_stat_t stats[ECFS_STAGE_COUNT];
+static int current_stage = -1;
+static uint64_t sampler_bytes; // what read_proc_io() itself added to rchar
+
+static uint64_t clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clk, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * rchar/wchar count every byte that went through read(2)/write(2)
+ * and friends, including pipes and memfds, which is what we want;
+ * read_bytes/write_bytes only see the block layer. Our own reads of
+ * /proc/self/io are taken back out.
+ */
+static void read_proc_io(uint64_t *rchar, uint64_t *wchar)
+{
+	char buf[512], *p;
+	ssize_t n;
+	int fd;
+
+	*rchar = *wchar = 0;
+	fd = open("/proc/self/io", O_RDONLY);
+	if (fd < 0)
+		return;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return;
+	buf[n] = '\0';
+	if ((p = strstr(buf, "rchar:")) != NULL)
+		*rchar = strtoull(p + 6, NULL, 10) - sampler_bytes;
+	sampler_bytes += n;
+	if ((p = strstr(buf, "wchar:")) != NULL)
+		*wchar = strtoull(p + 6, NULL, 10);
+}
+
+static void sample(struct stage_sample *s)
+{
+	s->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	s->cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	read_proc_io(&s->rchar, &s->wchar);
+}
+
+void stats_begin(int stage)
+{
+	if (stage < 0 || stage >= ECFS_STAGE_COUNT)
+		return;
+	sample(&stage_start[stage]);
+	current_stage = stage;
+}
+
+void stats_end(int stage)
+{
+	struct stage_sample now, *start;
+	struct rusage ru;
+	ecfs_stat_t *st;
+
+	if (stage < 0 || stage >= ECFS_STAGE_COUNT)
+		return;
+	start = &stage_start[stage];
+	st = &stats[stage];
+	sample(&now);
+	strncpy(st->name, stage_names[stage], ECFS_STAGE_NAME_LEN - 1);
+	st->wall_ns += now.wall_ns - start->wall_ns;
+	st->cpu_ns += now.cpu_ns - start->cpu_ns;
+	st->bytes_read += now.rchar - start->rchar;
+	st->bytes_written += now.wchar - start->wchar;
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		st->peak_rss_kb = ru.ru_maxrss;
+	current_stage = -1;
+}
+
+void stats_add_io(uint64_t bytes_read, uint64_t bytes_written)
+{
+	if (current_stage < 0)
+		return;
+	stats[current_stage].bytes_read += bytes_read;
+	stats[current_stage].bytes_written += bytes_written;
+}
+
+ecfs_stat_t * stats_table(void)
+{
+	return stats;
+}
+
+int stats_update_file(const char *outfile)
+{
+	ElfW(Ehdr) ehdr;
+	ElfW(Shdr) *shdr = NULL;
+	char *shstrtab = NULL;
+	size_t shlen;
+	int fd, i, ret = -1;
+
+	fd = open(outfile, O_RDWR);
+	if (fd < 0) {
+		log_msg(__LINE__, "open %s: %s", outfile, strerror(errno));
+		return -1;
+	}
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+	    ehdr.e_shoff == 0 || ehdr.e_shstrndx >= ehdr.e_shnum)
+		goto out;
+	shlen = ehdr.e_shnum * sizeof(ElfW(Shdr));
+	shdr = heapAlloc(shlen);
+	if (pread(fd, shdr, shlen, ehdr.e_shoff) != (ssize_t)shlen)
+		goto out;
+	shstrtab = heapAlloc(shdr[ehdr.e_shstrndx].sh_size + 1);
+	if (pread(fd, shstrtab, shdr[ehdr.e_shstrndx].sh_size,
+	    shdr[ehdr.e_shstrndx].sh_offset) != (ssize_t)shdr[ehdr.e_shstrndx].sh_size)
+		goto out;
+	for (i = 0; i < ehdr.e_shnum; i++) {
+		if (shdr[i].sh_name >= shdr[ehdr.e_shstrndx].sh_size)
+			continue;
+		if (strcmp(&shstrtab[shdr[i].sh_name], ECFS_STATS_NAME))
+			continue;
+		if (shdr[i].sh_size != sizeof(stats))
+			break;
+		if (pwrite(fd, stats, sizeof(stats), shdr[i].sh_offset) == sizeof(stats))
+			ret = 0;
+		else
+			log_msg(__LINE__, "pwrite %s", strerror(errno));
+		break;
+	}
+out:
+	free(shdr);
+	free(shstrtab);
+	close(fd);
+	return ret;
+}
+
+void stats_summary(char *buf, size_t len)
+{
+	uint64_t wall = 0, cpu = 0, rd = 0, wr = 0, rss = 0;
+	size_t off;
+	int i, n;
+
+	for (i = 0; i < ECFS_STAGE_COUNT; i++) {
+		wall += stats[i].wall_ns;
+		cpu += stats[i].cpu_ns;
+		rd += stats[i].bytes_read;
+		wr += stats[i].bytes_written;
+		if (stats[i].peak_rss_kb > rss)
+			rss = stats[i].peak_rss_kb;
+	}
+	n = snprintf(buf, len, "capture stats: wall %.3fms cpu %.3fms read %lu written %lu peak rss %lukB |",
+	    wall / 1e6, cpu / 1e6, (unsigned long)rd, (unsigned long)wr, (unsigned long)rss);
+	if (n < 0 || (size_t)n >= len)
+		return;
+	off = n;
+	for (i = 0; i < ECFS_STAGE_COUNT; i++) {
+		if (stats[i].name[0] == '\0')
+			continue;
+		n = snprintf(buf + off, len - off, " %s %.3f", stats[i].name, stats[i].wall_ns / 1e6);
+		if (n < 0 || (size_t)n >= len - off)
+			return;
+		off += n;
+	}
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/strtab.h"
+
+static void strtab_reserve(strtab_t *st, size_t len)
+{
+	size_t cap;
+
+	if (st->len + len <= st->cap)
+		return;
+	for (cap = st->cap ? st->cap : 256; cap < st->len + len; cap <<= 1)
+		;
+	st->buf = realloc(st->buf, cap);
+	if (st->buf == NULL) {
+		log_msg(__LINE__, "realloc %s", strerror(errno));
+		exit(-1);
+	}
+	st->cap = cap;
+}
+
+void strtab_init(strtab_t *st, size_t hint)
+{
+	st->buf = NULL;
+	st->len = st->cap = 0;
+	strtab_reserve(st, hint ? hint : 1);
+	st->buf[st->len++] = '\0';
+}
+
+unsigned int strtab_add(strtab_t *st, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	unsigned int offset = st->len;
+
+	strtab_reserve(st, len);
+	memcpy(&st->buf[st->len], str, len);
+	st->len += len;
+	return offset;
+}
+
+/*
+ * Append prefix followed by val in lowercase hex, i.e what
+ * "%s%lx" would give us, without going through the printf machinery.
+ */
+unsigned int strtab_add_hex(strtab_t *st, const char *prefix, uint64_t val)
+{
+	static const char hexdigits[] = "0123456789abcdef";
+	size_t plen = strlen(prefix);
+	unsigned int offset = st->len;
+	int digits = 1, n;
+	char *p;
+
+	while (digits < 16 && (val >> (digits * 4)))
+		digits++;
+	strtab_reserve(st, plen + digits + 1);
+	p = &st->buf[st->len];
+	memcpy(p, prefix, plen);
+	p += plen;
+	p[digits] = '\0';
+	for (n = digits - 1; n >= 0; n--) {
+		p[n] = hexdigits[val & 0xf];
+		val >>= 4;
+	}
+	st->len += plen + digits + 1;
+	return offset;
+}
+
+void strtab_free(strtab_t *st)
+{
+	free(st->buf);
+	st->buf = NULL;
+	st->len = st->cap = 0;
+}
+
+void symtab_builder_init(symtab_builder_t *sb, size_t hint)
+{
+	sb->count = 0;
+	sb->cap = hint ? hint : 64;
+	sb->syms = (ElfW(Sym) *)heapAlloc(sb->cap * sizeof(ElfW(Sym)));
+	/*
+	 * Names for generated symbols average around 16 bytes (sub_<addr>)
+	 */
+	strtab_init(&sb->strtab, sb->cap * 16);
+}
+
+ElfW(Sym) * symtab_builder_add(symtab_builder_t *sb, unsigned int name, ElfW(Addr) value,
+			       size_t size, unsigned char info, ElfW(Section) shndx)
+{
+	ElfW(Sym) *sym;
+
+	if (sb->count == sb->cap) {
+		sb->cap <<= 1;
+		sb->syms = realloc(sb->syms, sb->cap * sizeof(ElfW(Sym)));
+		if (sb->syms == NULL) {
+			log_msg(__LINE__, "realloc %s", strerror(errno));
+			exit(-1);
+		}
+	}
+	sym = &sb->syms[sb->count++];
+	sym->st_name = name;
+	sym->st_value = value;
+	sym->st_size = size;
+	sym->st_info = info;
+	sym->st_other = 0;
+	sym->st_shndx = shndx;
+	return sym;
+}
+
+void symtab_builder_free(symtab_builder_t *sb)
+{
+	free(sb->syms);
+	sb->syms = NULL;
+	sb->count = sb->cap = 0;
+	strtab_free(&sb->strtab);
+}
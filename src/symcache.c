@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/symcache.h"
+#include "../include/heuristics.h"
+#include "../include/hash.h"
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * Read the NT_GNU_BUILD_ID note with a couple of preads rather than
+ * mapping the whole file; this is done on every cache lookup.
+ */
+static uint32_t read_build_id(int fd, uint8_t *build_id)
+{
+	ElfW(Ehdr) ehdr;
+	ElfW(Phdr) *phdr;
+	ElfW(Nhdr) *nhdr;
+	uint8_t *note, *p;
+	uint32_t len = 0;
+	int i;
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG))
+		return 0;
+	if (ehdr.e_phnum == 0 || ehdr.e_phentsize != sizeof(ElfW(Phdr)))
+		return 0;
+	phdr = alloca(ehdr.e_phnum * sizeof(ElfW(Phdr)));
+	if (pread(fd, phdr, ehdr.e_phnum * sizeof(ElfW(Phdr)), ehdr.e_phoff) != ehdr.e_phnum * sizeof(ElfW(Phdr)))
+		return 0;
+	for (i = 0; i < ehdr.e_phnum && len == 0; i++) {
+		if (phdr[i].p_type != PT_NOTE || phdr[i].p_filesz == 0 || phdr[i].p_filesz > 4096)
+			continue;
+		note = alloca(phdr[i].p_filesz);
+		if (pread(fd, note, phdr[i].p_filesz, phdr[i].p_offset) != phdr[i].p_filesz)
+			continue;
+		for (p = note; p + sizeof(ElfW(Nhdr)) <= note + phdr[i].p_filesz;) {
+			nhdr = (ElfW(Nhdr) *)p;
+			if ((uint8_t *)ELFNOTE_DESC(nhdr) + nhdr->n_descsz > note + phdr[i].p_filesz)
+				break;
+			if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_descsz <= SYMCACHE_MAX_BUILD_ID) {
+				len = nhdr->n_descsz;
+				memcpy(build_id, ELFNOTE_DESC(nhdr), len);
+				break;
+			}
+			p = (uint8_t *)ELFNOTE_NEXT(nhdr);
+		}
+	}
+	return len;
+}
+
+static char * symcache_path(struct stat *st)
+{
+	return xfmtstrdup("%s/%lx-%lx-%lx.%lx", ECFS_SYMCACHE_DIR, (unsigned long)st->st_dev,
+	    (unsigned long)st->st_ino, (unsigned long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec);
+}
+
+static int symcache_map(const char *cpath, struct stat *st, uint8_t *build_id, uint32_t build_id_len, symcache_t *cache)
+{
+	struct stat cst;
+	uint8_t *mem;
+	int fd;
+
+	if ((fd = open(cpath, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &cst) < 0 || cst.st_size < sizeof(struct symcache_hdr)) {
+		close(fd);
+		return -1;
+	}
+	mem = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return -1;
+	cache->hdr = (struct symcache_hdr *)mem;
+	if (memcmp(cache->hdr->magic, SYMCACHE_MAGIC, 8) || cache->hdr->dev != st->st_dev ||
+	    cache->hdr->ino != st->st_ino || cache->hdr->size != st->st_size ||
+	    cache->hdr->mtime_sec != st->st_mtim.tv_sec || cache->hdr->mtime_nsec != st->st_mtim.tv_nsec ||
+	    cache->hdr->build_id_len != build_id_len || memcmp(cache->hdr->build_id, build_id, build_id_len) ||
+	    cache->hdr->names_offset + cache->hdr->names_size > cst.st_size ||
+	    cache->hdr->sym_offset + cache->hdr->sym_count * sizeof(struct symcache_sym) > cst.st_size ||
+	    cache->hdr->needed_offset + cache->hdr->needed_count * sizeof(uint32_t) > cst.st_size ||
+	    cache->hdr->rodata_offset + cache->hdr->rodata_count * sizeof(uint32_t) > cst.st_size) {
+		munmap(mem, cst.st_size);
+		return -1;
+	}
+	cache->syms = (struct symcache_sym *)&mem[cache->hdr->sym_offset];
+	cache->needed = (uint32_t *)&mem[cache->hdr->needed_offset];
+	cache->rodata = (uint32_t *)&mem[cache->hdr->rodata_offset];
+	cache->names = (const char *)&mem[cache->hdr->names_offset];
+	cache->map_size = cst.st_size;
+	return 0;
+}
+
+/*
+ * Parse the library and write its cache file to cpath.
+ */
+static int symcache_build(int fd, const char *cpath, struct stat *st,
+    uint8_t *build_id, uint32_t build_id_len)
+{
+	struct symcache_hdr hdr;
+	struct symcache_sym *syms = NULL;
+	uint32_t *needed = NULL, *rodata = NULL;
+	struct rodata_string *strs = NULL;
+	ElfW(Ehdr) *ehdr;
+	ElfW(Phdr) *phdr;
+	ElfW(Shdr) *shdr;
+	ElfW(Sym) *symtab = NULL;
+	ElfW(Dyn) *dyn = NULL;
+	char *shstrtab, *dynstr = NULL, *tmp, *rostr = NULL;
+	size_t dynstr_size = 0, rodata_size = 0, rostr_size = 0, i, n;
+	uint8_t *mem, *rodata_ptr = NULL;
+	int out, ret = -1;
+
+	mem = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+	ehdr = (ElfW(Ehdr) *)mem;
+	phdr = (ElfW(Phdr) *)&mem[ehdr->e_phoff];
+	shdr = (ElfW(Shdr) *)&mem[ehdr->e_shoff];
+	if (ehdr->e_shoff == 0 || ehdr->e_shstrndx == SHN_UNDEF)
+		goto done;
+	shstrtab = (char *)&mem[shdr[ehdr->e_shstrndx].sh_offset];
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SYMCACHE_MAGIC, 8);
+	hdr.dev = st->st_dev;
+	hdr.ino = st->st_ino;
+	hdr.size = st->st_size;
+	hdr.mtime_sec = st->st_mtim.tv_sec;
+	hdr.mtime_nsec = st->st_mtim.tv_nsec;
+	hdr.build_id_len = build_id_len;
+	memcpy(hdr.build_id, build_id, build_id_len);
+
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type == PT_LOAD) {
+			hdr.use_addend = phdr[i].p_vaddr == 0;
+			break;
+		}
+	}
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type == PT_DYNAMIC) {
+			dyn = (ElfW(Dyn) *)&mem[phdr[i].p_offset];
+			break;
+		}
+	}
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (!strcmp(&shstrtab[shdr[i].sh_name], ".dynsym")) {
+			hdr.sym_count = shdr[i].sh_size / sizeof(ElfW(Sym));
+			symtab = (ElfW(Sym) *)&mem[shdr[i].sh_offset];
+		} else
+		if (!strcmp(&shstrtab[shdr[i].sh_name], ".dynstr")) {
+			dynstr = (char *)&mem[shdr[i].sh_offset];
+			dynstr_size = shdr[i].sh_size;
+		} else
+		if (!strcmp(&shstrtab[shdr[i].sh_name], ".rodata")) {
+			rodata_ptr = &mem[shdr[i].sh_offset];
+			rodata_size = shdr[i].sh_size;
+		}
+	}
+	if (dynstr == NULL)
+		goto done;
+
+	/*
+	 * The name table starts with a copy of .dynstr; both the symbols
+	 * and the DT_NEEDED entries are offsets into it.
+	 */
+	syms = (struct symcache_sym *)heapAlloc((hdr.sym_count + 1) * sizeof(struct symcache_sym));
+	for (i = 0; symtab != NULL && i < hdr.sym_count; i++) {
+		syms[i].value = symtab[i].st_value;
+		syms[i].size = symtab[i].st_size;
+		syms[i].name = symtab[i].st_name;
+	}
+	for (n = 0, i = 0; dyn != NULL && dyn[i].d_tag != DT_NULL; i++)
+		if (dyn[i].d_tag == DT_NEEDED)
+			n++;
+	needed = (uint32_t *)heapAlloc((n + 1) * sizeof(uint32_t));
+	for (n = 0, i = 0; dyn != NULL && dyn[i].d_tag != DT_NULL; i++)
+		if (dyn[i].d_tag == DT_NEEDED)
+			needed[n++] = dyn[i].d_un.d_val;
+	hdr.needed_count = n;
+
+	/*
+	 * The .rodata strings are appended to the name table, each
+	 * with its terminator, so they can be used in place.
+	 */
+	for (i = 0; symtab != NULL && i < hdr.sym_count; i++) {
+		if (symtab[i].st_name < dynstr_size && !strcmp(&dynstr[symtab[i].st_name], "dlopen")) {
+			hdr.calls_dlopen = 1;
+			break;
+		}
+	}
+	if (rodata_ptr != NULL)
+		hdr.rodata_count = scan_rodata_strings(rodata_ptr, rodata_size, &strs);
+	rodata = (uint32_t *)heapAlloc((hdr.rodata_count + 1) * sizeof(uint32_t));
+	for (i = 0; i < hdr.rodata_count; i++)
+		rostr_size += strs[i].len + 1;
+	rostr = heapAlloc(rostr_size + 1);
+	for (n = 0, i = 0; i < hdr.rodata_count; i++) {
+		rodata[i] = dynstr_size + n;
+		memcpy(&rostr[n], &rodata_ptr[strs[i].offset], strs[i].len + 1);
+		n += strs[i].len + 1;
+	}
+
+	hdr.sym_offset = sizeof(hdr);
+	hdr.needed_offset = hdr.sym_offset + hdr.sym_count * sizeof(struct symcache_sym);
+	hdr.rodata_offset = hdr.needed_offset + hdr.needed_count * sizeof(uint32_t);
+	hdr.names_offset = hdr.rodata_offset + hdr.rodata_count * sizeof(uint32_t);
+	hdr.names_size = dynstr_size + rostr_size;
+
+	tmp = xfmtstrdup("%s/.tmp.%d.%lx", ECFS_SYMCACHE_DIR, getpid(), (unsigned long)pthread_self());
+	out = open(tmp, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (out < 0) {
+		free(tmp);
+		goto done;
+	}
+	struct iovec iov[6] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = syms, .iov_len = hdr.sym_count * sizeof(struct symcache_sym) },
+		{ .iov_base = needed, .iov_len = hdr.needed_count * sizeof(uint32_t) },
+		{ .iov_base = rodata, .iov_len = hdr.rodata_count * sizeof(uint32_t) },
+		{ .iov_base = dynstr, .iov_len = dynstr_size },
+		{ .iov_base = rostr, .iov_len = rostr_size }
+	};
+	size_t total = 0;
+	for (i = 0; i < 6; i++)
+		total += iov[i].iov_len;
+	if (writev(out, iov, 6) == total && rename(tmp, cpath) == 0)
+		ret = 0;
+	else
+		unlink(tmp);
+	close(out);
+	free(tmp);
+done:
+	if (syms != NULL)
+		free(syms);
+	if (needed != NULL)
+		free(needed);
+	if (rodata != NULL)
+		free(rodata);
+	if (rostr != NULL)
+		free(rostr);
+	if (strs != NULL)
+		free(strs);
+	munmap(mem, st->st_size);
+	return ret;
+}
+
+/*
+ * Entries already mapped by this process, by library path. A hit
+ * only needs a stat() to confirm the file is unchanged; the same
+ * libraries are looked up by the heuristics and the symbol resolver,
+ * and ecfsd workers pre-load the common ones.
+ */
+static hash_table_t *mapped;
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int symcache_lookup_mapped(const char *path, symcache_t *cache)
+{
+	unsigned long value;
+	symcache_t *c;
+	struct stat st;
+	int ret = -1;
+
+	pthread_mutex_lock(&mapped_lock);
+	if (mapped != NULL && hash_lookup(mapped, path, &value) && stat(path, &st) == 0) {
+		c = (symcache_t *)value;
+		if (c->hdr->dev == st.st_dev && c->hdr->ino == st.st_ino && c->hdr->size == st.st_size &&
+		    c->hdr->mtime_sec == st.st_mtim.tv_sec && c->hdr->mtime_nsec == st.st_mtim.tv_nsec) {
+			*cache = *c;
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&mapped_lock);
+	return ret;
+}
+
+static void symcache_remember(const char *path, symcache_t *cache)
+{
+	symcache_t *c = arena_alloc(sizeof(symcache_t));
+
+	*c = *cache;
+	pthread_mutex_lock(&mapped_lock);
+	if (mapped == NULL)
+		mapped = hash_create(64);
+	hash_insert(mapped, arena_strdup(path), (unsigned long)c, 1);
+	pthread_mutex_unlock(&mapped_lock);
+}
+
+int symcache_get(const char *path, symcache_t *cache)
+{
+	uint8_t build_id[SYMCACHE_MAX_BUILD_ID];
+	uint32_t build_id_len;
+	struct stat st;
+	char *cpath;
+	int fd, ret = -1;
+
+	if (symcache_lookup_mapped(path, cache) == 0)
+		return 0;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	build_id_len = read_build_id(fd, build_id);
+	cpath = symcache_path(&st);
+	if (symcache_map(cpath, &st, build_id, build_id_len, cache) == 0) {
+		ret = 0;
+		goto done;
+	}
+	if (access(ECFS_SYMCACHE_DIR, F_OK) != 0)
+		mkdir(ECFS_SYMCACHE_DIR, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+	if (symcache_build(fd, cpath, &st, build_id, build_id_len) == 0)
+		ret = symcache_map(cpath, &st, build_id, build_id_len, cache);
+#if DEBUG
+	log_msg(__LINE__, "symcache_get(): built cache entry %s for %s: %s", cpath, path, ret == 0 ? "ok" : "failed");
+#endif
+done:
+	close(fd);
+	free(cpath);
+	if (ret == 0)
+		symcache_remember(path, cache);
+	return ret;
+}
+
+static int prewarm_object(struct dl_phdr_info *info, size_t size, void *arg)
+{
+	char path[PATH_MAX];
+	symcache_t cache;
+
+	/*
+	 * Lookups come with the canonical path, as in /proc/pid/maps.
+	 */
+	if (info->dlpi_name != NULL && info->dlpi_name[0] == '/' && realpath(info->dlpi_name, path) != NULL)
+		symcache_get(path, &cache);
+	return 0;
+}
+
+void symcache_prewarm(void)
+{
+	dl_iterate_phdr(prewarm_object, NULL);
+}
@@ -26,6 +26,9 @@
 #include "../include/ecfs.h"
 #include "../include/util.h"
 #include "../include/list.h"
+#include "../include/hash.h"
+#include "../include/symcache.h"
+#include <pthread.h>
 
 /* 
  * Each library and its symbols are represented by an array
@@ -37,10 +40,33 @@
  * fgets	   pthread_mutext_lock
  * etc.		   etc.
  */
-static int resolve_symbols(list_t **list, const char *path, unsigned long base)
+/*
+ * Build the symvector straight from the persistent symbol cache;
+ * names point into the cache mapping rather than being duplicated.
+ */
+static symentry_t * load_symbols_cached(const char *path, unsigned long base, size_t *count, symcache_t *cache)
+{
+	symentry_t *symvector;
+	size_t i, symcount = cache->hdr->sym_count;
+
+	if (symcount == 0)
+		return NULL;
+	symvector = (symentry_t *)heapAlloc(symcount * sizeof(symentry_t));
+	symvector[0].count = symcount;
+	symvector[0].library = arena_strdup(strchr(path, '/') + 1);
+	for (i = 0; i < symcount; i++) {
+		symvector[i].value = cache->hdr->use_addend ? cache->syms[i].value + base : cache->syms[i].value;
+		symvector[i].size = cache->syms[i].size;
+		symvector[i].name = (char *)&cache->names[cache->syms[i].name];
+	}
+	*count = symcount;
+	return symvector;
+}
+
+static symentry_t * load_symbols(const char *path, unsigned long base, size_t *count)
 {
 	struct stat st;
-	int fd, ret;
+	int fd;
 	char use_addend = 0;
 	uint8_t *mem;
 	ElfW(Ehdr) *ehdr = NULL;
@@ -50,13 +76,18 @@ static int resolve_symbols(list_t **list, const char *path, unsigned long base)
 	char *StringTable = NULL, *dynstr = NULL;
 	size_t i, symcount =0;
 	symentry_t *symvector;
+	symcache_t cache;
+
+	if (opts.symcache && symcache_get(path, &cache) == 0)
+		return load_symbols_cached(path, base, count, &cache);
 
 	fd = xopen(path, O_RDONLY);
 	xfstat(fd, &st);
 	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
 	if (mem == MAP_FAILED) {
 		perror("mmap");
-		return -1;
+		return NULL;
 	} 
 	
 	ehdr = (ElfW(Ehdr) *)mem;	
@@ -81,22 +112,101 @@ static int resolve_symbols(list_t **list, const char *path, unsigned long base)
 			dynstr = (char *)&mem[shdr[i].sh_offset];
 	}
 
+	if (symtab == NULL || dynstr == NULL || symcount == 0) {
+		munmap(mem, st.st_size);
+		return NULL;
+	}
 	symvector = (symentry_t *)heapAlloc(symcount * sizeof(symentry_t));
 	
 	symvector[0].count = symcount;
-	symvector[0].library = xstrdup(strchr(path, '/') + 1);
+	symvector[0].library = arena_strdup(strchr(path, '/') + 1);
 
 	for (i = 0; i < symcount; i++) { 
 		symvector[i].value = use_addend ? (symtab[i].st_value + base) : symtab[i].st_value;
 		symvector[i].size = symtab[i].st_size;
-		symvector[i].name = xstrdup(&dynstr[symtab[i].st_name]);
+		symvector[i].name = arena_strdup(&dynstr[symtab[i].st_name]);
 	}
 	
-	ret = insert_item_front(&(*list), (void *)symvector, symcount * sizeof(symentry_t));	
-	
 	munmap(mem, st.st_size);
+	*count = symcount;
+	return symvector;
+}
+
+static int resolve_symbols(list_t **list, const char *path, unsigned long base)
+{
+	symentry_t *symvector;
+	size_t symcount;
+	int ret;
+
+	if ((symvector = load_symbols(path, base, &symcount)) == NULL)
+		return -1;
+	ret = insert_item_front(&(*list), (void *)symvector, symcount * sizeof(symentry_t));
+	free(symvector);
+	return ret;
+}
+
+/*
+ * Worker pool for resolving many libraries at once (opts.sym_threads).
+ * Every worker claims the next unresolved library, parses it into its
+ * own symvector, and stores it in the slot for that library. The slots
+ * are then inserted into the list in library order, so the list looks
+ * exactly like it does when resolving serially.
+ */
+struct symresolve_pool {
+	struct lib_mappings *lm;
+	symentry_t **vectors;
+	size_t *counts;
+	int next;
+};
+
+static void * symresolve_worker(void *arg)
+{
+	struct symresolve_pool *pool = arg;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->lm->libcount)
+		pool->vectors[i] = load_symbols(pool->lm->libs[i].path, pool->lm->libs[i].addr, &pool->counts[i]);
+	return NULL;
+}
+
+static int resolve_symbols_parallel(list_t **list, struct lib_mappings *lm, int nthreads)
+{
+	struct symresolve_pool pool;
+	pthread_t *threads;
+	int i, started, ret = -1;
+
+	pool.lm = lm;
+	pool.vectors = (symentry_t **)heapAlloc(lm->libcount * sizeof(symentry_t *));
+	pool.counts = (size_t *)heapAlloc(lm->libcount * sizeof(size_t));
+	pool.next = 0;
+	if (nthreads > lm->libcount)
+		nthreads = lm->libcount;
+	threads = (pthread_t *)heapAlloc(nthreads * sizeof(pthread_t));
+
+	for (started = 0; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, symresolve_worker, &pool) != 0) {
+			log_msg(__LINE__, "pthread_create %s", strerror(errno));
+			break;
+		}
+	}
+	/*
+	 * If we could not start any threads this thread does the work
+	 */
+	if (started == 0)
+		symresolve_worker(&pool);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < lm->libcount; i++) {
+		if (pool.vectors[i] == NULL)
+			continue;
+		ret = insert_item_front(&(*list), (void *)pool.vectors[i], pool.counts[i] * sizeof(symentry_t));
+		free(pool.vectors[i]);
+	}
+	free(threads);
+	free(pool.vectors);
+	free(pool.counts);
 	return ret;
-	
 }
 
 unsigned long lookup_from_symlist(const char *name, list_t *list)
@@ -116,8 +226,39 @@ unsigned long lookup_from_symlist(const char *name, list_t *list)
 
 
 
+/*
+ * Builds a hash index over every symbol in the list. Libraries are
+ * added tail first and a name is only added the first time it is seen,
+ * so lookups give exactly the same answer as lookup_from_symlist().
+ */
+hash_table_t * build_symbol_index(list_t *list)
+{
+	hash_table_t *index;
+	node_t *current;
+	symentry_t *symptr;
+	size_t i, total = 0;
+
+	for (current = list->tail; current != NULL; current = current->prev)
+		total += ((symentry_t *)current->data)[0].count;
+	index = hash_create(total);
+	for (current = list->tail; current != NULL; current = current->prev) {
+		symptr = (symentry_t *)current->data;
+		for (i = 0; i < symptr[0].count; i++)
+			hash_insert(index, symptr[i].name, symptr[i].value, 0);
+	}
+	return index;
+}
+
+unsigned long lookup_from_symindex(const char *name, hash_table_t *index)
+{
+	unsigned long value;
+
+	return hash_lookup(index, name, &value) ? value : 0;
+}
+
 int store_dynamic_symvals(list_t *list, const char *path)
 {	
+	hash_table_t *index;
         struct stat st;
         int fd;
         uint8_t *mem;
@@ -145,14 +286,18 @@ int store_dynamic_symvals(list_t *list, const char *path)
 			break;
 		}
 	}
+	index = build_symbol_index(list);
 	for (i = 0; i < ehdr->e_shnum; i++) {
 		if (!strcmp(&StringTable[shdr[i].sh_name], ".dynsym")) {
 			symtab = (ElfW(Sym) *)&mem[shdr[i].sh_offset];
 			symcount = shdr[i].sh_size / shdr[i].sh_entsize;
 			for (j = 0; j < symcount; j++) 
-				symtab[j].st_value = lookup_from_symlist((char *)&dynstr[symtab[j].st_name], list);
+				symtab[j].st_value = lookup_from_symindex((char *)&dynstr[symtab[j].st_name], index);
 		}
 	}
+	hash_destroy(index);
+	munmap(mem, st.st_size);
+	close(fd);
 	return 0;
 }
 	
@@ -168,6 +313,9 @@ int fill_dynamic_symtab(list_t **list, struct lib_mappings *lm)
 	(*list)->tail = NULL;
 	(*list)->head = NULL;
 	
+	if (opts.sym_threads > 1 && lm->libcount > 1)
+		return resolve_symbols_parallel(list, lm, opts.sym_threads);
+
 	/*
 	 * Resolve symbols for each shared library
 	 */
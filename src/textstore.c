@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2015, Ryan O'Neill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Content addressed store for shared library text images. With -t
+ * every ECFS file would otherwise carry its own copy of the text
+ * of libc and friends, which is identical across every crash on the
+ * same host. Each image is written once to ECFS_TEXTSTORE_DIR as
+ * <hash>-<len> and the ECFS file records a reference to it instead.
+ */
+
+#include "../include/ecfs.h"
+#include "../include/util.h"
+#include "../include/textstore.h"
+
+static int store_text_image(const char *dir, uint64_t hash, const uint8_t *image, size_t len)
+{
+	struct stat st;
+	char *path, *tmp;
+	size_t total = 0;
+	ssize_t n;
+	int fd;
+
+	path = xfmtstrdup("%s/%016lx-%lx", dir, (unsigned long)hash, (unsigned long)len);
+	if (stat(path, &st) == 0 && st.st_size == len) {
+		free(path);
+		return 0; // already in the store
+	}
+	/*
+	 * Write to a temporary name and rename it into place so
+	 * that readers (or concurrent captures) never see a partial
+	 * image.
+	 */
+	tmp = xfmtstrdup("%s/.%016lx.%d", dir, (unsigned long)hash, getpid());
+	fd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0) {
+		log_msg(__LINE__, "open %s: %s", tmp, strerror(errno));
+		goto fail;
+	}
+	while (total < len) {
+		n = write(fd, image + total, len - total);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_msg(__LINE__, "write %s", strerror(errno));
+			close(fd);
+			unlink(tmp);
+			goto fail;
+		}
+		total += n;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0) {
+		log_msg(__LINE__, "rename %s", strerror(errno));
+		unlink(tmp);
+		goto fail;
+	}
+	free(tmp);
+	free(path);
+	return 0;
+fail:
+	free(tmp);
+	free(path);
+	return -1;
+}
+
+int store_shlib_texts(memdesc_t *memdesc)
+{
+	mappings_t *maps = memdesc->maps;
+	uint64_t hash;
+	int i, stored = 0;
+
+	if (access(ECFS_TEXTSTORE_DIR, F_OK) != 0)
+		mkdir(ECFS_TEXTSTORE_DIR, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+
+	memdesc->textrefs = (ecfs_textref_t *)heapAlloc(sizeof(ecfs_textref_t) * (memdesc->mapcount + 1));
+	memdesc->textref_count = 0;
+	for (i = 0; i < memdesc->mapcount; i++) {
+		if (!maps[i].shlib || !(maps[i].p_flags & PF_X))
+			continue;
+		if (maps[i].text_image == NULL || maps[i].text_len <= 0)
+			continue;
+		hash = hash_bytes(maps[i].text_image, maps[i].text_len);
+		if (store_text_image(ECFS_TEXTSTORE_DIR, hash, maps[i].text_image, maps[i].text_len) < 0) {
+			/*
+			 * Leave the image in place; it will be merged
+			 * into the core like it would be without -d
+			 */
+			log_msg(__LINE__, "failed to store text of %s in %s", maps[i].filename, ECFS_TEXTSTORE_DIR);
+			continue;
+		}
+		memdesc->textrefs[memdesc->textref_count].hash = hash;
+		memdesc->textrefs[memdesc->textref_count].vaddr = maps[i].base;
+		memdesc->textrefs[memdesc->textref_count].len = maps[i].text_len;
+		memdesc->textref_count++;
+		munmap(maps[i].text_image, maps[i].text_len);
+		maps[i].text_image = NULL;
+		stored++;
+	}
+#if DEBUG
+	log_msg(__LINE__, "store_shlib_texts(): %d shlib texts referenced from %s", stored, ECFS_TEXTSTORE_DIR);
+#endif
+	return stored;
+}
@@ -25,6 +25,7 @@
 
 
 #include "../include/ecfs.h"
+#include "../include/stats.h"
 #include <syslog.h>
 
 struct opts opts;
@@ -33,6 +34,8 @@ void log_msg(unsigned int lineno, char *fmt, ...);
 
 void deliver_signal(int pid, int signo)
 {
+	if (opts.replay_dir != NULL)
+		return; // pid is just a name in the snapshot
 	kill(pid, signo);
 }
 
@@ -69,6 +72,96 @@ char * xfmtstrdup(char *fmt, ...)
         return s;
 }
 
+/*
+ * Bump allocator for the capture process. The capture makes a lot of
+ * small allocations (map filenames, symbol names, lib paths) that live
+ * until we exit, and it usually runs right after a crash when the host
+ * may be short on memory. So the whole arena is reserved and faulted in
+ * up front with MAP_POPULATE, handed out by bumping an offset (safe to
+ * call from the symbol resolver threads), and unmapped in one shot at
+ * exit. If it runs out we fall back to heapAlloc().
+ */
+static struct {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	size_t allocs;
+	size_t fallback;
+} arena;
+
+int arena_init(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+	if (p == MAP_FAILED) {
+		log_msg(__LINE__, "arena mmap %s", strerror(errno));
+		return -1;
+	}
+	arena.base = p;
+	arena.size = size;
+	arena.used = arena.allocs = arena.fallback = 0;
+	return 0;
+}
+
+/*
+ * Returns zeroed memory, like heapAlloc(). It must never be passed
+ * to free(); xfree() knows to leave it alone.
+ */
+void * arena_alloc(size_t len)
+{
+	size_t rlen = (len + 15) & ~(size_t)15, off;
+
+	if (arena.base != NULL) {
+		off = __atomic_fetch_add(&arena.used, rlen, __ATOMIC_RELAXED);
+		if (off + rlen <= arena.size) {
+			__atomic_fetch_add(&arena.allocs, 1, __ATOMIC_RELAXED);
+			return arena.base + off;
+		}
+		__atomic_fetch_sub(&arena.used, rlen, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&arena.fallback, len, __ATOMIC_RELAXED);
+	return heapAlloc(len);
+}
+
+char * arena_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p = arena_alloc(len);
+
+	memcpy(p, s, len);
+	return p;
+}
+
+char * arena_fmtstrdup(char *fmt, ...)
+{
+	char buf[512];
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+	return arena_strdup(buf);
+}
+
+int arena_owns(const void *p)
+{
+	return arena.base != NULL && (const uint8_t *)p >= arena.base &&
+	    (const uint8_t *)p < arena.base + arena.size;
+}
+
+void arena_stats(char *buf, size_t len)
+{
+	snprintf(buf, len, "arena: %zu of %zu KB used in %zu allocations, %zu bytes fell back to the heap",
+	    arena.used >> 10, arena.size >> 10, arena.allocs, arena.fallback);
+}
+
+void arena_destroy(void)
+{
+	if (arena.base == NULL)
+		return;
+	munmap(arena.base, arena.size);
+	arena.base = NULL;
+}
+
 int xopen(const char *path, int flags)
 {
 	int fd = open(path, flags);
@@ -102,7 +195,7 @@ int xfstat(int fd, struct stat *st)
 
 void xfree(void *p)
 {
-	if (p)
+	if (p && !arena_owns(p))
 		free(p);
 }
 
@@ -137,41 +230,242 @@ void log_msg(unsigned int lineno, char *fmt, ...)
 
 }
 
-int inquire_meminfo(void)
+/*
+ * Anonymous staging file for the core while it is merged and
+ * converted. It lives only as long as its fd, so concurrent workers
+ * can't collide and nothing is left behind if we die. memfd is
+ * shmem backed, which is what the tmpfs ramdisk used to provide;
+ * without it we fall back to an O_TMPFILE in ECFS_CORE_DIR.
+ */
+int ecfs_tmpfile(const char *name)
 {
-        FILE *fp;
-        char *s1 = alloca(64);
-        char *s2 = alloca(64);
-        size_t kbytes;
-        size_t gbytes;
+	int fd;
 
-        fp = fopen("/proc/meminfo", "r");
-        if (fp == NULL) {       
-                perror("fopen");
-                return -1;
-        }
-        fscanf(fp, "%s %u %s", s1, &kbytes, s2);
-        fclose(fp);
-        if (kbytes < 1048576)
-                return 0;
-        gbytes = kbytes / 1024 / 1024;
-        return gbytes;
+	fd = memfd_create(name, MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	if (fd < 0 && (errno == ENOSYS || errno == EINVAL))
+		fd = open(ECFS_CORE_DIR, O_TMPFILE|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if (fd < 0)
+		log_msg(__LINE__, "staging file %s: %s", name, strerror(errno));
+	return fd;
 }
 
-int create_tmp_ramdisk(size_t gigs)
+/*
+ * Seal a staging file once it is complete; later stages only read
+ * it (through private mappings) and write their result elsewhere.
+ * This is a no-op for the O_TMPFILE fallback.
+ */
+void ecfs_seal(int fd)
 {
-	int ret;
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL);
+}
 
-	if (access(ECFS_RAMDISK_DIR, F_OK) != 0) {
-#if DEBUG
-		log_msg(__LINE__, "%s did not exist, so creating it.");
+/*
+ * Ask for the largest pipe buffer we are allowed (see
+ * /proc/sys/fs/pipe-max-size) so that the kernel can stay
+ * ahead of us when writing the core out. Returns the new
+ * size of the pipe buffer, or -1 if fd is not a pipe.
+ */
+int grow_pipe_buffer(int fd)
+{
+	FILE *fp;
+	int max = 1024 * 1024, ret;
+
+	fp = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%d", &max) != 1)
+			max = 1024 * 1024;
+		fclose(fp);
+	}
+	ret = fcntl(fd, F_SETPIPE_SZ, max);
+	if (ret < 0)
+		ret = fcntl(fd, F_GETPIPE_SZ);
+	return ret;
+}
+
+/*
+ * Copy everything from the pipe 'in' to the file 'out' using
+ * splice() so that the pages never pass through userspace. If
+ * splice isn't supported (i.e. in is a regular file when testing
+ * with ecfs -p <pid> < corefile) we fall back to read()/write().
+ * Returns the number of bytes copied, or -1 on error.
+ */
+#define COPY_BUF_LEN (1024 * 1024)
+ssize_t splice_to_file(int in, int out)
+{
+	uint8_t *buf;
+	ssize_t n, bytes = 0;
+	int pipe_size;
+
+	pipe_size = grow_pipe_buffer(in);
+	if (pipe_size > 0) {
+		for (;;) {
+			n = splice(in, NULL, out, NULL, pipe_size, SPLICE_F_MOVE|SPLICE_F_MORE);
+			if (n == 0)
+				return bytes;
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EINVAL || errno == ENOSYS)
+					break; // nothing consumed; finish with read/write
+				log_msg(__LINE__, "splice %s", strerror(errno));
+				return -1;
+			}
+			bytes += n;
+			stats_add_io(n, n);
+		}
+	}
+	buf = HUGE_ALLOC(COPY_BUF_LEN);
+	while ((n = read(in, buf, COPY_BUF_LEN)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_msg(__LINE__, "read %s", strerror(errno));
+			bytes = -1;
+			break;
+		}
+		if (write(out, buf, n) != n) {
+			log_msg(__LINE__, "write %s", strerror(errno));
+			bytes = -1;
+			break;
+		}
+		bytes += n;
+	}
+	munmap(buf, COPY_BUF_LEN);
+	return bytes;
+}
+#undef COPY_BUF_LEN
+
+/*
+ * Returns 1 if the PAGE_SIZE bytes at p are all zero.
+ */
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static int is_zero_page(const uint8_t *p)
+{
+	__m128i acc = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i < PAGE_SIZE; i += 64) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 48)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			return 0;
+	}
+	return 1;
+}
+#else
+static int is_zero_page(const uint8_t *p)
+{
+	const uint64_t *q = (const uint64_t *)p;
+	uint64_t acc = 0;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 8) {
+		acc |= q[i] | q[i + 1] | q[i + 2] | q[i + 3] |
+		    q[i + 4] | q[i + 5] | q[i + 6] | q[i + 7];
+		if (acc)
+			return 0;
+	}
+	return 1;
+}
 #endif
-		mkdir(ECFS_RAMDISK_DIR, S_IRWXU|S_IRWXG);
+
+/*
+ * pwrite() that leaves a hole in place of every page aligned
+ * (with respect to the file offset) run of zero pages. This is
+ * only valid for regions of a file that have not been written to
+ * yet, i.e. a file opened with O_TRUNC, since holes read back as
+ * zero. The file is always extended to offset + len. Without
+ * opts.sparse this is a plain pwrite() that retries short writes.
+ */
+ssize_t sparse_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	const uint8_t *p = buf;
+	size_t pos = 0, start, skipped = 0;
+	ssize_t n;
+
+	while (pos < len) {
+		/*
+		 * Find the next run of data; everything up to the first
+		 * zero page that begins on a page boundary in the file.
+		 */
+		start = pos;
+		if (!opts.sparse)
+			pos = len;
+		while (pos < len) {
+			if (((offset + pos) & (PAGE_SIZE - 1)) == 0 && len - pos >= PAGE_SIZE &&
+			    is_zero_page(p + pos))
+				break;
+			pos += ((offset + pos) & (PAGE_SIZE - 1)) ? PAGE_SIZE - ((offset + pos) & (PAGE_SIZE - 1)) : PAGE_SIZE;
+			if (pos > len)
+				pos = len;
+		}
+		while (start < pos) {
+			n = pwrite(fd, p + start, pos - start, offset + start);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			start += n;
+		}
+		while (opts.sparse && pos + PAGE_SIZE <= len && is_zero_page(p + pos)) {
+			pos += PAGE_SIZE;
+			skipped += PAGE_SIZE;
+		}
+	}
+	/*
+	 * If we ended on a hole make sure the file is still
+	 * extended to cover it.
+	 */
+	if (len > 0 && pos == len && skipped > 0) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size < offset + (off_t)len)
+			if (ftruncate(fd, offset + len) < 0)
+				return -1;
 	}
+#if DEBUG
+	if (skipped)
+		log_msg(__LINE__, "sparse_pwrite(): left %lu bytes of zero pages as holes", (unsigned long)skipped);
+#endif
+	return len;
+}
 
-	char *cmd = xfmtstrdup("mount -o size=%dG -t tmpfs none %s", gigs, ECFS_RAMDISK_DIR);
-	ret = system(cmd);
-	if (ret == -1)
-		return -1;
-	return 0;
+/*
+ * Fast 64bit hash of a buffer (murmur3 style mixing over
+ * 8 byte words). Not cryptographic; used for content addressing.
+ */
+static inline uint64_t hash_mix(uint64_t k)
+{
+	k *= 0x87c37b91114253d5ULL;
+	k = (k << 31) | (k >> 33);
+	k *= 0x4cf5ad432745937fULL;
+	return k;
+}
+
+uint64_t hash_bytes(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, k;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&k, p + i, 8);
+		h ^= hash_mix(k);
+		h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+	}
+	if (i < len) {
+		k = 0;
+		memcpy(&k, p + i, len - i);
+		h ^= hash_mix(k);
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
 }